@@ -8,12 +8,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
-#include <errno.h>
 #include <limits.h>
 #include <string.h>
-#include <math.h>
 
 #include "ccronexpr.h"
+#include "ccronexpr_alloc.h"
+#include "ccronexpr_internal.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+#include <intrin.h>
+#endif
 
 #define CRON_MAX_SECONDS 60
 #define CRON_MAX_MINUTES 60
@@ -32,107 +36,262 @@
 
 #define CRON_CF_ARR_LEN 7
 
+/* number of fields in the expression */
+#define CRON_FIELDS_COUNT 6
+
 #define CRON_INVALID_INSTANT ((time_t) -1)
 
-static const char* DAYS_ARR[] = {"SUN", "MON", "TUE", "WED", "THU", "FRI", "SAT"};
-#define CRON_DAYS_ARR_LEN 7
-static const char* MONTHS_ARR[] = {"FOO", "JAN", "FEB", "MAR", "APR", "MAY", "JUN", "JUL", "AUG", "SEP", "OCT", "NOV", "DEC"};
-#define CRON_MONTHS_ARR_LEN 13
-
-#define CRON_MAX_STR_LEN_TO_SPLIT 256
-#define CRON_MAX_NUM_TO_SRING 1000000000
-/* computes number of digits in decimal number */
-#define CRON_NUM_OF_DIGITS(num) (abs(num) < 10 ? 1 : \
-                                (abs(num) < 100 ? 2 : \
-                                (abs(num) < 1000 ? 3 : \
-                                (abs(num) < 10000 ? 4 : \
-                                (abs(num) < 100000 ? 5 : \
-                                (abs(num) < 1000000 ? 6 : \
-                                (abs(num) < 10000000 ? 7 : \
-                                (abs(num) < 100000000 ? 8 : \
-                                (abs(num) < 1000000000 ? 9 : 10)))))))))
+#define CRON_MAX_STR_LEN 256
 
 /* ESP and AVR boards provide gmtime() instead of timegm() */
 #if defined(ESP8266) || defined(__AVR__) || defined (ARDUINO_ARCH_NRF52)
 #define CRON_USE_LOCAL_TIME
+/* time zone files are loaded from memory only */
+#define CRON_NO_FILE_IO
 #endif 
 
+#define CRON_MIN_YEAR 1
+#define CRON_MAX_YEAR 9999
+
+/*
+ * Civil calendar arithmetic for the proleptic Gregorian calendar,
+ * see http://howardhinnant.github.io/date_algorithms.html
+ */
+
+/* number of days since 1970-01-01 for the specified date, month is 1-12 */
+static long days_from_civil(long year, unsigned int month, unsigned int day) {
+    long era;
+    unsigned long yoe;
+    unsigned long doy;
+    unsigned long doe;
+    year -= month <= 2;
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = (unsigned long) (year - era * 400);
+    doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (long) doe - 719468;
+}
+
+/* inverse of 'days_from_civil', month is 1-12 */
+static void civil_from_days(long days, long* year, unsigned int* month, unsigned int* day) {
+    long era;
+    unsigned long doe;
+    unsigned long yoe;
+    unsigned long doy;
+    unsigned long mp;
+    days += 719468;
+    era = (days >= 0 ? days : days - 146096) / 146097;
+    doe = (unsigned long) (days - era * 146097);
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    *day = (unsigned int) (doy - (153 * mp + 2) / 5 + 1);
+    *month = (unsigned int) (mp < 10 ? mp + 3 : mp - 9);
+    *year = (long) yoe + era * 400 + (*month <= 2);
+}
+
+static int is_leap_year(long year) {
+    return (0 == year % 4 && 0 != year % 100) || 0 == year % 400;
+}
+
+/* number of days in month, month is 0-11 */
+static int days_in_month(long year, int month) {
+    static const int DAYS[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    if (1 == month && is_leap_year(year)) {
+        return 29;
+    }
+    return DAYS[month];
+}
+
+/* day of week (Sunday is 0) for the number of days since 1970-01-01 (Thursday) */
+static int weekday_from_days(long days) {
+    return (int) (days >= -4 ? (days + 4) % 7 : (days + 5) % 7 + 6);
+}
+
+/* moves the overflow of 'value' out of the range [0, size) into the returned carry */
+static int carry_over(int* value, int size) {
+    int carry = *value / size;
+    *value %= size;
+    if (*value < 0) {
+        *value += size;
+        carry -= 1;
+    }
+    return carry;
+}
+
+/**
+ * Normalizes calendar fields after modification the same way 'timegm' does
+ * (carrying out of range seconds into minutes, days into months etc.)
+ * and updates the day of week and day of year, without any time_t conversion.
+ */
+static int cron_normalize(struct tm* calendar) {
+    long days;
+    long year;
+    unsigned int month;
+    unsigned int day;
+    calendar->tm_min += carry_over(&calendar->tm_sec, 60);
+    calendar->tm_hour += carry_over(&calendar->tm_min, 60);
+    days = carry_over(&calendar->tm_hour, 24);
+    calendar->tm_year += carry_over(&calendar->tm_mon, 12);
+    if (calendar->tm_year + 1900 < CRON_MIN_YEAR || calendar->tm_year + 1900 > CRON_MAX_YEAR) {
+        return 1;
+    }
+    days += days_from_civil(calendar->tm_year + 1900L, calendar->tm_mon + 1, 1) + calendar->tm_mday - 1;
+    civil_from_days(days, &year, &month, &day);
+    if (year < CRON_MIN_YEAR || year > CRON_MAX_YEAR) {
+        return 1;
+    }
+    calendar->tm_year = (int) (year - 1900);
+    calendar->tm_mon = (int) month - 1;
+    calendar->tm_mday = (int) day;
+    calendar->tm_wday = weekday_from_days(days);
+    calendar->tm_yday = (int) (days - days_from_civil(year, 1, 1));
+    return 0;
+}
+
+/* seconds since epoch of the normalized calendar taken as UTC */
+static int64_t calendar_to_seconds(const struct tm* calendar) {
+    return (int64_t) days_from_civil(calendar->tm_year + 1900L, calendar->tm_mon + 1, calendar->tm_mday) * 86400 +
+            calendar->tm_hour * 3600 + calendar->tm_min * 60 + calendar->tm_sec;
+}
+
+/* UTC calendar of the seconds since epoch, NULL is returned if the year is out of range */
+static struct tm* seconds_to_calendar(int64_t seconds, struct tm* out) {
+    long days = (long) (seconds / 86400);
+    long secs = (long) (seconds % 86400);
+    long year;
+    unsigned int month;
+    unsigned int day;
+    if (secs < 0) {
+        secs += 86400;
+        days -= 1;
+    }
+    civil_from_days(days, &year, &month, &day);
+    if (year < CRON_MIN_YEAR || year > CRON_MAX_YEAR) {
+        return NULL;
+    }
+    memset(out, 0, sizeof(struct tm));
+    out->tm_year = (int) (year - 1900);
+    out->tm_mon = (int) month - 1;
+    out->tm_mday = (int) day;
+    out->tm_hour = (int) (secs / 3600);
+    out->tm_min = (int) (secs / 60 % 60);
+    out->tm_sec = (int) (secs % 60);
+    out->tm_wday = weekday_from_days(days);
+    out->tm_yday = (int) (days - days_from_civil(year, 1, 1));
+    return out;
+}
+
+/* converts seconds since epoch to time_t, that may be 32-bit */
+static time_t seconds_to_time(int64_t seconds) {
+    if ((int64_t) (time_t) seconds != seconds) {
+        return CRON_INVALID_INSTANT;
+    }
+    return (time_t) seconds;
+}
+
 /* Defining 'cron_mktime' to use use UTC (default) or local time */
 #ifndef CRON_USE_LOCAL_TIME
 
-/* http://stackoverflow.com/a/22557778 */
-    #ifdef _WIN32
-static time_t cron_mktime(struct tm* tm) {
-    return _mkgmtime(tm);
-}
-    #else /* _WIN32 */
-        #ifndef ANDROID
-/* can be hidden in time.h */
-time_t timegm(struct tm* __tp);
-        #endif /* ANDROID */
-static time_t cron_mktime(struct tm* tm) {
-        #ifndef ANDROID
-    return timegm(tm);    
-        #else /* ANDROID */
-    /* https://github.com/adobe/chromium/blob/cfe5bf0b51b1f6b9fe239c2a3c2f2364da9967d7/base/os_compat_android.cc#L20 */
-    static const time_t kTimeMax = ~(1L << (sizeof (time_t) * CHAR_BIT - 1));
-    static const time_t kTimeMin = (1L << (sizeof (time_t) * CHAR_BIT - 1));
-    time64_t result = timegm64(tm);
-    if (result < kTimeMin || result > kTimeMax)
-        return -1;
-    return result;
-        #endif /* ANDROID */
+static time_t cron_mktime(struct tm* calendar) {
+    /* calendar is always kept normalized by the field operations */
+    return seconds_to_time(calendar_to_seconds(calendar));
 }
-    #endif /* _WIN32 */
 
-static struct tm* cron_time(time_t* date) {
-    return gmtime(date);
+static struct tm* cron_time(time_t* date, struct tm* out) {
+    return seconds_to_calendar((int64_t) *date, out);
 }
 
 #else /* CRON_USE_LOCAL_TIME */
 
-static time_t cron_mktime(struct tm* tm) {
-    return mktime(tm);
+static time_t cron_mktime(struct tm* calendar) {
+    /* calendar fields were moved arithmetically so DST flag may be outdated */
+    calendar->tm_isdst = -1;
+    return mktime(calendar);
 }
 
-static struct tm* cron_time(time_t* date) {
-    return localtime(date);
+    #ifdef _WIN32
+static struct tm* cron_time(time_t* date, struct tm* out) {
+    return 0 == localtime_s(out, date) ? out : NULL;
+}
+    #else /* _WIN32 */
+/* can be hidden in time.h */
+struct tm* localtime_r(const time_t* timep, struct tm* result);
+static struct tm* cron_time(time_t* date, struct tm* out) {
+    return localtime_r(date, out);
 }
+    #endif /* _WIN32 */
 
 #endif /* CRON_USE_LOCAL_TIME */
 
-static void free_splitted(char** splitted, size_t len) {
-    size_t i;
-    if(!splitted) return;
-    for(i = 0; i < len; i++) {
-        if (splitted[i]) {
-            free(splitted[i]);
-        }
-    }  
-    free(splitted);
+static int calendars_equal(struct tm* cal1, struct tm* cal2) {
+    return cal1->tm_sec == cal2->tm_sec &&
+            cal1->tm_min == cal2->tm_min &&
+            cal1->tm_hour == cal2->tm_hour &&
+            cal1->tm_mday == cal2->tm_mday &&
+            cal1->tm_mon == cal2->tm_mon &&
+            cal1->tm_year == cal2->tm_year;
 }
 
-static char* strdupl(const char* str, size_t len) {
-    if (!str) return NULL;
-    char* res = (char*) malloc(len + 1);
-    if (!res) return NULL;
-    memset(res, 0, len + 1);
-    memcpy(res, str, len);
-    return res;
+#define CRON_BIT(n) (((uint64_t) 1) << (n))
+/* bits 0, 7, 14, 21, 28 and 35, repeats a 7-bit set of week days 6 times */
+#define CRON_WEEK_REPEAT ((((uint64_t) 0x81020408u) << 4) | 1)
+
+/* number of leading zero bits, 'bits' must not be zero */
+static unsigned int clz64(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned int) __builtin_clzll(bits);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    unsigned long idx;
+    _BitScanReverse64(&idx, bits);
+    return 63 - (unsigned int) idx;
+#else
+    unsigned int n = 0;
+    if (!(bits & 0xFFFFFFFF00000000u)) { n += 32; bits <<= 32; }
+    if (!(bits & 0xFFFF000000000000u)) { n += 16; bits <<= 16; }
+    if (!(bits & 0xFF00000000000000u)) { n += 8; bits <<= 8; }
+    if (!(bits & 0xF000000000000000u)) { n += 4; bits <<= 4; }
+    if (!(bits & 0xC000000000000000u)) { n += 2; bits <<= 2; }
+    if (!(bits & 0x8000000000000000u)) { n += 1; }
+    return n;
+#endif
 }
 
+#ifndef CRON_USE_LOCAL_TIME
+/* number of set bits */
+static unsigned int popcount64(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned int) __builtin_popcountll(bits);
+#else
+    bits = bits - ((bits >> 1) & 0x5555555555555555ULL);
+    bits = (bits & 0x3333333333333333ULL) + ((bits >> 2) & 0x3333333333333333ULL);
+    bits = (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (unsigned int) ((bits * 0x0101010101010101ULL) >> 56);
+#endif
+}
+#endif /* CRON_USE_LOCAL_TIME */
 
-static unsigned int next_set_bit(char* bits, unsigned int max, unsigned int from_index, int* notfound) {    
-    unsigned int i;
-    if (!bits) {
+static unsigned int next_set_bit(uint64_t bits, unsigned int max, unsigned int from_index, int* notfound) {
+    uint64_t rest;
+    if (from_index >= max) {
         *notfound = 1;
         return 0;
     }
-    for (i = from_index; i < max; i++) {
-        if (bits[i]) return i;
+    rest = bits >> from_index;
+    if (!rest) {
+        *notfound = 1;
+        return 0;
     }
-    *notfound = 1;
-    return 0;
+    return from_index + ctz64(rest);
+}
+
+static unsigned int prev_set_bit(uint64_t bits, unsigned int from_index, int* notfound) {
+    uint64_t rest = bits & (CRON_BIT(from_index) | (CRON_BIT(from_index) - 1));
+    if (!rest) {
+        *notfound = 1;
+        return 0;
+    }
+    return 63 - clz64(rest);
 }
 
 static void push_to_fields_arr(int* arr, int fi) {
@@ -151,6 +310,20 @@ static void push_to_fields_arr(int* arr, int fi) {
     }
 }
 
+/**
+ * Normalizes the calendar after the specified field was modified, changes of
+ * the time of day that do not overflow into the next day need no calendar arithmetic.
+ */
+static int normalize_field(struct tm* calendar, int field) {
+    if (field <= CRON_CF_HOUR_OF_DAY &&
+            calendar->tm_sec >= 0 && calendar->tm_sec < CRON_MAX_SECONDS &&
+            calendar->tm_min >= 0 && calendar->tm_min < CRON_MAX_MINUTES &&
+            calendar->tm_hour >= 0 && calendar->tm_hour < CRON_MAX_HOURS) {
+        return 0;
+    }
+    return cron_normalize(calendar);
+}
+
 static int add_to_field(struct tm* calendar, int field, int val) {
     if (!calendar || -1 == field) {
         return 1;
@@ -159,17 +332,13 @@ static int add_to_field(struct tm* calendar, int field, int val) {
     case CRON_CF_SECOND: calendar->tm_sec = calendar->tm_sec + val; break;
     case CRON_CF_MINUTE: calendar->tm_min = calendar->tm_min + val; break;
     case CRON_CF_HOUR_OF_DAY: calendar->tm_hour = calendar->tm_hour + val; break;
-    case CRON_CF_DAY_OF_WEEK: /* mkgmtime ignores this field */
+    case CRON_CF_DAY_OF_WEEK: /* normalization ignores this field */
     case CRON_CF_DAY_OF_MONTH: calendar->tm_mday = calendar->tm_mday + val; break;
     case CRON_CF_MONTH: calendar->tm_mon = calendar->tm_mon + val; break;
     case CRON_CF_YEAR: calendar->tm_year = calendar->tm_year + val; break;
     default: return 1; /* unknown field */
     }
-    time_t res = cron_mktime(calendar);
-    if (CRON_INVALID_INSTANT == res) {
-        return 1;
-    }
-    return 0;
+    return normalize_field(calendar, field);
 }
 
 /**
@@ -189,11 +358,7 @@ static int reset(struct tm* calendar, int field) {
     case CRON_CF_YEAR: calendar->tm_year = 0; break;
     default: return 1; /* unknown field */
     }
-    time_t res = cron_mktime(calendar);
-    if (CRON_INVALID_INSTANT == res) {
-        return 1;
-    }
-    return 0;
+    return normalize_field(calendar, field);
 }
 
 static int reset_all(struct tm* calendar, int* fields) {
@@ -225,11 +390,7 @@ static int set_field(struct tm* calendar, int field, int val) {
     case CRON_CF_YEAR: calendar->tm_year = val; break;
     default: return 1; /* unknown field */
     }
-    time_t res = cron_mktime(calendar);
-    if (CRON_INVALID_INSTANT == res) {
-        return 1;
-    }
-    return 0;
+    return normalize_field(calendar, field);
 }
 
 
@@ -237,7 +398,7 @@ static int set_field(struct tm* calendar, int field, int val) {
  * Search the bits provided for the next set bit after the value provided,
  * and reset the calendar.
  */
-static unsigned int find_next(char* bits, unsigned int max, unsigned int value, struct tm* calendar, 
+static unsigned int find_next(uint64_t bits, unsigned int max, unsigned int value, struct tm* calendar, 
         unsigned int field, unsigned int nextField, int* lower_orders, int* res_out) {
     int notfound = 0;
     int err = 0;
@@ -252,10 +413,11 @@ static unsigned int find_next(char* bits, unsigned int max, unsigned int value,
         next_value = next_set_bit(bits, max, 0, &notfound);
     }
     if (notfound || next_value != value) {
-        err = set_field(calendar, field, next_value);
-        if (err) goto return_error;
+        /* lower orders are reset first, so the day of month cannot overflow the new month */
         err = reset_all(calendar, lower_orders);
         if (err) goto return_error;
+        err = set_field(calendar, field, next_value);
+        if (err) goto return_error;
     }
     return next_value;
     
@@ -264,58 +426,283 @@ static unsigned int find_next(char* bits, unsigned int max, unsigned int value,
         return 0;
 }
 
-static unsigned int find_next_day(struct tm* calendar, char* days_of_month,
-        unsigned int day_of_month, char* days_of_week, unsigned int day_of_week,
-        int* resets, int* res_out) {
+/* 'nearest_weekday' value of 'LW' */
+#define CRON_LAST_WEEKDAY 32
+
+/* field without values, such expression never fires (the parser does not
+   produce them, but fields can be set by client or read from a record) */
+static int has_empty_field(const cron_expr* expr) {
+    return !expr->seconds || !expr->minutes || !expr->hours || !expr->months ||
+            (!has_day_items(expr) && (!expr->days_of_month || !expr->days_of_week));
+}
+
+/* number of years of the year field after its first one, including it */
+#define CRON_YEARS_SPAN 128
+
+/* whether the year matches the optional year field */
+static int year_matches(const cron_expr* expr, long year) {
+    long offset = year - (long) expr->year_first;
+    if (0 == expr->year_first) return 1;
+    return offset >= 0 && offset < CRON_YEARS_SPAN && ((expr->years[offset / 64] >> (offset % 64)) & 1);
+}
+
+/**
+ * Finds the nearest year of the year field starting from the specified year and moving
+ * by 'step' (1 or -1) years, the excluded years are skipped a word of the bit set at a time.
+ * Returns 0 if there is no such year in the supported range.
+ */
+static long next_field_year(const cron_expr* expr, long year, int step) {
+    long offset;
+    int notfound;
+    unsigned int bit;
+    if (year < CRON_MIN_YEAR || year > CRON_MAX_YEAR) return 0;
+    if (0 == expr->year_first) return year;
+    offset = year - (long) expr->year_first;
+    if (step > 0) {
+        for (offset = offset < 0 ? 0 : offset; offset < CRON_YEARS_SPAN; offset += 64 - offset % 64) {
+            notfound = 0;
+            bit = next_set_bit(expr->years[offset / 64], 64, (unsigned int) (offset % 64), &notfound);
+            if (!notfound) {
+                year = (long) expr->year_first + offset - offset % 64 + (long) bit;
+                return year <= CRON_MAX_YEAR ? year : 0;
+            }
+        }
+    } else {
+        for (offset = offset < CRON_YEARS_SPAN ? offset : CRON_YEARS_SPAN - 1; offset >= 0; offset -= offset % 64 + 1) {
+            notfound = 0;
+            bit = prev_set_bit(expr->years[offset / 64], (unsigned int) (offset % 64), &notfound);
+            if (!notfound) {
+                year = (long) expr->year_first + offset - offset % 64 + (long) bit;
+                return year <= CRON_MAX_YEAR ? year : 0;
+            }
+        }
+    }
+    return 0;
+}
+
+/* bit set of the days of the month matching 'L', 'L-n', 'nW' and 'LW' items */
+static uint32_t day_of_month_items(const cron_expr* expr, int first_wday, int length) {
+    uint32_t days = 0;
+    if (expr->last_day_of_month && expr->last_day_of_month <= length) {
+        days |= (uint32_t) CRON_BIT(length + 1 - expr->last_day_of_month);
+    }
+    /* days missing in the month (like '31W' in April) do not match */
+    if (expr->nearest_weekday && (CRON_LAST_WEEKDAY == expr->nearest_weekday || expr->nearest_weekday <= length)) {
+        int day = CRON_LAST_WEEKDAY == expr->nearest_weekday ? length : expr->nearest_weekday;
+        int wday = (first_wday + day - 1) % 7;
+        /* weekend days move to the nearest weekday in the same month */
+        if (6 == wday) {
+            day = 1 == day ? day + 2 : day - 1;
+        } else if (0 == wday) {
+            day = length == day ? day - 2 : day + 1;
+        }
+        days |= (uint32_t) CRON_BIT(day);
+    }
+    return days;
+}
+
+/* bit set of the days of the month matching 'dL' and 'd#n' items */
+static uint32_t day_of_week_items(const cron_expr* expr, int first_wday, int length) {
+    uint32_t days = 0;
+    unsigned int last = expr->last_days_of_week;
+    int last_wday = (first_wday + length - 1) % 7;
+    while (last) {
+        int wday = (int) ctz64(last);
+        days |= (uint32_t) CRON_BIT(length - (last_wday - wday + 7) % 7);
+        last &= last - 1;
+    }
+    if (expr->nth_day_of_week) {
+        int wday = expr->nth_day_of_week & 7;
+        int day = 1 + (wday - first_wday + 7) % 7 + 7 * ((expr->nth_day_of_week >> 3) - 1);
+        if (day <= length) {
+            days |= (uint32_t) CRON_BIT(day);
+        }
+    }
+    return days;
+}
+
+/**
+ * Bit set of the days of the month matching the day of month and day of week fields,
+ * for the month of the specified length starting at the specified day of week.
+ */
+static uint32_t month_matching_days(const cron_expr* expr, int first_wday, int length) {
+    /* days of week repeated 6 times, so that bit N is set when the N-th day after
+       a Sunday matches, then shifted to start at the week day of the 1st */
+    uint64_t week_days = ((uint64_t) expr->days_of_week * CRON_WEEK_REPEAT) >> first_wday;
+    uint32_t month_days = (uint32_t) ((CRON_BIT(length) - 1) << 1);
+    uint32_t days_of_month = expr->days_of_month;
+    uint32_t days_of_week = (uint32_t) (week_days << 1);
+    if (has_day_items(expr)) {
+        days_of_month |= day_of_month_items(expr, first_wday, length);
+        days_of_week |= day_of_week_items(expr, first_wday, length);
+    }
+    return days_of_month & days_of_week & month_days;
+}
+
+/* whether the day of the calendar matches the day of month, day of week, month and year fields */
+static int calendar_day_matches(const cron_expr* expr, const struct tm* calendar) {
+    if (!(expr->months & CRON_BIT(calendar->tm_mon)) || !year_matches(expr, calendar->tm_year + 1900L)) return 0;
+    if (has_day_items(expr)) {
+        int first_wday = (calendar->tm_wday - (calendar->tm_mday - 1) % 7 + 7) % 7;
+        uint32_t days = month_matching_days(expr, first_wday, days_in_month(calendar->tm_year + 1900L, calendar->tm_mon));
+        return (int) ((days >> calendar->tm_mday) & 1);
+    }
+    return (int) ((expr->days_of_month >> calendar->tm_mday) & (expr->days_of_week >> calendar->tm_wday) & 1);
+}
+
+/**
+ * Bit set of the days of the month matching the day of month, day of week,
+ * month and year fields, the bit of the day N is set when the day matches.
+ */
+static uint32_t matching_days(const cron_expr* expr, long year, int month) {
+    if (!(expr->months & CRON_BIT(month)) || !year_matches(expr, year)) {
+        return 0;
+    }
+    return month_matching_days(expr, weekday_from_days(days_from_civil(year, month + 1, 1)), days_in_month(year, month));
+}
+
+/*
+ * The Gregorian calendar repeats every 400 years (146097 days, a whole number of weeks),
+ * and the days of a year depend only on whether it is a leap year and on the day of week
+ * of January 1st. There are 14 such year types, so whether a year has a matching day is
+ * looked up by its type, and any type that occurs at all occurs in any 400 consecutive years.
+ */
+#define CRON_YEAR_TYPES 14
+#define CRON_CALENDAR_CYCLE_YEARS 400
+
+/* type of the year: day of week of January 1st, plus 7 for leap years */
+static int year_type(long year) {
+    return weekday_from_days(days_from_civil(year, 1, 1)) + (is_leap_year(year) ? 7 : 0);
+}
+
+/* bit set of the year types that have at least one matching day */
+static uint32_t matching_year_types(const cron_expr* expr) {
+    uint32_t types = 0;
+    int type;
+    int month;
+    for (type = 0; type < CRON_YEAR_TYPES; type++) {
+        /* 2000 is a leap year, 2001 is not */
+        long year = type >= 7 ? 2000 : 2001;
+        int first_wday = type % 7;
+        for (month = 0; month < CRON_MAX_MONTHS; month++) {
+            if ((expr->months & CRON_BIT(month)) && month_matching_days(expr, first_wday, days_in_month(year, month))) {
+                types |= (uint32_t) CRON_BIT(type);
+                break;
+            }
+            first_wday = (first_wday + days_in_month(year, month)) % 7;
+        }
+    }
+    return types;
+}
+
+/**
+ * Finds the nearest year with a matching day, starting from the specified year and moving
+ * by 'step' (1 or -1) years. Only the years of the year field are checked and at most 400
+ * of them, returns 0 if there is no such year in the supported range.
+ */
+static long find_matching_year(const cron_expr* expr, long year, int step) {
+    uint32_t types = matching_year_types(expr);
+    int i;
+    if (!types) return 0;
+    for (i = 0; i < CRON_CALENDAR_CYCLE_YEARS; i++) {
+        year = next_field_year(expr, year, step);
+        if (0 == year) return 0;
+        if (types & CRON_BIT(year_type(year))) return year;
+        year += step;
+    }
+    return 0;
+}
+
+/**
+ * Move the calendar to the next day matching the day of month, day of week,
+ * month and year fields, looking up the matching days of a whole month at once,
+ * returns the number of days moved. Years excluded by the year field are skipped
+ * without looking at their months. If the rest of the year and the next year have no
+ * matching day, the next year with one is found by its type (see 'find_matching_year'),
+ * so at most 24 months, 400 years and 12 more months are checked.
+ */
+static unsigned int find_next_day(const cron_expr* expr, struct tm* calendar, int* resets, int* res_out) {
+    long year = calendar->tm_year + 1900L;
+    int month = calendar->tm_mon;
+    unsigned int day = (unsigned int) calendar->tm_mday;
+    long start;
+    int notfound = 0;
+    int wraps = 0;
     int err;
-    unsigned int count = 0;
-    unsigned int max = 366;
-    while ((!days_of_month[day_of_month] || !days_of_week[day_of_week]) && count++ < max) {
-        err = add_to_field(calendar, CRON_CF_DAY_OF_MONTH, 1);
-        if (err) goto return_error;
-        day_of_month = calendar->tm_mday;
-        day_of_week = calendar->tm_wday;
-        reset_all(calendar, resets);
+    if (calendar_day_matches(expr, calendar)) {
+        return 0;
+    }
+    start = days_from_civil(year, month + 1, day);
+    if (!year_matches(expr, year)) {
+        year = next_field_year(expr, year + 1, 1);
+        if (0 == year) goto return_error;
+        month = 0;
+        day = 1;
+    }
+    for (;;) {
+        notfound = 0;
+        day = next_set_bit(matching_days(expr, year, month), CRON_MAX_DAYS_OF_MONTH, day, &notfound);
+        if (!notfound) break;
+        /* continue from the 1st of the next month */
+        day = 1;
+        month += 1;
+        if (CRON_MAX_MONTHS == month) {
+            /* the next year is checked month by month, after it the year
+               found has a matching day, the search stops in it */
+            year = 0 == wraps++ ? next_field_year(expr, year + 1, 1) : find_matching_year(expr, year + 1, 1);
+            if (0 == year) goto return_error;
+            month = 0;
+        }
     }
-    return day_of_month;
+    calendar->tm_year = (int) (year - 1900);
+    calendar->tm_mon = month;
+    calendar->tm_mday = (int) day;
+    err = cron_normalize(calendar);
+    if (err) goto return_error;
+    err = reset_all(calendar, resets);
+    if (err) goto return_error;
+    return (unsigned int) (days_from_civil(year, month + 1, day) - start);
 
     return_error:
         *res_out = 1;
         return 0;
 }
 
-static int do_next(cron_expr* expr, struct tm* calendar, unsigned int dot) {
+/**
+ * Moves the calendar to the next date matching the expression, not before it.
+ * The search is bounded: a level recurses only after it moved a field forward,
+ * the time of day can roll over to the next day once, then the day search moves
+ * to a matching day directly (see 'find_next_day') where the time fields start
+ * from midnight and the time of day is found without moving the day again.
+ * That is at most 8 levels of recursion and one day search that moves the day.
+ */
+static int do_next(const cron_expr* expr, struct tm* calendar) {
     int i;
     int res = 0;
-    int* resets = NULL;
-    int* empty_list = NULL;
+    int resets[CRON_CF_ARR_LEN];
+    int empty_list[CRON_CF_ARR_LEN];
     unsigned int second = 0;
-    unsigned int update_second = 0;
     unsigned int minute = 0;
     unsigned int update_minute = 0;
     unsigned int hour = 0;
     unsigned int update_hour = 0;
-    unsigned int day_of_week = 0;
-    unsigned int day_of_month = 0;
-    unsigned int update_day_of_month = 0;
+    unsigned int days_moved = 0;
     unsigned int month = 0;
     unsigned int update_month = 0;
     
-    resets = (int*) malloc(CRON_CF_ARR_LEN * sizeof (int));
-    if (!resets) goto return_result;
-    empty_list = (int*) malloc(CRON_CF_ARR_LEN * sizeof (int));
-    if (!empty_list) goto return_result;
+    /* the search would move to the next minute, hour or day forever */
+    if (has_empty_field(expr)) return 1;
     for (i = 0; i < CRON_CF_ARR_LEN; i++) {
         resets[i] = -1;
         empty_list[i] = -1;
     }
 
     second = calendar->tm_sec;
-    update_second = find_next(expr->seconds, CRON_MAX_SECONDS, second, calendar, CRON_CF_SECOND, CRON_CF_MINUTE, empty_list, &res);
+    find_next(expr->seconds, CRON_MAX_SECONDS, second, calendar, CRON_CF_SECOND, CRON_CF_MINUTE, empty_list, &res);
     if (0 != res) goto return_result;
-    if (second == update_second) {
-        push_to_fields_arr(resets, CRON_CF_SECOND);
-    }
+    /* seconds are not searched again by a recursive call, so they must be reset
+       even if they were moved, when any of the higher order fields changes */
+    push_to_fields_arr(resets, CRON_CF_SECOND);
 
     minute = calendar->tm_min;
     update_minute = find_next(expr->minutes, CRON_MAX_MINUTES, minute, calendar, CRON_CF_MINUTE, CRON_CF_HOUR_OF_DAY, resets, &res);
@@ -323,7 +710,7 @@ static int do_next(cron_expr* expr, struct tm* calendar, unsigned int dot) {
     if (minute == update_minute) {
         push_to_fields_arr(resets, CRON_CF_MINUTE);
     } else {
-        res = do_next(expr, calendar, dot);
+        res = do_next(expr, calendar);
         if (0 != res) goto return_result;
     }
 
@@ -333,18 +720,16 @@ static int do_next(cron_expr* expr, struct tm* calendar, unsigned int dot) {
     if (hour == update_hour) {
         push_to_fields_arr(resets, CRON_CF_HOUR_OF_DAY);
     } else {
-        res = do_next(expr, calendar, dot);
+        res = do_next(expr, calendar);
         if (0 != res) goto return_result;
     }
 
-    day_of_week = calendar->tm_wday;
-    day_of_month = calendar->tm_mday;
-    update_day_of_month = find_next_day(calendar, expr->days_of_month, day_of_month, expr->days_of_week, day_of_week, resets, &res);
+    days_moved = find_next_day(expr, calendar, resets, &res);
     if (0 != res) goto return_result;
-    if (day_of_month == update_day_of_month) {
+    if (0 == days_moved) {
         push_to_fields_arr(resets, CRON_CF_DAY_OF_MONTH);
     } else {
-        res = do_next(expr, calendar, dot);
+        res = do_next(expr, calendar);
         if (0 != res) goto return_result;
     }
 
@@ -352,461 +737,870 @@ static int do_next(cron_expr* expr, struct tm* calendar, unsigned int dot) {
     update_month = find_next(expr->months, CRON_MAX_MONTHS, month, calendar, CRON_CF_MONTH, CRON_CF_YEAR, resets, &res);
     if (0 != res) goto return_result;
     if (month != update_month) {
-        if (calendar->tm_year - dot > 4) {
-            res = -1;
-            goto return_result;
-        }
-        res = do_next(expr, calendar, dot);
+        res = do_next(expr, calendar);
         if (0 != res) goto return_result;
     }
     goto return_result;
     
     return_result:
-        if (!resets || !empty_list) {
-            res = -1;
-        }
-        if(resets) {
-            free(resets);
-        }
-        if (empty_list) {
-            free(empty_list);
-        }
         return res;
 }
 
-static int to_upper(char* str) {
-    if (!str) return 1;
-    int i;
-    for (i = 0; '\0' != str[i]; i++) {
-        str[i] = (char) toupper(str[i]);
+/**
+ * Set the calendar fields provided to their maximum values.
+ */
+static int reset_max(struct tm* calendar, int field) {
+    if (!calendar || -1 == field) {
+        return 1;
     }
-    return 0;
-}
-
-static char* to_string(int num) {
-    if (abs(num) >= CRON_MAX_NUM_TO_SRING) return NULL;
-    char* str = (char*) malloc(CRON_NUM_OF_DIGITS(num) + 1);
-    if (!str) return NULL;
-    int res = sprintf(str, "%d", num);
-    if (res < 0) return NULL;
-    return str;
-}
-
-static char* str_replace(char *orig, const char *rep, const char *with) {
-    char *result; /* the return string */
-    char *ins; /* the next insert point */
-    char *tmp; /* varies */
-    size_t len_rep; /* length of rep */
-    size_t len_with; /* length of with */
-    size_t len_front; /* distance between rep and end of last rep */
-    int count; /* number of replacements */
-    if (!orig) return NULL;
-    if (!rep) rep = "";
-    if (!with) with = "";
-    len_rep = strlen(rep);
-    len_with = strlen(with);
-
-    ins = orig;
-    for (count = 0; NULL != (tmp = strstr(ins, rep)); ++count) {
-        ins = tmp + len_rep;
-    }
-
-    /* first time through the loop, all the variable are set correctly
-     from here on,
-        tmp points to the end of the result string
-        ins points to the next occurrence of rep in orig
-        orig points to the remainder of orig after "end of rep"
-    */
-    tmp = result = (char*) malloc(strlen(orig) + (len_with - len_rep) * count + 1);
-    if (!result) return NULL;
-
-    while (count--) {
-        ins = strstr(orig, rep);
-        len_front = ins - orig;
-        tmp = strncpy(tmp, orig, len_front) + len_front;
-        tmp = strcpy(tmp, with) + len_with;
-        orig += len_front + len_rep; /* move to next "end of rep" */
-    }
-    strcpy(tmp, orig);
-    return result;
-}
-
-static unsigned int parse_uint(const char* str, int* errcode) {
-    char* endptr;
-    errno = 0;
-    long int l = strtol(str, &endptr, 0);
-    if (errno == ERANGE || *endptr != '\0' || l < 0 || l > INT_MAX) {
-        *errcode = 1;
-        return 0;
-    } else {
-        *errcode = 0;
-        return (unsigned int) l;
+    switch (field) {
+    case CRON_CF_SECOND: calendar->tm_sec = CRON_MAX_SECONDS - 1; break;
+    case CRON_CF_MINUTE: calendar->tm_min = CRON_MAX_MINUTES - 1; break;
+    case CRON_CF_HOUR_OF_DAY: calendar->tm_hour = CRON_MAX_HOURS - 1; break;
+    case CRON_CF_DAY_OF_WEEK: calendar->tm_wday = CRON_MAX_DAYS_OF_WEEK - 2; break;
+    case CRON_CF_DAY_OF_MONTH: calendar->tm_mday = days_in_month(calendar->tm_year + 1900L, calendar->tm_mon); break;
+    case CRON_CF_MONTH: calendar->tm_mon = CRON_MAX_MONTHS - 1; break;
+    default: return 1; /* unknown or unbounded field */
     }
+    return normalize_field(calendar, field);
 }
 
-static char** split_str(const char* str, char del, size_t* len_out) {
-    size_t i;
-    size_t stlen = 0;
-    size_t len = 0;
-    int accum = 0; 
-    char* buf = NULL;
-    char** res = NULL;
-    size_t bi = 0;
-    size_t ri = 0;
-    char* tmp;
-    
-    if(!str) goto return_error;
-    for (i = 0; '\0' != str[i]; i++) {
-        stlen += 1;
-        if (stlen >= CRON_MAX_STR_LEN_TO_SPLIT) goto return_error;
-    }
-           
-    for (i = 0; i < stlen; i++) {
-        if (del == str[i]) {
-            if (accum > 0) {
-                len += 1;
-                accum = 0;
-            }
-        } else if (!isspace(str[i])) {
-            accum += 1;
-        }
-    }
-    /* tail */
-    if (accum > 0) {
-        len += 1;
+static int reset_all_max(struct tm* calendar, int* fields) {
+    int i;
+    int res = 0;
+    if (!calendar || !fields) {
+        return 1;
     }
-    if (0 == len) return NULL;
-
-    buf = (char*) malloc(stlen + 1);
-    if (!buf) goto return_error;
-    memset(buf, 0, stlen + 1);
-    res = (char**) malloc(len * sizeof(char*));
-    if (!res) goto return_error;
-    
-    for (i = 0; i < stlen; i++) {
-        if (del == str[i]) {
-            if (bi > 0) {
-                tmp = strdupl(buf, bi);
-                if (!tmp) goto return_error;
-                res[ri++] = tmp;
-                memset(buf, 0, stlen + 1);
-                bi = 0;
-            }
-        } else if (!isspace(str[i])) {
-            buf[bi++] = str[i];            
+    for (i = 0; i < CRON_CF_ARR_LEN; i++) {
+        if (-1 != fields[i]) {
+            res = reset_max(calendar, fields[i]);
+            if(0 != res) return res;
         }
     }
-    /* tail */
-    if (bi > 0) {
-        tmp = strdupl(buf, bi);
-        if (!tmp) goto return_error;
-        res[ri++] = tmp;
-    }
-    free(buf);
-    *len_out = len;
-    return res;
-    
-    return_error:
-        if(buf) {
-            free(buf);
-        }
-        free_splitted(res, len);
-        *len_out = 0;
-        return NULL;
+    return 0;
 }
 
-static char* replace_ordinals(char* value, const char** arr, size_t arr_len) {
-    size_t i;
-    char* cur = value;
-    char* res = NULL;
-    int first = 1;
-    for (i = 0; i < arr_len; i++) {
-        char* strnum = to_string((int)i);
-        if (!strnum) {
-            if (!first) {
-                free(cur);
-            }
-            return NULL;
-        }
-        res = str_replace(cur, arr[i], strnum);
-        free(strnum);
-        if (!first) {
-            free(cur);
-        }
-        if (!res) {            
-            return NULL;
-        }
-        cur = res;
-        if (first) {
-            first = 0;
-        }
+/**
+ * Search the bits provided for the previous set bit before the value provided,
+ * and reset the calendar.
+ */
+static unsigned int find_prev(uint64_t bits, unsigned int max, unsigned int value, struct tm* calendar,
+        unsigned int field, unsigned int nextField, int* lower_orders, int* res_out) {
+    int notfound = 0;
+    int err = 0;
+    unsigned int prev_value = prev_set_bit(bits, value, &notfound);
+    /* roll under if needed */
+    if (notfound) {
+        err = add_to_field(calendar, nextField, -1);
+        if (err) goto return_error;
+        err = reset_max(calendar, field);
+        if (err) goto return_error;
+        notfound = 0;
+        prev_value = prev_set_bit(bits, max - 1, &notfound);
     }
-    return res;
-}
-
-static  int has_char(char* str, char ch) {    
-    size_t i;
-    size_t len = 0;
-    if (!str) return 0;
-    len = strlen(str);
-    for (i = 0; i < len; i++) {
-        if (str[i] == ch) return 1;
+    if (notfound || prev_value != value) {
+        /* the day of month is lowered first so it cannot overflow the new month,
+           and is set to its maximum once the month is known */
+        err = reset_all(calendar, lower_orders);
+        if (err) goto return_error;
+        err = set_field(calendar, field, prev_value);
+        if (err) goto return_error;
+        err = reset_all_max(calendar, lower_orders);
+        if (err) goto return_error;
     }
-    return 0;
+    return prev_value;
+
+    return_error:
+        *res_out = 1;
+        return 0;
 }
 
-static unsigned int* get_range(char* field, unsigned int min, unsigned int max, const char** error) {
-    char** parts = NULL;
-    size_t len = 0;
-    unsigned int* res = (unsigned int*) malloc(2*sizeof (unsigned int));
-    if(!res) goto return_error;
-    res[0] = 0;
-    res[1] = 0;
-    if (1 == strlen(field) && '*' == field[0]) {
-        res[0] = min;
-        res[1] = max - 1;
-    } else if (!has_char(field, '-')) {
-        int err = 0;
-        unsigned int val = parse_uint(field, &err);
-        if (err) {
-            *error = "Unsigned integer parse error 1";
-            goto return_error;
-        }
-        res[0] = val;
-        res[1] = val;
-    } else {        
-        parts = split_str(field, '-', &len);
-        if (0 == len || len > 2) {
-            *error = "Specified range has more than two fields";
-            goto return_error;
-        }
-        int err = 0;
-        res[0] = parse_uint(parts[0], &err);
-        if (err) {
-            *error = "Unsigned integer parse error 2";
-            goto return_error;
-        }
-        res[1] = parse_uint(parts[1], &err);
-        if (err) {
-            *error = "Unsigned integer parse error 3";
-            goto return_error;
-        }
+/* reverse of 'find_next_day', with the same bound of months and years checked */
+static unsigned int find_prev_day(const cron_expr* expr, struct tm* calendar, int* resets, int* res_out) {
+    long year = calendar->tm_year + 1900L;
+    int month = calendar->tm_mon;
+    unsigned int day = (unsigned int) calendar->tm_mday;
+    long start;
+    int notfound = 0;
+    int wraps = 0;
+    int err;
+    if (calendar_day_matches(expr, calendar)) {
+        return 0;
     }
-    if (res[0] >= max || res[1] >= max) {
-        *error = "Specified range exceeds maximum";
-        goto return_error;
+    start = days_from_civil(year, month + 1, day);
+    if (!year_matches(expr, year)) {
+        year = next_field_year(expr, year - 1, -1);
+        if (0 == year) goto return_error;
+        month = CRON_MAX_MONTHS - 1;
+        day = (unsigned int) days_in_month(year, month);
     }
-    if (res[0] < min || res[1] < min) {
-        *error = "Specified range is less than minimum";
-        goto return_error;
+    for (;;) {
+        notfound = 0;
+        day = prev_set_bit(matching_days(expr, year, month), day, &notfound);
+        if (!notfound) break;
+        /* continue from the last day of the previous month */
+        month -= 1;
+        if (month < 0) {
+            year = 0 == wraps++ ? next_field_year(expr, year - 1, -1) : find_matching_year(expr, year - 1, -1);
+            if (0 == year) goto return_error;
+            month = CRON_MAX_MONTHS - 1;
+        }
+        day = (unsigned int) days_in_month(year, month);
     }
-    free_splitted(parts, len);
-    *error = NULL;
-    return res;
-    
+    calendar->tm_year = (int) (year - 1900);
+    calendar->tm_mon = month;
+    calendar->tm_mday = (int) day;
+    err = cron_normalize(calendar);
+    if (err) goto return_error;
+    err = reset_all_max(calendar, resets);
+    if (err) goto return_error;
+    return (unsigned int) (start - days_from_civil(year, month + 1, day));
+
     return_error:
-        free_splitted(parts, len);
-        if(res) {
-            free(res);
-        }
-        return NULL;
+        *res_out = 1;
+        return 0;
 }
 
-static char* set_number_hits(char* value, unsigned int min, unsigned int max, const char** error) {
-    size_t i;
-    unsigned int i1;
-    char* bits = (char*) malloc(max);
-    if (!bits) {
-        *error = "Memory allocation error";
-        return NULL;
-    }
-    memset(bits, 0, max);
-    size_t len = 0;
-    char** fields = split_str(value, ',', &len);
-    if (!fields) {
-        *error = "Comma split error";
-        goto return_result;
-    }
-    
-    for (i = 0; i < len; i++) {
-        if (!has_char(fields[i], '/')) {
-            /* Not an incrementer so it must be a range (possibly empty) */
-            unsigned int* range = get_range(fields[i], min, max, error);
-            if (*error) {
-                if (range) {
-                    free(range);
-                }
-                goto return_result;
-            }
-            for (i1 = range[0]; i1 <= range[1]; i1++) {
-                bits[i1] = 1;
-            }
-            free(range);
-        } else {
-            size_t len2 = 0;
-            char** split = split_str(fields[i], '/', &len2);
-            if (0 == len2 || len2 > 2) {
-                *error = "Incrementer has more than two fields";
-                free_splitted(split, len2);
-                goto return_result;
-            }
-            unsigned int* range = get_range(split[0], min, max, error);
-            if (*error) {
-                if (range) {
-                    free(range);
-                }
-                free_splitted(split, len2);
-                goto return_result;
-            }
-            if (!has_char(split[0], '-')) {
-                range[1] = max - 1;
+static int do_prev(const cron_expr* expr, struct tm* calendar) {
+    int i;
+    int res = 0;
+    int resets[CRON_CF_ARR_LEN];
+    int empty_list[CRON_CF_ARR_LEN];
+    unsigned int second = 0;
+    unsigned int minute = 0;
+    unsigned int update_minute = 0;
+    unsigned int hour = 0;
+    unsigned int update_hour = 0;
+    unsigned int days_moved = 0;
+    unsigned int month = 0;
+    unsigned int update_month = 0;
+
+    /* the search would move to the previous minute, hour or day forever */
+    if (has_empty_field(expr)) return 1;
+    for (i = 0; i < CRON_CF_ARR_LEN; i++) {
+        resets[i] = -1;
+        empty_list[i] = -1;
+    }
+
+    second = calendar->tm_sec;
+    find_prev(expr->seconds, CRON_MAX_SECONDS, second, calendar, CRON_CF_SECOND, CRON_CF_MINUTE, empty_list, &res);
+    if (0 != res) goto return_result;
+    /* seconds are not searched again by a recursive call, so they must be reset
+       even if they were moved, when any of the higher order fields changes */
+    push_to_fields_arr(resets, CRON_CF_SECOND);
+
+    minute = calendar->tm_min;
+    update_minute = find_prev(expr->minutes, CRON_MAX_MINUTES, minute, calendar, CRON_CF_MINUTE, CRON_CF_HOUR_OF_DAY, resets, &res);
+    if (0 != res) goto return_result;
+    if (minute == update_minute) {
+        push_to_fields_arr(resets, CRON_CF_MINUTE);
+    } else {
+        res = do_prev(expr, calendar);
+        if (0 != res) goto return_result;
+    }
+
+    hour = calendar->tm_hour;
+    update_hour = find_prev(expr->hours, CRON_MAX_HOURS, hour, calendar, CRON_CF_HOUR_OF_DAY, CRON_CF_DAY_OF_WEEK, resets, &res);
+    if (0 != res) goto return_result;
+    if (hour == update_hour) {
+        push_to_fields_arr(resets, CRON_CF_HOUR_OF_DAY);
+    } else {
+        res = do_prev(expr, calendar);
+        if (0 != res) goto return_result;
+    }
+
+    days_moved = find_prev_day(expr, calendar, resets, &res);
+    if (0 != res) goto return_result;
+    if (0 == days_moved) {
+        push_to_fields_arr(resets, CRON_CF_DAY_OF_MONTH);
+    } else {
+        res = do_prev(expr, calendar);
+        if (0 != res) goto return_result;
+    }
+
+    month = calendar->tm_mon;
+    update_month = find_prev(expr->months, CRON_MAX_MONTHS, month, calendar, CRON_CF_MONTH, CRON_CF_YEAR, resets, &res);
+    if (0 != res) goto return_result;
+    if (month != update_month) {
+        res = do_prev(expr, calendar);
+        if (0 != res) goto return_result;
+    }
+    goto return_result;
+
+    return_result:
+        return res;
+}
+
+/*
+ * Expressions of simple shapes (all the days, some days of week or some days
+ * of month, in any month) are evaluated directly on the seconds since epoch,
+ * the shape is chosen by the parser, see 'cron_expr_shape'.
+ */
+
+#define CRON_SHAPE_GENERAL 0
+/* every day, only time of day is restricted */
+#define CRON_SHAPE_DAILY 1
+/* every month, days of week are restricted */
+#define CRON_SHAPE_WEEKLY 2
+/* every month, days of month are restricted */
+#define CRON_SHAPE_MONTHLY 3
+
+#define CRON_ALL_DAYS_OF_MONTH 0xFFFFFFFEu
+#define CRON_ALL_MONTHS 0xFFFu
+#define CRON_ALL_DAYS_OF_WEEK 0x7Fu
+
+/* seconds since epoch of 0001-01-01 00:00:00 and 9999-12-31 23:59:59 */
+#define CRON_MIN_SECONDS (-62135596800LL)
+#define CRON_MAX_SECONDS_SINCE_EPOCH 253402300799LL
+
+static uint8_t cron_expr_shape(const cron_expr* expr) {
+    if (CRON_ALL_MONTHS != expr->months || has_day_items(expr) || expr->year_first) return CRON_SHAPE_GENERAL;
+    /* the shortcuts look for the first set bits of the fields */
+    if (has_empty_field(expr)) return CRON_SHAPE_GENERAL;
+    if (CRON_ALL_DAYS_OF_MONTH == expr->days_of_month) {
+        return CRON_ALL_DAYS_OF_WEEK == expr->days_of_week ? CRON_SHAPE_DAILY : CRON_SHAPE_WEEKLY;
+    }
+    return CRON_ALL_DAYS_OF_WEEK == expr->days_of_week ? CRON_SHAPE_MONTHLY : CRON_SHAPE_GENERAL;
+}
+
+static long first_second_of_day(const cron_expr* expr) {
+    return (long) ctz64(expr->hours) * 3600 + (long) ctz64(expr->minutes) * 60 + (long) ctz64(expr->seconds);
+}
+
+/* first matching second of day not before the specified one, -1 if there is none */
+static long next_second_of_day(const cron_expr* expr, long second) {
+    int notfound = 0;
+    unsigned int hour = (unsigned int) (second / 3600);
+    unsigned int minute = (unsigned int) (second / 60 % 60);
+    unsigned int value;
+    if (expr->hours & CRON_BIT(hour)) {
+        if (expr->minutes & CRON_BIT(minute)) {
+            value = next_set_bit(expr->seconds, CRON_MAX_SECONDS, (unsigned int) (second % 60), &notfound);
+            if (!notfound) return (long) hour * 3600 + (long) minute * 60 + (long) value;
+            notfound = 0;
+        }
+        value = next_set_bit(expr->minutes, CRON_MAX_MINUTES, minute + 1, &notfound);
+        if (!notfound) return (long) hour * 3600 + (long) value * 60 + (long) ctz64(expr->seconds);
+        notfound = 0;
+    }
+    value = next_set_bit(expr->hours, CRON_MAX_HOURS, hour + 1, &notfound);
+    if (!notfound) return (long) value * 3600 + (long) ctz64(expr->minutes) * 60 + (long) ctz64(expr->seconds);
+    return -1;
+}
+
+/* number of days from the specified one (inclusive) to the next one matching the expression */
+static long days_to_next_day(const cron_expr* expr, long days) {
+    long year;
+    unsigned int month;
+    unsigned int day;
+    long moved = 0;
+    int notfound = 0;
+    unsigned int value;
+    if (CRON_SHAPE_DAILY == expr->shape) return 0;
+    if (CRON_SHAPE_WEEKLY == expr->shape) {
+        /* bit N is set when the N-th day from the specified one matches */
+        uint64_t week_days = ((uint64_t) expr->days_of_week * CRON_WEEK_REPEAT) >> weekday_from_days(days);
+        return (long) ctz64(week_days);
+    }
+    civil_from_days(days, &year, &month, &day);
+    /* any set day of month matches in at most 2 months */
+    for (;;) {
+        uint32_t month_days = (uint32_t) ((CRON_BIT(days_in_month(year, (int) month - 1)) - 1) << 1);
+        value = next_set_bit(expr->days_of_month & month_days, CRON_MAX_DAYS_OF_MONTH, day, &notfound);
+        if (!notfound) return moved + (long) (value - day);
+        moved += days_in_month(year, (int) month - 1) - (long) day + 1;
+        day = 1;
+        notfound = 0;
+        if (12 == month) {
+            month = 1;
+            year += 1;
+        } else {
+            month += 1;
+        }
+    }
+}
+
+/**
+ * Finds the first second matching the expression not before the specified one,
+ * for the expressions of simple shapes. Returns 0 in case of success,
+ * 1 if the date is out of the supported range.
+ */
+static int next_by_shape(const cron_expr* expr, int64_t from, int64_t* out) {
+    long days;
+    long second;
+    long moved;
+    if (from < CRON_MIN_SECONDS || from > CRON_MAX_SECONDS_SINCE_EPOCH) return 1;
+    days = (long) ((from - CRON_MIN_SECONDS) / 86400) + (long) (CRON_MIN_SECONDS / 86400);
+    second = (long) (from - (int64_t) days * 86400);
+    moved = days_to_next_day(expr, days);
+    second = 0 == moved ? next_second_of_day(expr, second) : first_second_of_day(expr);
+    if (second < 0) {
+        moved = 1 + days_to_next_day(expr, days + 1);
+        second = first_second_of_day(expr);
+    }
+    *out = (int64_t) (days + moved) * 86400 + second;
+    return *out > CRON_MAX_SECONDS_SINCE_EPOCH ? 1 : 0;
+}
+
+/* day and month names matched by perfect hash of their upper case letters, see 'name_hash' */
+typedef struct {
+    char name[4];
+    int kind;
+    unsigned int value;
+} cron_name;
+
+#define CRON_NAMES_NONE 0
+#define CRON_NAMES_DAYS 1
+#define CRON_NAMES_MONTHS 2
+#define CRON_NAMES_TABLE_LEN 32
+
+static const cron_name NAMES_TABLE[CRON_NAMES_TABLE_LEN] = {
+    {"OCT", CRON_NAMES_MONTHS, 10}, {"JUL", CRON_NAMES_MONTHS, 7}, {"SUN", CRON_NAMES_DAYS, 0}, {"", CRON_NAMES_NONE, 0},
+    {"MAY", CRON_NAMES_MONTHS, 5}, {"", CRON_NAMES_NONE, 0}, {"", CRON_NAMES_NONE, 0}, {"", CRON_NAMES_NONE, 0},
+    {"THU", CRON_NAMES_DAYS, 4}, {"APR", CRON_NAMES_MONTHS, 4}, {"SEP", CRON_NAMES_MONTHS, 9}, {"", CRON_NAMES_NONE, 0},
+    {"", CRON_NAMES_NONE, 0}, {"", CRON_NAMES_NONE, 0}, {"SAT", CRON_NAMES_DAYS, 6}, {"", CRON_NAMES_NONE, 0},
+    {"MAR", CRON_NAMES_MONTHS, 3}, {"", CRON_NAMES_NONE, 0}, {"", CRON_NAMES_NONE, 0}, {"", CRON_NAMES_NONE, 0},
+    {"", CRON_NAMES_NONE, 0}, {"FEB", CRON_NAMES_MONTHS, 2}, {"", CRON_NAMES_NONE, 0}, {"TUE", CRON_NAMES_DAYS, 2},
+    {"FRI", CRON_NAMES_DAYS, 5}, {"JUN", CRON_NAMES_MONTHS, 6}, {"MON", CRON_NAMES_DAYS, 1}, {"NOV", CRON_NAMES_MONTHS, 11},
+    {"AUG", CRON_NAMES_MONTHS, 8}, {"JAN", CRON_NAMES_MONTHS, 1}, {"WED", CRON_NAMES_DAYS, 3}, {"DEC", CRON_NAMES_MONTHS, 12}
+};
+
+/* fields with Quartz-style day items */
+#define CRON_ITEMS_NONE 0
+#define CRON_ITEMS_DAYS_OF_MONTH 1
+#define CRON_ITEMS_DAYS_OF_WEEK 2
+
+/* fields in the order of the expression */
+typedef struct {
+    unsigned int min;
+    unsigned int max;
+    int names;
+    int any_allowed;
+    int day_items;
+} cron_field_spec;
+
+static const cron_field_spec FIELD_SPECS[CRON_FIELDS_COUNT] = {
+    {0, CRON_MAX_SECONDS, CRON_NAMES_NONE, 0, CRON_ITEMS_NONE},
+    {0, CRON_MAX_MINUTES, CRON_NAMES_NONE, 0, CRON_ITEMS_NONE},
+    {0, CRON_MAX_HOURS, CRON_NAMES_NONE, 0, CRON_ITEMS_NONE},
+    /* days of month start with 1 */
+    {1, CRON_MAX_DAYS_OF_MONTH, CRON_NAMES_NONE, 1, CRON_ITEMS_DAYS_OF_MONTH},
+    /* months start with 1 in Cron and 0 in Calendar, bits are shifted after parsing */
+    {1, CRON_MAX_MONTHS + 1, CRON_NAMES_MONTHS, 0, CRON_ITEMS_NONE},
+    /* Sunday can be represented as 0 or 7 */
+    {0, CRON_MAX_DAYS_OF_WEEK, CRON_NAMES_DAYS, 1, CRON_ITEMS_DAYS_OF_WEEK}
+};
+
+/* any value above all the field maximums, numbers saturate to it instead of overflowing */
+#define CRON_MAX_PARSED_NUM 10000
+
+static int is_field_end(char ch) {
+    return '\0' == ch || isspace((unsigned char) ch);
+}
+
+static unsigned int name_hash(const char* str) {
+    return ((unsigned int) toupper((unsigned char) str[0]) +
+            (unsigned int) toupper((unsigned char) str[1]) * 11 +
+            (unsigned int) toupper((unsigned char) str[2]) * 12) & (CRON_NAMES_TABLE_LEN - 1);
+}
+
+static unsigned int parse_value(const char** pos, int names, const char** error) {
+    const char* str = *pos;
+    unsigned int val = 0;
+    if (isdigit((unsigned char) *str)) {
+        for (; isdigit((unsigned char) *str); str++) {
+            val = val * 10 + (unsigned int) (*str - '0');
+            if (val > CRON_MAX_PARSED_NUM) {
+                val = CRON_MAX_PARSED_NUM;
             }
-            int err = 0;
-            unsigned int delta = parse_uint(split[1], &err);
-            if (err) {
-                *error = "Unsigned integer parse error 4";
-                free(range);
-                free_splitted(split, len2);
-                goto return_result;
+        }
+    } else if (CRON_NAMES_NONE != names && isalpha((unsigned char) str[0]) &&
+            isalpha((unsigned char) str[1]) && isalpha((unsigned char) str[2]) &&
+            (!isalpha((unsigned char) str[3]) || (CRON_NAMES_DAYS == names &&
+            'L' == toupper((unsigned char) str[3]) && !isalpha((unsigned char) str[4])))) {
+        /* day names can be followed by 'L', see 'parse_day_item' */
+        const cron_name* entry = &NAMES_TABLE[name_hash(str)];
+        if (entry->kind != names ||
+                entry->name[0] != toupper((unsigned char) str[0]) ||
+                entry->name[1] != toupper((unsigned char) str[1]) ||
+                entry->name[2] != toupper((unsigned char) str[2])) {
+            *error = "Invalid day or month name";
+            return 0;
+        }
+        val = entry->value;
+        str += 3;
+    } else {
+        *error = "Unsigned integer parse error";
+        return 0;
+    }
+    *pos = str;
+    return val;
+}
+
+/**
+ * Parses Quartz-style day item into the expression: 'L' (last day of month), 'L-n'
+ * (n days before it), 'LW' (last weekday) and 'nW' (weekday nearest to the day n)
+ * in days of month, 'dL' (last day d of month) and 'd#n' (n-th day d) in days of week.
+ * Returns 0 without moving the position if the item is not one of them.
+ */
+static int parse_day_item(const char** pos, int day_items, cron_expr* target, const char** error) {
+    const char* str = *pos;
+    unsigned int value;
+    if (CRON_ITEMS_DAYS_OF_MONTH == day_items) {
+        if ('L' == toupper((unsigned char) *str)) {
+            if ('W' == toupper((unsigned char) str[1]) ? target->nearest_weekday : target->last_day_of_month) {
+                *error = "Only one 'L' and one 'W' item are supported in days of month";
+                return 0;
             }
-            for (i1 = range[0]; i1 <= range[1]; i1 += delta) {
-                bits[i1] = 1;
+            str++;
+            if ('W' == toupper((unsigned char) *str)) {
+                target->nearest_weekday = CRON_LAST_WEEKDAY;
+                str++;
+            } else {
+                value = 0;
+                if ('-' == *str) {
+                    str++;
+                    value = parse_value(&str, CRON_NAMES_NONE, error);
+                    if (*error) return 0;
+                    if (value >= CRON_MAX_DAYS_OF_MONTH - 1) {
+                        *error = "Specified range exceeds maximum";
+                        return 0;
+                    }
+                }
+                target->last_day_of_month = (uint8_t) (value + 1);
             }
-            free_splitted(split, len2);
-            free(range);
+            *pos = str;
+            return 1;
+        }
+        if (!isdigit((unsigned char) *str)) return 0;
+        value = parse_value(&str, CRON_NAMES_NONE, error);
+        if (*error || 'W' != toupper((unsigned char) *str)) return 0;
+        if (target->nearest_weekday) {
+            *error = "Only one 'L' and one 'W' item are supported in days of month";
+            return 0;
         }
+        if (value < 1 || value >= CRON_MAX_DAYS_OF_MONTH) {
+            *error = "Specified range exceeds maximum";
+            return 0;
+        }
+        target->nearest_weekday = (uint8_t) value;
+        *pos = str + 1;
+        return 1;
     }
-    goto return_result;
-    
-    return_result:
-        free_splitted(fields, len);
-        return bits;
+    if (!isalnum((unsigned char) *str)) return 0;
+    value = parse_value(&str, CRON_NAMES_DAYS, error);
+    if (*error || ('L' != toupper((unsigned char) *str) && '#' != *str)) return 0;
+    if (value >= CRON_MAX_DAYS_OF_WEEK) {
+        *error = "Specified range exceeds maximum";
+        return 0;
+    }
+    /* Sunday can be represented as 0 or 7 */
+    value %= 7;
+    if ('L' == toupper((unsigned char) *str)) {
+        target->last_days_of_week |= (uint8_t) CRON_BIT(value);
+        *pos = str + 1;
+        return 1;
+    }
+    str++;
+    if (target->nth_day_of_week) {
+        *error = "Only one '#' item is supported in days of week";
+        return 0;
+    }
+    target->nth_day_of_week = (uint8_t) value;
+    value = parse_value(&str, CRON_NAMES_NONE, error);
+    if (*error) return 0;
+    if (value < 1 || value > 5) {
+        *error = "Day of week occurrence must be between 1 and 5";
+        return 0;
+    }
+    target->nth_day_of_week |= (uint8_t) (value << 3);
+    *pos = str;
+    return 1;
 }
 
-static char* set_months(char* value, const char** error) {
-    int err;
+/**
+ * Parses single value, range or increment of the field ('?' only if it is
+ * the whole field), returns its bit set and moves the position after it.
+ */
+static uint64_t parse_range(const char** pos, const cron_field_spec* spec, int whole_field, const char** error) {
+    const char* str = *pos;
+    uint64_t bits = 0;
+    unsigned int start;
+    unsigned int end;
+    unsigned int step = 1;
     unsigned int i;
-    unsigned int max = 12;
-    char* months = NULL;
-    char* replaced = NULL;
-    char* bits = (char*) malloc(CRON_MAX_MONTHS);
-    if (!bits) {
-        *error = "Months memory allocation error";
-        return NULL;
+    int range = 0;
+    if ('?' == *str && spec->any_allowed && whole_field && is_field_end(str[1])) {
+        /* 'no specific value', allowed only as a whole day field */
+        start = spec->min;
+        end = spec->max - 1;
+        range = 1;
+        str++;
+    } else if ('*' == *str) {
+        start = spec->min;
+        end = spec->max - 1;
+        range = 1;
+        str++;
+    } else {
+        start = parse_value(&str, spec->names, error);
+        if (*error) return 0;
+        end = start;
+        if ('-' == *str) {
+            str++;
+            end = parse_value(&str, spec->names, error);
+            if (*error) return 0;
+            range = 1;
+        }
+    }
+    if ('/' == *str) {
+        str++;
+        step = parse_value(&str, CRON_NAMES_NONE, error);
+        if (*error) return 0;
+        if (0 == step) {
+            *error = "Incrementer must be greater than zero";
+            return 0;
+        }
+        if (!range) {
+            end = spec->max - 1;
+        }
+    }
+    if (start >= spec->max || end >= spec->max) {
+        *error = "Specified range exceeds maximum";
+        return 0;
     }
-    memset(bits, 0, CRON_MAX_MONTHS);
-    err = to_upper(value);
-    if(err) goto return_error;
-    replaced = replace_ordinals(value, MONTHS_ARR, CRON_MONTHS_ARR_LEN);
-    if (!replaced) goto return_error;
-    /* Months start with 1 in Cron and 0 in Calendar, so push the values first into a longer bit set */
-    months = set_number_hits(replaced, 1, max + 1, error);
-    free(replaced);
-    if (*error) goto return_error;
-    /* ... and then rotate it to the front of the months */
-    for (i = 1; i <= max; i++) {
-        if (months[i]) {
-            bits[i - 1] = 1;
-        }
-    }
-    free(months);
+    if (start < spec->min || end < spec->min) {
+        *error = "Specified range is less than minimum";
+        return 0;
+    }
+    if (start > end) {
+        *error = "Specified range start is greater than its end";
+        return 0;
+    }
+    for (i = start; i <= end; i += step) {
+        bits |= CRON_BIT(i);
+    }
+    *pos = str;
     return bits;
-    
-    return_error:
-        if (months) {
-            free(months);
+}
+
+/**
+ * Parses comma separated list of values, ranges and increments,
+ * moves the position to the end of the field. Day items of the
+ * day fields are stored into the target expression.
+ */
+static uint64_t parse_field(const char** pos, const cron_field_spec* spec, cron_expr* target, const char** error) {
+    const char* str = *pos;
+    uint64_t bits = 0;
+    int items = 0;
+    for (;;) {
+        if (CRON_ITEMS_NONE == spec->day_items || !parse_day_item(&str, spec->day_items, target, error)) {
+            if (*error) return 0;
+            bits |= parse_range(&str, spec, str == *pos, error);
+            if (*error) return 0;
+        } else {
+            items = 1;
+        }
+        if (',' == *str) {
+            str++;
+        } else if (is_field_end(*str)) {
+            break;
+        } else {
+            *error = "Invalid character in expression field";
+            return 0;
         }
-        return bits;
+    }
+    if (!bits && !items) {
+        *error = "Expression field matches no values";
+        return 0;
+    }
+    *pos = str;
+    return bits;
 }
 
-static char* set_days(char* field, int max, const char** error) {
-    if (1 == strlen(field) && '?' == field[0]) {
-        field[0] = '*';
+/**
+ * Parses single year, range or increment of the year field ('*' is the range of all
+ * the supported years) and moves the position after it.
+ */
+static void parse_year_range(const char** pos, unsigned int* start, unsigned int* end, unsigned int* step, const char** error) {
+    const char* str = *pos;
+    int range = 0;
+    *step = 1;
+    if ('*' == *str) {
+        *start = CRON_MIN_YEAR;
+        *end = CRON_MAX_YEAR;
+        range = 1;
+        str++;
+    } else {
+        *start = parse_value(&str, CRON_NAMES_NONE, error);
+        if (*error) return;
+        *end = *start;
+        if ('-' == *str) {
+            str++;
+            *end = parse_value(&str, CRON_NAMES_NONE, error);
+            if (*error) return;
+            range = 1;
+        }
+    }
+    if ('/' == *str) {
+        str++;
+        *step = parse_value(&str, CRON_NAMES_NONE, error);
+        if (*error) return;
+        if (0 == *step) {
+            *error = "Incrementer must be greater than zero";
+            return;
+        }
+        if (!range) {
+            *end = CRON_MAX_YEAR;
+        }
+    }
+    if (*start > CRON_MAX_YEAR || *end > CRON_MAX_YEAR) {
+        *error = "Specified range exceeds maximum";
+        return;
+    }
+    if (*start < CRON_MIN_YEAR || *end < CRON_MIN_YEAR) {
+        *error = "Specified range is less than minimum";
+        return;
+    }
+    if (*start > *end) {
+        *error = "Specified range start is greater than its end";
+        return;
     }
-    return set_number_hits(field, 0, max, error);
+    *pos = str;
 }
 
-static char* set_days_of_month(char* field, const char** error) {
-    /* Days of month start with 1 (in Cron and Calendar) so add one */
-    char* bits = set_days(field, CRON_MAX_DAYS_OF_MONTH, error);
-    /* ... and remove it from the front */
-    if (bits) {
-        bits[0] = 0;
+/**
+ * Parses the optional year field into the expression and moves the position to the end
+ * of the field. Years are stored as a bit set starting from the first year of the field
+ * (see 'cron_expr'), the list is parsed twice: to find the first year and to set the bits.
+ * A field matching all the years is stored the same as no year field.
+ */
+static void parse_years(const char** pos, cron_expr* target, const char** error) {
+    const char* str = *pos;
+    unsigned int first = CRON_MAX_YEAR;
+    unsigned int last = CRON_MIN_YEAR;
+    unsigned int start = 0;
+    unsigned int end = 0;
+    unsigned int step = 1;
+    unsigned int year;
+    int any = 0;
+    int pass;
+    for (pass = 0; pass < 2; pass++) {
+        str = *pos;
+        for (;;) {
+            parse_year_range(&str, &start, &end, &step, error);
+            if (*error) return;
+            if (CRON_MIN_YEAR == start && CRON_MAX_YEAR == end && 1 == step) {
+                any = 1;
+            } else if (0 == pass) {
+                first = start < first ? start : first;
+                year = start + (end - start) / step * step;
+                last = year > last ? year : last;
+            } else {
+                for (year = start; year <= end; year += step) {
+                    target->years[(year - first) / 64] |= CRON_BIT((year - first) % 64);
+                }
+            }
+            if (',' == *str) {
+                str++;
+            } else if (is_field_end(*str)) {
+                break;
+            } else {
+                *error = "Invalid character in expression field";
+                return;
+            }
+        }
+        if (any) break;
+        if (0 == pass) {
+            if (last - first >= CRON_YEARS_SPAN) {
+                *error = "Years must be within 128 years from the first one";
+                return;
+            }
+            target->year_first = (uint16_t) first;
+        }
     }
-    return bits;
+    *pos = str;
 }
 
+int cron_parse_expr_into(const char* expression, cron_expr* target, const char** error) {
+    const char* err_local;
+    uint64_t fields[CRON_FIELDS_COUNT];
+    cron_expr parsed;
+    const char* pos;
+    size_t len;
+    int i;
+    if (!error) {
+        error = &err_local;
+    }
+    *error = NULL;
+    if (!expression || !target) {
+        *error = "Invalid NULL expression or target";
+        return -1;
+    }
+    for (len = 0; '\0' != expression[len]; len++) {
+        if (len + 1 >= CRON_MAX_STR_LEN) {
+            *error = "Expression is too long";
+            return -1;
+        }
+    }
+    /* day items are parsed directly into it */
+    memset(&parsed, 0, sizeof(cron_expr));
+    pos = expression;
+    for (i = 0; i < CRON_FIELDS_COUNT; i++) {
+        while (isspace((unsigned char) *pos)) {
+            pos++;
+        }
+        if ('\0' == *pos) break;
+        fields[i] = parse_field(&pos, &FIELD_SPECS[i], &parsed, error);
+        if (*error) return -1;
+    }
+    while (isspace((unsigned char) *pos)) {
+        pos++;
+    }
+    if (i == CRON_FIELDS_COUNT && '\0' != *pos) {
+        parse_years(&pos, &parsed, error);
+        if (*error) return -1;
+        while (isspace((unsigned char) *pos)) {
+            pos++;
+        }
+    }
+    if (i != CRON_FIELDS_COUNT || '\0' != *pos) {
+        *error = "Invalid number of fields, expression must consist of 6 or 7 fields";
+        return -1;
+    }
+
+    parsed.seconds = fields[0];
+    parsed.minutes = fields[1];
+    parsed.hours = (uint32_t) fields[2];
+    parsed.days_of_month = (uint32_t) fields[3];
+    parsed.months = (uint16_t) (fields[4] >> 1);
+    if (fields[5] & CRON_BIT(7)) {
+        fields[5] |= CRON_BIT(0);
+    }
+    parsed.days_of_week = (uint8_t) (fields[5] & ~CRON_BIT(7));
+    parsed.shape = cron_expr_shape(&parsed);
+    *target = parsed;
+    return 0;
+}
 
 cron_expr* cron_parse_expr(const char* expression, const char** error) {
     const char* err_local;
-    char* seconds = NULL;
-    char* minutes = NULL;
-    char* hours = NULL;
-    char* days_of_week = NULL;
-    char* days_of_month = NULL;
-    char* months = NULL;
-    size_t len = 0;
-    char** fields = NULL;
-    char* days_replaced = NULL;
+    cron_expr parsed;
+    cron_expr* res;
     if (!error) {
         error = &err_local;
     }
-    *error = NULL;
     if (!expression) {
         *error = "Invalid NULL expression";
-        goto return_res;
-    }
-    fields = split_str(expression, ' ', &len);
-    if (len != 6) {
-        *error = "Invalid number of fields, expression must consist of 6 fields";
-        goto return_res;
+        return NULL;
     }
-    seconds = set_number_hits(fields[0], 0, 60, error);
-    if (*error) goto return_res;
-    minutes = set_number_hits(fields[1], 0, 60, error);
-    if (*error) goto return_res;
-    hours = set_number_hits(fields[2], 0, 24, error);
-    if (*error) goto return_res;
-    to_upper(fields[5]);
-    days_replaced = replace_ordinals(fields[5], DAYS_ARR, CRON_DAYS_ARR_LEN);
-    days_of_week = set_days(days_replaced, 8, error);
-    free(days_replaced);
-    if (*error) goto return_res;
-    if (days_of_week[7]) {
-        /* Sunday can be represented as 0 or 7 */
-        days_of_week[0] = 1;
-        days_of_week[7] = 0;
-    }
-    days_of_month = set_days_of_month(fields[3], error);
-    if (*error) goto return_res;
-    months = set_months(fields[4], error);
-    if (*error) goto return_res;
-
-    goto return_res;
-    
-    return_res: 
-    free_splitted(fields, len);
-    if(*error) {
-        if(seconds) free(seconds);
-        if(minutes) free(minutes);
-        if(hours) free(hours);
-        if(days_of_week) free(days_of_week);
-        if(days_of_month) free(days_of_month);
-        if(months) free(months);
+    if (0 != cron_parse_expr_into(expression, &parsed, error)) return NULL;
+    res = (cron_expr*) cron_malloc(sizeof (cron_expr));
+    if (!res) {
+        *error = "Memory allocation error";
         return NULL;
     }
-    cron_expr* res = (cron_expr*) malloc(sizeof (cron_expr));
-    res->seconds = seconds;
-    res->minutes = minutes;
-    res->hours = hours;
-    res->days_of_week = days_of_week;
-    res->days_of_month = days_of_month;
-    res->months = months;
+    *res = parsed;
     return res;
+}
+
+/*
+ * Binary record of the expression, little-endian fields at fixed offsets:
+ * seconds (8 bytes, with the record version in the top 4 bits), minutes (8),
+ * hours (3), days of month (4), months (2), days of week (1), the day items (1 each),
+ * first year of the year field (2) and years (2 x 8). Unused bits are zero.
+ * The shape is not stored, it is chosen again when the record is read.
+ */
+#define CRON_RECORD_VERSION 1
+#define CRON_RECORD_VERSION_SHIFT 60
+
+static void put_le(unsigned char* buf, uint64_t value, int len) {
+    int i;
+    for (i = 0; i < len; i++) {
+        buf[i] = (unsigned char) (value >> (8 * i));
+    }
+}
+
+/* written out byte by byte, so that compilers turn them into single loads */
+static uint64_t get_le64(const unsigned char* buf) {
+    return (uint64_t) buf[0] | ((uint64_t) buf[1] << 8) | ((uint64_t) buf[2] << 16) | ((uint64_t) buf[3] << 24) |
+            ((uint64_t) buf[4] << 32) | ((uint64_t) buf[5] << 40) | ((uint64_t) buf[6] << 48) | ((uint64_t) buf[7] << 56);
+}
+
+static uint32_t get_le32(const unsigned char* buf) {
+    return (uint32_t) buf[0] | ((uint32_t) buf[1] << 8) | ((uint32_t) buf[2] << 16) | ((uint32_t) buf[3] << 24);
+}
 
+/* whether the day items and the year field have values the parser can produce */
+static int valid_record_fields(const cron_expr* expr) {
+    unsigned int nth = expr->nth_day_of_week;
+    return expr->last_day_of_month < CRON_MAX_DAYS_OF_MONTH && expr->nearest_weekday <= CRON_LAST_WEEKDAY &&
+            expr->last_days_of_week < CRON_BIT(7) && (0 == nth || ((nth >> 3) >= 1 && (nth >> 3) <= 5 && (nth & 7) < 7)) &&
+            expr->year_first <= CRON_MAX_YEAR && (expr->year_first || (0 == expr->years[0] && 0 == expr->years[1])) &&
+            !has_empty_field(expr);
+}
+
+int cron_expr_serialize(const cron_expr* expr, unsigned char* record) {
+    if (!expr || !record || !valid_record_fields(expr)) return -1;
+    put_le(record, (expr->seconds & (CRON_BIT(CRON_MAX_SECONDS) - 1)) |
+            ((uint64_t) CRON_RECORD_VERSION << CRON_RECORD_VERSION_SHIFT), 8);
+    put_le(record + 8, expr->minutes & (CRON_BIT(CRON_MAX_MINUTES) - 1), 8);
+    put_le(record + 16, expr->hours & (CRON_BIT(CRON_MAX_HOURS) - 1), 3);
+    put_le(record + 19, expr->days_of_month & ~CRON_BIT(0), 4);
+    put_le(record + 23, expr->months & (CRON_BIT(CRON_MAX_MONTHS) - 1), 2);
+    record[25] = (unsigned char) (expr->days_of_week & (CRON_BIT(7) - 1));
+    record[26] = expr->last_day_of_month;
+    record[27] = expr->nearest_weekday;
+    record[28] = expr->last_days_of_week;
+    record[29] = expr->nth_day_of_week;
+    put_le(record + 30, expr->year_first, 2);
+    put_le(record + 32, expr->years[0], 8);
+    put_le(record + 40, expr->years[1], 8);
+    return 0;
+}
+
+int cron_expr_view(const unsigned char* record, cron_expr* target, const char** error) {
+    const char* err_local;
+    cron_expr viewed;
+    uint64_t seconds;
+    if (!error) {
+        error = &err_local;
+    }
+    *error = NULL;
+    if (!record || !target) {
+        *error = "Invalid NULL record or target";
+        return -1;
+    }
+    seconds = get_le64(record);
+    if (CRON_RECORD_VERSION != seconds >> CRON_RECORD_VERSION_SHIFT) {
+        *error = "Unsupported record version";
+        return -1;
+    }
+    memset(&viewed, 0, sizeof(cron_expr));
+    viewed.seconds = seconds & (CRON_BIT(CRON_MAX_SECONDS) - 1);
+    viewed.minutes = get_le64(record + 8);
+    /* the last byte read is the first one of the days of month */
+    viewed.hours = get_le32(record + 16) & (uint32_t) (CRON_BIT(CRON_MAX_HOURS) - 1);
+    viewed.days_of_month = get_le32(record + 19);
+    viewed.months = (uint16_t) (record[23] | (record[24] << 8));
+    viewed.days_of_week = record[25];
+    viewed.last_day_of_month = record[26];
+    viewed.nearest_weekday = record[27];
+    viewed.last_days_of_week = record[28];
+    viewed.nth_day_of_week = record[29];
+    viewed.year_first = (uint16_t) (record[30] | (record[31] << 8));
+    viewed.years[0] = get_le64(record + 32);
+    viewed.years[1] = get_le64(record + 40);
+    if ((viewed.minutes >> CRON_MAX_MINUTES) || (viewed.days_of_month & 1) || (viewed.months >> CRON_MAX_MONTHS) ||
+            (viewed.days_of_week >> 7) || !valid_record_fields(&viewed)) {
+        *error = "Invalid record";
+        return -1;
+    }
+    viewed.shape = cron_expr_shape(&viewed);
+    *target = viewed;
+    return 0;
 }
 
-time_t cron_next(cron_expr* expr, time_t date) {
+time_t cron_next(const cron_expr* expr, time_t date) {
     /*
     The plan:
 
@@ -826,46 +1620,828 @@ time_t cron_next(cron_expr* expr, time_t date) {
     ...
      */
     if (!expr) return CRON_INVALID_INSTANT;
-    struct tm* calendar = cron_time(&date);
+#ifndef CRON_USE_LOCAL_TIME
+    if (CRON_SHAPE_GENERAL != expr->shape) {
+        int64_t next;
+        if ((int64_t) date < CRON_MIN_SECONDS || (int64_t) date >= CRON_MAX_SECONDS_SINCE_EPOCH ||
+                0 != next_by_shape(expr, (int64_t) date + 1, &next)) {
+            return CRON_INVALID_INSTANT;
+        }
+        return seconds_to_time(next);
+    }
+#endif /* CRON_USE_LOCAL_TIME */
+    struct tm calval;
+    struct tm* calendar = cron_time(&date, &calval);
     if (!calendar) return CRON_INVALID_INSTANT;
-    time_t original = cron_mktime(calendar);
-    if (CRON_INVALID_INSTANT == original) return CRON_INVALID_INSTANT;
+    struct tm original = *calendar;
 
-    int res = do_next(expr, calendar, calendar->tm_year);
+    int res = do_next(expr, calendar);
     if (0 != res) return CRON_INVALID_INSTANT;
 
-    time_t calculated = cron_mktime(calendar);
-    if (CRON_INVALID_INSTANT == calculated) return CRON_INVALID_INSTANT;
-    if (calculated == original) {
+    if (calendars_equal(calendar, &original)) {
         /* We arrived at the original timestamp - round up to the next whole second and try again... */
         res = add_to_field(calendar, CRON_CF_SECOND, 1);
         if (0 != res) return CRON_INVALID_INSTANT;
-        int res = do_next(expr, calendar, calendar->tm_year);
+        int res = do_next(expr, calendar);
         if (0 != res) return CRON_INVALID_INSTANT;
     }
 
+    /* the only conversion back to time_t */
     return cron_mktime(calendar);
 }
 
-void cron_expr_free(cron_expr* expr) {
-    if (!expr) return;
-    if (expr->seconds) {
-        free(expr->seconds);
+/**
+ * Moves a calendar matching the expression to the next matching time of day,
+ * returns 0 if there is none left on the same day.
+ */
+static int next_time_of_day(const cron_expr* expr, struct tm* calendar) {
+    int notfound = 0;
+    unsigned int value = next_set_bit(expr->seconds, CRON_MAX_SECONDS, calendar->tm_sec + 1, &notfound);
+    if (!notfound) {
+        calendar->tm_sec = (int) value;
+        return 1;
     }
-    if (expr->minutes) {
-        free(expr->minutes);
+    notfound = 0;
+    value = next_set_bit(expr->minutes, CRON_MAX_MINUTES, calendar->tm_min + 1, &notfound);
+    if (!notfound) {
+        calendar->tm_min = (int) value;
+        calendar->tm_sec = (int) ctz64(expr->seconds);
+        return 1;
     }
-    if (expr->hours) {
-        free(expr->hours);
+    notfound = 0;
+    value = next_set_bit(expr->hours, CRON_MAX_HOURS, calendar->tm_hour + 1, &notfound);
+    if (!notfound) {
+        calendar->tm_hour = (int) value;
+        calendar->tm_min = (int) ctz64(expr->minutes);
+        calendar->tm_sec = (int) ctz64(expr->seconds);
+        return 1;
     }
-    if (expr->days_of_week) {
-        free(expr->days_of_week);
+    return 0;
+}
+
+void cron_iter_init(cron_iter* iter, const cron_expr* expr, time_t date) {
+    if (!iter) return;
+    iter->expr = expr;
+    iter->state = CRON_ITER_START;
+    if (!expr || !cron_time(&date, &iter->calendar)) {
+        iter->state = CRON_ITER_END;
+        return;
     }
-    if (expr->days_of_month) {
-        free(expr->days_of_month);
+    /* dates are strictly after the start date */
+    if (0 != add_to_field(&iter->calendar, CRON_CF_SECOND, 1)) {
+        iter->state = CRON_ITER_END;
     }
-    if (expr->months) {
-        free(expr->months);
+}
+
+time_t cron_iter_next(cron_iter* iter) {
+    struct tm converted;
+    time_t res;
+    if (!iter || CRON_ITER_END == iter->state) return CRON_INVALID_INSTANT;
+    /* The calendar is kept between dates, the following dates on the same day
+       are found directly from the time of day bits, the full search
+       is only needed to move to the next matching day */
+    if (CRON_ITER_START == iter->state || !next_time_of_day(iter->expr, &iter->calendar)) {
+        if (CRON_ITER_START != iter->state && 0 != add_to_field(&iter->calendar, CRON_CF_SECOND, 1)) {
+            goto return_end;
+        }
+        if (0 != do_next(iter->expr, &iter->calendar)) {
+            goto return_end;
+        }
+    }
+    iter->state = CRON_ITER_DATE;
+    /* mktime may adjust the calendar passed to it in local time mode */
+    converted = iter->calendar;
+    res = cron_mktime(&converted);
+    if (CRON_INVALID_INSTANT == res) goto return_end;
+    return res;
+
+    return_end:
+        iter->state = CRON_ITER_END;
+        return CRON_INVALID_INSTANT;
+}
+
+size_t cron_next_n(const cron_expr* expr, time_t date, time_t* out, size_t n) {
+    size_t count = 0;
+    cron_iter iter;
+    if (!out) return 0;
+    cron_iter_init(&iter, expr, date);
+    while (count < n) {
+        out[count] = cron_iter_next(&iter);
+        if (CRON_INVALID_INSTANT == out[count]) break;
+        count += 1;
+    }
+    return count;
+}
+
+static int calendar_matches(const cron_expr* expr, const struct tm* calendar) {
+    return (int) ((expr->seconds >> calendar->tm_sec) & (expr->minutes >> calendar->tm_min) &
+            (expr->hours >> calendar->tm_hour) & 1) && calendar_day_matches(expr, calendar);
+}
+
+int cron_matches(const cron_expr* expr, time_t date) {
+    struct tm calval;
+    if (!expr || !cron_time(&date, &calval)) return 0;
+    return calendar_matches(expr, &calval);
+}
+
+int cron_matches_calendar(const cron_expr* expr, const struct tm* calendar) {
+    if (!expr || !calendar) return 0;
+    if (calendar->tm_sec < 0 || calendar->tm_sec >= CRON_MAX_SECONDS || calendar->tm_min < 0 ||
+            calendar->tm_min >= CRON_MAX_MINUTES || calendar->tm_hour < 0 || calendar->tm_hour >= CRON_MAX_HOURS ||
+            calendar->tm_mday < 1 || calendar->tm_mday >= CRON_MAX_DAYS_OF_MONTH || calendar->tm_mon < 0 ||
+            calendar->tm_mon >= CRON_MAX_MONTHS || calendar->tm_wday < 0 || calendar->tm_wday > 6) {
+        return 0;
     }
-    free(expr);
+    return calendar_matches(expr, calendar);
+}
+
+#ifndef CRON_USE_LOCAL_TIME
+static unsigned char second_of_day_matches(const cron_expr* expr, uint64_t day_match, uint32_t second) {
+    return (unsigned char) (day_match & (expr->hours >> (second / 3600)) &
+            (expr->minutes >> (second / 60 % 60)) & (expr->seconds >> (second % 60)) & 1);
+}
+
+/* dates checked at once when they are on the same day */
+#define CRON_MATCHES_CHUNK 8
+#endif /* CRON_USE_LOCAL_TIME */
+
+size_t cron_matches_n(const cron_expr* expr, const time_t* dates, size_t n, unsigned char* out) {
+    size_t count = 0;
+    size_t i;
+#ifndef CRON_USE_LOCAL_TIME
+    /* day of the previous date: its first second and whether it matches (0 or 1) */
+    int64_t day_start = 0;
+    uint64_t day_match = 0;
+    int day_valid = 0;
+    if (!expr || !dates || !out) return 0;
+    for (i = 0; i < n; ) {
+        size_t len = n - i < CRON_MATCHES_CHUNK ? n - i : CRON_MATCHES_CHUNK;
+        size_t j;
+        int same_day = day_valid;
+        for (j = 0; j < len && same_day; j++) {
+            same_day = (int64_t) dates[i + j] >= day_start && (int64_t) dates[i + j] < day_start + 86400;
+        }
+        if (same_day) {
+            /* branch free, only time of day is left to check */
+            for (j = 0; j < len; j++) {
+                out[i + j] = second_of_day_matches(expr, day_match, (uint32_t) ((int64_t) dates[i + j] - day_start));
+            }
+            i += len;
+            continue;
+        }
+        /* single date, decomposed if it is on another day, the following dates can reuse its day */
+        if (!day_valid || (int64_t) dates[i] < day_start || (int64_t) dates[i] >= day_start + 86400) {
+            struct tm calval;
+            day_valid = NULL != seconds_to_calendar((int64_t) dates[i], &calval);
+            if (day_valid) {
+                day_start = (int64_t) dates[i] - (calval.tm_hour * 3600 + calval.tm_min * 60 + calval.tm_sec);
+                day_match = (uint64_t) calendar_day_matches(expr, &calval);
+            }
+        }
+        out[i] = day_valid ? second_of_day_matches(expr, day_match, (uint32_t) ((int64_t) dates[i] - day_start)) : 0;
+        i += 1;
+    }
+#else /* CRON_USE_LOCAL_TIME */
+    /* offset may change during the day */
+    if (!expr || !dates || !out) return 0;
+    for (i = 0; i < n; i++) {
+        out[i] = (unsigned char) cron_matches(expr, dates[i]);
+    }
+#endif /* CRON_USE_LOCAL_TIME */
+    for (i = 0; i < n; i++) {
+        count += out[i];
+    }
+    return count;
+}
+
+#ifndef CRON_USE_LOCAL_TIME
+/* number of matching seconds of day before the specified one, 86400 gives the number of all of them */
+static int64_t fires_before_second(const cron_expr* expr, long second) {
+    unsigned int hour = (unsigned int) (second / 3600);
+    unsigned int minute = (unsigned int) (second / 60 % 60);
+    int64_t per_minute = popcount64(expr->seconds);
+    int64_t per_hour = (int64_t) popcount64(expr->minutes) * per_minute;
+    int64_t count = (int64_t) popcount64(expr->hours & (CRON_BIT(hour) - 1)) * per_hour;
+    if (expr->hours & CRON_BIT(hour)) {
+        count += (int64_t) popcount64(expr->minutes & (CRON_BIT(minute) - 1)) * per_minute;
+        if (expr->minutes & CRON_BIT(minute)) {
+            count += popcount64(expr->seconds & (CRON_BIT(second % 60) - 1));
+        }
+    }
+    return count;
+}
+
+/**
+ * Bit set of the matching days of the month of the specified day that are not before it
+ * and not after the 'last' day, bit N is the day 'month_base + N'.
+ * 'month_end' is set to the last day of the month.
+ */
+static uint32_t matching_days_from(const cron_expr* expr, long first, long last, long* month_base, long* month_end) {
+    long year;
+    unsigned int month;
+    unsigned int day;
+    uint32_t days;
+    civil_from_days(first, &year, &month, &day);
+    days = matching_days(expr, year, (int) month - 1) & ~(uint32_t) (CRON_BIT(day) - 1);
+    *month_base = first - (long) day;
+    *month_end = *month_base + days_in_month(year, (int) month - 1);
+    if (*month_end >= last) {
+        days &= (uint32_t) (CRON_BIT(day + (unsigned int) (last - first) + 1) - 1);
+    }
+    return days;
+}
+
+/* number of matching days in the range [first, last], walks the months of the range */
+static int64_t count_matching_days(const cron_expr* expr, long first, long last) {
+    int64_t count = 0;
+    long month_base;
+    long month_end;
+    for (; first <= last; first = month_end + 1) {
+        count += popcount64(matching_days_from(expr, first, last, &month_base, &month_end));
+    }
+    return count;
+}
+
+/* first matching day in the range [first, last], 'last + 1' if there is none */
+static long next_matching_day(const cron_expr* expr, long first, long last) {
+    long month_base;
+    long month_end;
+    for (; first <= last; first = month_end + 1) {
+        uint32_t days = matching_days_from(expr, first, last, &month_base, &month_end);
+        if (days) return month_base + (long) ctz64(days);
+    }
+    return last + 1;
+}
+
+/* clamps the range (from, to] of dates to the supported years, returns 0 if nothing is left */
+static int clamp_range(time_t from, time_t to, int64_t* first, int64_t* last) {
+    *first = (int64_t) from + 1;
+    *last = (int64_t) to;
+    if (*first < CRON_MIN_SECONDS) {
+        *first = CRON_MIN_SECONDS;
+    }
+    if (*last > CRON_MAX_SECONDS_SINCE_EPOCH) {
+        *last = CRON_MAX_SECONDS_SINCE_EPOCH;
+    }
+    return (int64_t) from < (int64_t) to && *first <= *last;
+}
+
+static long day_of_seconds(int64_t seconds) {
+    return (long) ((seconds - CRON_MIN_SECONDS) / 86400) + (long) (CRON_MIN_SECONDS / 86400);
+}
+#endif /* CRON_USE_LOCAL_TIME */
+
+int64_t cron_count_between(const cron_expr* expr, time_t from, time_t to) {
+#ifndef CRON_USE_LOCAL_TIME
+    int64_t first;
+    int64_t last;
+    long first_day;
+    long last_day;
+    long first_second;
+    long last_second;
+    int64_t count = 0;
+    if (!expr) return -1;
+    if (!clamp_range(from, to, &first, &last)) return 0;
+    first_day = day_of_seconds(first);
+    last_day = day_of_seconds(last);
+    first_second = (long) (first - (int64_t) first_day * 86400);
+    last_second = (long) (last - (int64_t) last_day * 86400);
+    if (first_day == last_day) {
+        if (0 == count_matching_days(expr, first_day, first_day)) return 0;
+        return fires_before_second(expr, last_second + 1) - fires_before_second(expr, first_second);
+    }
+    /* only the first and the last day are partial, all fires of the days between them
+       are counted from the number of matching days */
+    if (count_matching_days(expr, first_day, first_day)) {
+        count += fires_before_second(expr, 86400) - fires_before_second(expr, first_second);
+    }
+    if (count_matching_days(expr, last_day, last_day)) {
+        count += fires_before_second(expr, last_second + 1);
+    }
+    count += count_matching_days(expr, first_day + 1, last_day - 1) * fires_before_second(expr, 86400);
+    return count;
+#else /* CRON_USE_LOCAL_TIME */
+    /* offset may change during the days, dates are iterated */
+    int64_t count = 0;
+    time_t date;
+    cron_iter iter;
+    if (!expr) return -1;
+    cron_iter_init(&iter, expr, from);
+    while (CRON_INVALID_INSTANT != (date = cron_iter_next(&iter)) && date <= to) {
+        count += 1;
+    }
+    return count;
+#endif /* CRON_USE_LOCAL_TIME */
+}
+
+size_t cron_fill_between(const cron_expr* expr, time_t from, time_t to, time_t* out, size_t n) {
+    size_t count = 0;
+#ifndef CRON_USE_LOCAL_TIME
+    int64_t first;
+    int64_t last;
+    long day;
+    long last_day;
+    long second;
+    if (!expr || !out || !clamp_range(from, to, &first, &last)) return 0;
+    day = day_of_seconds(first);
+    last_day = day_of_seconds(last);
+    second = (long) (first - (int64_t) day * 86400);
+    while (count < n) {
+        long found = next_matching_day(expr, day, last_day);
+        if (found > last_day) break;
+        if (found != day) {
+            day = found;
+            second = 0;
+        }
+        for (second = next_second_of_day(expr, second); second >= 0 && count < n;
+                second = next_second_of_day(expr, second + 1)) {
+            int64_t date = (int64_t) day * 86400 + second;
+            if (date > last) return count;
+            out[count++] = seconds_to_time(date);
+        }
+        day += 1;
+        second = 0;
+    }
+#else /* CRON_USE_LOCAL_TIME */
+    time_t date;
+    cron_iter iter;
+    if (!expr || !out) return 0;
+    cron_iter_init(&iter, expr, from);
+    while (count < n && CRON_INVALID_INSTANT != (date = cron_iter_next(&iter)) && date <= to) {
+        out[count++] = date;
+    }
+#endif /* CRON_USE_LOCAL_TIME */
+    return count;
+}
+
+time_t cron_prev(const cron_expr* expr, time_t date) {
+    /*
+    The plan is the same as in 'cron_next', with fields searched backwards
+    and lower order fields set to their maximums instead of zero.
+     */
+    if (!expr) return CRON_INVALID_INSTANT;
+    struct tm calval;
+    struct tm* calendar = cron_time(&date, &calval);
+    if (!calendar) return CRON_INVALID_INSTANT;
+    struct tm original = *calendar;
+
+    int res = do_prev(expr, calendar);
+    if (0 != res) return CRON_INVALID_INSTANT;
+
+    if (calendars_equal(calendar, &original)) {
+        /* We arrived at the original timestamp - round down to the previous whole second and try again... */
+        res = add_to_field(calendar, CRON_CF_SECOND, -1);
+        if (0 != res) return CRON_INVALID_INSTANT;
+        res = do_prev(expr, calendar);
+        if (0 != res) return CRON_INVALID_INSTANT;
+    }
+
+    return cron_mktime(calendar);
+}
+
+/*
+ * Time zones loaded from TZif data (RFC 8536), offsets are resolved from
+ * the transitions table and the POSIX TZ rule from the footer of the data,
+ * without using libc time zone functions.
+ */
+
+/* TZif header: magic, version, 15 reserved bytes and 6 counts */
+#define CRON_TZIF_HEADER_LEN 44
+/* transitions closer than this to each other are not supported when converting wall clock to UTC */
+#define CRON_TZ_MIN_TRANSITIONS_GAP 86400
+/* default time of the rule transitions, 02:00:00 */
+#define CRON_TZ_DEFAULT_RULE_TIME 7200
+
+#define CRON_TZ_RULE_JULIAN 0
+#define CRON_TZ_RULE_ZERO_BASED 1
+#define CRON_TZ_RULE_MONTH 2
+
+typedef struct {
+    int kind;
+    int month;
+    int week;
+    int day;
+    long time;
+} cron_tz_rule;
+
+struct cron_tz {
+    /* transitions times (UTC) in ascending order and the offsets from them on */
+    int64_t* times;
+    long* offsets;
+    size_t len;
+    /* offset before the first transition */
+    long initial_offset;
+    /* POSIX TZ rule for the instants after the last transition */
+    int has_rule;
+    int has_dst;
+    long std_offset;
+    long dst_offset;
+    cron_tz_rule dst_start;
+    cron_tz_rule dst_end;
+};
+
+static uint32_t read_be32(const unsigned char* data) {
+    return ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | ((uint32_t) data[2] << 8) | (uint32_t) data[3];
+}
+
+static int64_t read_be64(const unsigned char* data) {
+    uint64_t val = ((uint64_t) read_be32(data) << 32) | read_be32(data + 4);
+    return (int64_t) val;
+}
+
+/* signed 32-bit value without relying on implementation-defined conversion */
+static long read_be32_signed(const unsigned char* data) {
+    uint32_t val = read_be32(data);
+    return val < 0x80000000u ? (long) val : -(long) (0xFFFFFFFFu - val) - 1;
+}
+
+/* parses POSIX TZ [+-]hh[:mm[:ss]], returns 0 on success */
+static int parse_tz_time(const char** pos, long* out) {
+    const char* str = *pos;
+    long sign = 1;
+    long parts[3] = {0, 0, 0};
+    int i;
+    if ('+' == *str || '-' == *str) {
+        sign = '-' == *str ? -1 : 1;
+        str++;
+    }
+    for (i = 0; i < 3; i++) {
+        if (i > 0) {
+            if (':' != *str) break;
+            str++;
+        }
+        if (!isdigit((unsigned char) *str)) return 1;
+        for (; isdigit((unsigned char) *str); str++) {
+            parts[i] = parts[i] * 10 + (*str - '0');
+            if (parts[i] > 167) return 1;
+        }
+    }
+    *out = sign * (parts[0] * 3600 + parts[1] * 60 + parts[2]);
+    *pos = str;
+    return 0;
+}
+
+static int parse_tz_name(const char** pos) {
+    const char* str = *pos;
+    if ('<' == *str) {
+        for (str++; '>' != *str; str++) {
+            if ('\0' == *str) return 1;
+        }
+        str++;
+    } else {
+        for (; isalpha((unsigned char) *str); str++) {}
+    }
+    if (str - *pos < 3) return 1;
+    *pos = str;
+    return 0;
+}
+
+static long parse_tz_number(const char** pos, long max) {
+    long val = 0;
+    if (!isdigit((unsigned char) **pos)) return -1;
+    for (; isdigit((unsigned char) **pos); (*pos)++) {
+        val = val * 10 + (**pos - '0');
+        if (val > max) return -1;
+    }
+    return val;
+}
+
+/* parses ',Jn[/time]', ',n[/time]' or ',Mm.w.d[/time]', returns 0 on success */
+static int parse_tz_rule(const char** pos, cron_tz_rule* rule) {
+    const char* str = *pos;
+    if (',' != *str) return 1;
+    str++;
+    if ('J' == *str) {
+        str++;
+        rule->kind = CRON_TZ_RULE_JULIAN;
+        rule->day = (int) parse_tz_number(&str, 365);
+        if (rule->day < 1) return 1;
+    } else if ('M' == *str) {
+        str++;
+        rule->kind = CRON_TZ_RULE_MONTH;
+        rule->month = (int) parse_tz_number(&str, 12);
+        if (rule->month < 1 || '.' != *str++) return 1;
+        rule->week = (int) parse_tz_number(&str, 5);
+        if (rule->week < 1 || '.' != *str++) return 1;
+        rule->day = (int) parse_tz_number(&str, 6);
+        if (rule->day < 0) return 1;
+    } else {
+        rule->kind = CRON_TZ_RULE_ZERO_BASED;
+        rule->day = (int) parse_tz_number(&str, 365);
+        if (rule->day < 0) return 1;
+    }
+    rule->time = CRON_TZ_DEFAULT_RULE_TIME;
+    if ('/' == *str) {
+        str++;
+        if (0 != parse_tz_time(&str, &rule->time)) return 1;
+    }
+    *pos = str;
+    return 0;
+}
+
+/* parses POSIX TZ string from the footer, 'end' points after the string, returns 0 on success */
+static int parse_tz_footer(cron_tz* tz, const char* str, const char* end) {
+    long offset;
+    if (str == end) return 0;
+    if (0 != parse_tz_name(&str)) return 1;
+    /* POSIX offsets are west of Greenwich */
+    if (0 != parse_tz_time(&str, &offset)) return 1;
+    tz->std_offset = -offset;
+    tz->dst_offset = tz->std_offset;
+    if (str != end) {
+        if (0 != parse_tz_name(&str)) return 1;
+        tz->dst_offset = tz->std_offset + 3600;
+        if (str != end && ',' != *str) {
+            if (0 != parse_tz_time(&str, &offset)) return 1;
+            tz->dst_offset = -offset;
+        }
+        if (0 != parse_tz_rule(&str, &tz->dst_start)) return 1;
+        if (0 != parse_tz_rule(&str, &tz->dst_end)) return 1;
+        tz->has_dst = 1;
+    }
+    if (str != end) return 1;
+    tz->has_rule = 1;
+    return 0;
+}
+
+/* local time (in the offset in effect before it) of the rule transition in the specified year */
+static int64_t tz_rule_local_time(const cron_tz_rule* rule, long year) {
+    long days = days_from_civil(year, 1, 1);
+    if (CRON_TZ_RULE_JULIAN == rule->kind) {
+        /* February 29 is never counted */
+        days += rule->day - 1 + (is_leap_year(year) && rule->day >= 60 ? 1 : 0);
+    } else if (CRON_TZ_RULE_ZERO_BASED == rule->kind) {
+        days += rule->day;
+    } else {
+        int first_wday;
+        int day;
+        days = days_from_civil(year, (unsigned int) rule->month, 1);
+        first_wday = weekday_from_days(days);
+        day = (rule->day - first_wday + 7) % 7 + (rule->week - 1) * 7;
+        /* week 5 is the last week of the month */
+        while (day >= days_in_month(year, rule->month - 1)) {
+            day -= 7;
+        }
+        days += day;
+    }
+    return (int64_t) days * 86400 + rule->time;
+}
+
+static long tz_rule_offset(const cron_tz* tz, int64_t date) {
+    int64_t local = date + tz->std_offset;
+    long days = (long) (local / 86400) - (local % 86400 < 0 ? 1 : 0);
+    long year;
+    unsigned int month;
+    unsigned int day;
+    int64_t start;
+    int64_t end;
+    if (!tz->has_dst) return tz->std_offset;
+    civil_from_days(days, &year, &month, &day);
+    start = tz_rule_local_time(&tz->dst_start, year) - tz->std_offset;
+    end = tz_rule_local_time(&tz->dst_end, year) - tz->dst_offset;
+    if (start < end) {
+        return date >= start && date < end ? tz->dst_offset : tz->std_offset;
+    }
+    /* southern hemisphere, DST spans the new year */
+    return date >= end && date < start ? tz->std_offset : tz->dst_offset;
+}
+
+static long tz_offset(const cron_tz* tz, int64_t date) {
+    size_t lo = 0;
+    size_t hi = tz->len;
+    if (0 == tz->len || date < tz->times[0]) {
+        return 0 == tz->len && tz->has_rule ? tz_rule_offset(tz, date) : tz->initial_offset;
+    }
+    if (date >= tz->times[tz->len - 1] && tz->has_rule) {
+        return tz_rule_offset(tz, date);
+    }
+    /* last transition not after the date */
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (tz->times[mid] <= date) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return tz->offsets[lo];
+}
+
+/* first instant in (from, to] with offset different from the one at 'from' */
+static int64_t tz_find_transition(const cron_tz* tz, int64_t from, int64_t to) {
+    long before = tz_offset(tz, from);
+    while (to - from > 1) {
+        int64_t mid = from + (to - from) / 2;
+        if (tz_offset(tz, mid) == before) {
+            from = mid;
+        } else {
+            to = mid;
+        }
+    }
+    return to;
+}
+
+/**
+ * Converts wall clock time to UTC. Wall clock time repeated in an overlap
+ * (offset decreases) is converted to its first occurrence, wall clock time
+ * skipped in a gap (offset increases) to the end of the gap.
+ */
+static int64_t tz_wall_to_utc(const cron_tz* tz, int64_t wall) {
+    long early = tz_offset(tz, wall - CRON_TZ_MIN_TRANSITIONS_GAP);
+    long late = tz_offset(tz, wall + CRON_TZ_MIN_TRANSITIONS_GAP);
+    if (tz_offset(tz, wall - early) == early) return wall - early;
+    if (tz_offset(tz, wall - late) == late) return wall - late;
+    return tz_find_transition(tz, wall - late, wall - early);
+}
+
+/* reads one TZif data block, 'time_size' is 4 for version 1 block and 8 for others */
+static int read_tzif_block(cron_tz* tz, const unsigned char* data, size_t len, size_t time_size, size_t* block_len) {
+    size_t isutcnt;
+    size_t isstdcnt;
+    size_t leapcnt;
+    size_t timecnt;
+    size_t typecnt;
+    size_t charcnt;
+    const unsigned char* times;
+    const unsigned char* indices;
+    const unsigned char* types;
+    size_t i;
+    if (len < CRON_TZIF_HEADER_LEN || 0 != memcmp(data, "TZif", 4)) return 1;
+    isutcnt = read_be32(data + 20);
+    isstdcnt = read_be32(data + 24);
+    leapcnt = read_be32(data + 28);
+    timecnt = read_be32(data + 32);
+    typecnt = read_be32(data + 36);
+    charcnt = read_be32(data + 40);
+    /* counts are limited so that the sizes below cannot overflow */
+    if (0 == typecnt || typecnt > 256 || timecnt > 0xFFFFFF || charcnt > 0xFFFFFF || leapcnt > 0xFFFFFF ||
+            isutcnt > typecnt || isstdcnt > typecnt) return 1;
+    *block_len = CRON_TZIF_HEADER_LEN + timecnt * (time_size + 1) + typecnt * 6 + charcnt +
+            leapcnt * (time_size + 4) + isstdcnt + isutcnt;
+    if (len < *block_len) return 1;
+    times = data + CRON_TZIF_HEADER_LEN;
+    indices = times + timecnt * time_size;
+    types = indices + timecnt;
+    if (tz->times) {
+        cron_free(tz->times);
+    }
+    tz->times = (int64_t*) cron_malloc(timecnt * sizeof(int64_t) + timecnt * sizeof(long) + 1);
+    if (!tz->times) return 1;
+    tz->offsets = (long*) (tz->times + timecnt);
+    tz->len = 0;
+    tz->initial_offset = read_be32_signed(types);
+    for (i = 0; i < timecnt; i++) {
+        int64_t time = 8 == time_size ? read_be64(times + i * 8) : (int64_t) read_be32_signed(times + i * 4);
+        long offset;
+        if (indices[i] >= typecnt) return 1;
+        offset = read_be32_signed(types + indices[i] * 6);
+        if (tz->len > 0 && time <= tz->times[tz->len - 1]) return 1;
+        /* transitions changing only DST flag or abbreviation do not matter */
+        if (offset == (tz->len > 0 ? tz->offsets[tz->len - 1] : tz->initial_offset)) continue;
+        tz->times[tz->len] = time;
+        tz->offsets[tz->len] = offset;
+        tz->len += 1;
+    }
+    return 0;
+}
+
+cron_tz* cron_tz_load(const void* data, size_t len, const char** error) {
+    const char* err_local;
+    const unsigned char* bytes = (const unsigned char*) data;
+    size_t block_len = 0;
+    cron_tz* tz = NULL;
+    if (!error) {
+        error = &err_local;
+    }
+    *error = NULL;
+    if (!data) {
+        *error = "Invalid NULL time zone data";
+        goto return_error;
+    }
+    tz = (cron_tz*) cron_malloc(sizeof(cron_tz));
+    if (!tz) {
+        *error = "Memory allocation error";
+        goto return_error;
+    }
+    memset(tz, 0, sizeof(cron_tz));
+    if (0 != read_tzif_block(tz, bytes, len, 4, &block_len)) {
+        *error = "Invalid TZif data";
+        goto return_error;
+    }
+    if (bytes[4] >= '2') {
+        /* version 2+ repeats the data with 64-bit times, followed by the footer */
+        const char* footer;
+        const char* footer_end;
+        size_t offset = block_len;
+        if (0 != read_tzif_block(tz, bytes + offset, len - offset, 8, &block_len)) {
+            *error = "Invalid TZif version 2+ data";
+            goto return_error;
+        }
+        offset += block_len;
+        footer = (const char*) bytes + offset + 1;
+        footer_end = (const char*) memchr(footer, '\n', len > offset + 1 ? len - offset - 1 : 0);
+        if (len <= offset + 1 || '\n' != bytes[offset] || !footer_end ||
+                0 != parse_tz_footer(tz, footer, footer_end)) {
+            *error = "Invalid TZif footer";
+            goto return_error;
+        }
+    }
+    return tz;
+
+    return_error:
+    cron_tz_free(tz);
+    return NULL;
+}
+
+cron_tz* cron_tz_load_file(const char* path, const char** error) {
+#ifndef CRON_NO_FILE_IO
+    const char* err_local;
+    FILE* file = NULL;
+    unsigned char* data = NULL;
+    long len;
+    cron_tz* tz = NULL;
+    if (!error) {
+        error = &err_local;
+    }
+    *error = NULL;
+    if (!path) {
+        *error = "Invalid NULL time zone file path";
+        goto return_res;
+    }
+    file = fopen(path, "rb");
+    if (!file || 0 != fseek(file, 0, SEEK_END) || (len = ftell(file)) < 0 || 0 != fseek(file, 0, SEEK_SET)) {
+        *error = "Time zone file read error";
+        goto return_res;
+    }
+    data = (unsigned char*) cron_malloc((size_t) len + 1);
+    if (!data) {
+        *error = "Memory allocation error";
+        goto return_res;
+    }
+    if ((size_t) len != fread(data, 1, (size_t) len, file)) {
+        *error = "Time zone file read error";
+        goto return_res;
+    }
+    tz = cron_tz_load(data, (size_t) len, error);
+
+    return_res:
+    if (file) {
+        fclose(file);
+    }
+    if (data) {
+        cron_free(data);
+    }
+    return tz;
+#else /* CRON_NO_FILE_IO */
+    (void) path;
+    if (error) {
+        *error = "Time zone files are not supported on this platform";
+    }
+    return NULL;
+#endif /* CRON_NO_FILE_IO */
+}
+
+long cron_tz_offset(const cron_tz* tz, time_t date) {
+    if (!tz) return 0;
+    return tz_offset(tz, (int64_t) date);
+}
+
+time_t cron_next_tz(const cron_expr* expr, const cron_tz* tz, time_t date) {
+    /*
+    The expression is matched against wall clock time, handled as UTC:
+    the search starts from the wall clock time of the next second, and the
+    matching wall clock time is converted back with 'tz_wall_to_utc'
+     */
+    struct tm calval;
+    int64_t from;
+    int64_t wall;
+    if (!expr || !tz) return CRON_INVALID_INSTANT;
+    from = (int64_t) date + 1;
+    wall = from + tz_offset(tz, from);
+    if (tz_wall_to_utc(tz, wall) < from) {
+        /* second pass of the wall clock times repeated in an overlap, they fired in the first pass */
+        long early = tz_offset(tz, from - CRON_TZ_MIN_TRANSITIONS_GAP);
+        int64_t transition = tz_find_transition(tz, from - (early - tz_offset(tz, from)) - 1, from);
+        wall = transition + early;
+    }
+    if (CRON_SHAPE_GENERAL != expr->shape) {
+        if (0 != next_by_shape(expr, wall, &wall)) return CRON_INVALID_INSTANT;
+        return seconds_to_time(tz_wall_to_utc(tz, wall));
+    }
+    if (!seconds_to_calendar(wall, &calval)) return CRON_INVALID_INSTANT;
+    if (0 != do_next(expr, &calval)) return CRON_INVALID_INSTANT;
+    return seconds_to_time(tz_wall_to_utc(tz, calendar_to_seconds(&calval)));
+}
+
+void cron_tz_free(cron_tz* tz) {
+    if (!tz) return;
+    if (tz->times) {
+        cron_free(tz->times);
+    }
+    cron_free(tz);
+}
+
+void cron_expr_free(cron_expr* expr) {
+    if (!expr) return;
+    cron_free(expr);
 }
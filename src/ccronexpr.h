@@ -14,22 +14,61 @@
 #include <time64.h>
 #endif /* ANDROID */
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /**
- * Parsed cron expression
+ * Parsed cron expression, each field is stored as a bit set
+ * where bit N is set when value N matches:
+ * seconds and minutes 0-59, hours 0-23, days of week 0-6 (Sunday is 0),
+ * days of month 1-31, months 0-11 (January is 0).
+ * Quartz-style day items are stored separately from the bit sets, a day
+ * matches when it is in the bit set or matches an item, 0 means no item.
+ * Years of the optional 7th field (1-9999, within 128 years from the first
+ * one) are stored as a bit set starting from the first year.
  */
 typedef struct {
-    char* seconds;
-    char* minutes;
-    char* hours;
-    char* days_of_week;
-    char* days_of_month;
-    char* months;
+    uint64_t seconds;
+    uint64_t minutes;
+    uint32_t hours;
+    uint32_t days_of_month;
+    uint16_t months;
+    uint8_t days_of_week;
+    /* evaluation strategy chosen by the parser, 0 (general) if the fields are set by client */
+    uint8_t shape;
+    /* 'L' (1) or 'L-n' (n + 1), days before the last day of month plus one */
+    uint8_t last_day_of_month;
+    /* 'nW' (n), nearest weekday to the day, 'LW' (32) last weekday of month */
+    uint8_t nearest_weekday;
+    /* 'dL', bit set of days of week matching their last occurrence in the month */
+    uint8_t last_days_of_week;
+    /* 'd#n' ((n << 3) | d), n-th occurrence of the day of week in the month */
+    uint8_t nth_day_of_week;
+    /* optional year field, bit N is set when the year 'year_first + N' matches */
+    uint64_t years[2];
+    /* first year of the year field, 0 (no year field) if any year matches */
+    uint16_t year_first;
 } cron_expr;
 
+#define CRON_ITER_START 0
+#define CRON_ITER_DATE 1
+#define CRON_ITER_END 2
+
+/**
+ * Iterator over the 'fire' dates of a cron expression, keeps the
+ * calendar of the last date between calls. Can be allocated by the client
+ * anywhere (no cleanup needed), fields should NOT be accessed by client.
+ * The expression must stay valid while the iterator is used.
+ */
+typedef struct {
+    const cron_expr* expr;
+    struct tm calendar;
+    int state;
+} cron_iter;
+
 /**
  * Parses specified cron expression.
  * 
@@ -44,17 +83,240 @@ typedef struct {
  */
 cron_expr* cron_parse_expr(const char* expression, const char** error);
 
+/**
+ * Parses specified cron expression into the storage provided by client,
+ * does not use heap. The expression is self-contained, it can be placed
+ * anywhere (stack, static array, arena) and copied, no cleanup is needed.
+ *
+ * @param expression cron expression as nul-terminated string,
+ *        should be no longer that 256 bytes
+ * @param target output parsed expression, is not modified on error
+ * @param error output error message, will be set to string literal
+ *        error message in case of error. Will be set to NULL on success.
+ *        The error message should NOT be freed by client.
+ * @return 0 in case of success, -1 on error.
+ */
+int cron_parse_expr_into(const char* expression, cron_expr* target, const char** error);
+
+/* size of the binary record of an expression in bytes */
+#define CRON_EXPR_RECORD_SIZE 48
+
+/**
+ * Writes the expression to a fixed-size binary record. The record is the same
+ * on all platforms (fields in little-endian byte order), so records can be
+ * stored in files and shared between machines, and read back with 'cron_expr_view'
+ * much faster than parsing the expression again.
+ *
+ * @param expr parsed cron expression
+ * @param record output record, must have space for 'CRON_EXPR_RECORD_SIZE' bytes
+ * @return 0 in case of success, -1 if the expression has day items or year field
+ *         values that the parser does not produce, or a field without values.
+ */
+int cron_expr_serialize(const cron_expr* expr, unsigned char* record);
+
+/**
+ * Reads the expression from the binary record written by 'cron_expr_serialize',
+ * does not use heap. Only shifts and masks are done, the record can be used
+ * directly from memory (for example a memory mapped file of records).
+ *
+ * @param record record of 'CRON_EXPR_RECORD_SIZE' bytes
+ * @param target output expression, is not modified on error
+ * @param error output error message, will be set to string literal
+ *        error message in case of error. Will be set to NULL on success.
+ *        The error message should NOT be freed by client.
+ * @return 0 in case of success, -1 on error.
+ */
+int cron_expr_view(const unsigned char* record, cron_expr* target, const char** error);
+
 /**
  * Uses the specified expression to calculate the next 'fire' date after
  * the specified date. All dates are processed as UTC (GMT) dates 
  * without timezones information. To use local dates (current system timezone) 
  * instead of GMT compile with '-DCRON_USE_LOCAL_TIME'
  * 
+ * This function is reentrant: it keeps the calendar on the stack and does not
+ * modify the expression, so it is safe to call it concurrently from multiple
+ * threads with the same parsed expression.
+ * 
+ * @param expr parsed cron expression to use in next date calculation
+ * @param date start date to start calculation from
+ * @return next 'fire' date in case of success, '((time_t) -1)' in case of error.
+ */
+time_t cron_next(const cron_expr* expr, time_t date);
+
+/**
+ * Initializes iterator over the 'fire' dates of the specified expression
+ * after the specified date.
+ * 
+ * @param iter iterator to initialize
+ * @param expr parsed cron expression to iterate over
+ * @param date start date, first 'fire' date will be after it
+ */
+void cron_iter_init(cron_iter* iter, const cron_expr* expr, time_t date);
+
+/**
+ * Advances iterator to the next 'fire' date. Dates are the same as from calling
+ * 'cron_next' in a loop, but following dates on the same day are found
+ * without any search. Iterators are independent from each other and can be used
+ * from different threads.
+ * 
+ * @param iter iterator initialized with 'cron_iter_init'
+ * @return next 'fire' date in case of success, '((time_t) -1)' in case of error,
+ *         all following calls will return error too.
+ */
+time_t cron_iter_next(cron_iter* iter);
+
+/**
+ * Uses the specified expression to calculate up to 'n' consecutive 'fire' dates
+ * after the specified date. Gives the same dates as calling 'cron_next' in a loop,
+ * but uses 'cron_iter' to keep the calendar between the dates instead of starting
+ * each search from scratch. This function is reentrant.
+ * 
+ * @param expr parsed cron expression to use in next dates calculation
+ * @param date start date to start calculation from
+ * @param out array to write 'fire' dates to, must have space for 'n' dates
+ * @param n maximum number of dates to calculate
+ * @return number of dates written to 'out', less than 'n' in case of error.
+ */
+size_t cron_next_n(const cron_expr* expr, time_t date, time_t* out, size_t n);
+
+/**
+ * Checks whether the expression fires at the specified date (whole second),
+ * same as 'cron_next(expr, date - 1) == date', but without the search.
+ *
+ * @param expr parsed cron expression
+ * @param date date to check
+ * @return 1 if the expression fires at the date, 0 otherwise (or on error).
+ */
+int cron_matches(const cron_expr* expr, time_t date);
+
+/**
+ * Checks whether the expression fires at the date of the specified calendar, the same
+ * as 'cron_matches', but the date is already decomposed (for example to the wall
+ * clock time of a 'cron_tz').
+ *
+ * @param expr parsed cron expression
+ * @param calendar date to check, 'tm_sec', 'tm_min', 'tm_hour', 'tm_mday', 'tm_mon',
+ *        'tm_wday' and 'tm_year' (for the day items like 'L' and the year field) are used
+ * @return 1 if the expression fires at the date, 0 otherwise (or on error).
+ */
+int cron_matches_calendar(const cron_expr* expr, const struct tm* calendar);
+
+/**
+ * Checks the array of dates with 'cron_matches'. Dates on the same day as
+ * the previous one reuse its decomposition, so sorted (or mostly sorted)
+ * arrays are checked fastest.
+ *
+ * @param expr parsed cron expression
+ * @param dates dates to check
+ * @param n number of dates
+ * @param out output array, 'out[i]' is set to 1 if the expression
+ *        fires at 'dates[i]', 0 otherwise. Must have space for 'n' values.
+ * @return number of dates the expression fires at.
+ */
+size_t cron_matches_n(const cron_expr* expr, const time_t* dates, size_t n, unsigned char* out);
+
+/**
+ * Counts the 'fire' dates of the expression after the 'from' date and not after
+ * the 'to' date, the same dates as from calling 'cron_next' in a loop.
+ * In UTC mode the dates are not iterated: the matching times of day are counted
+ * once and multiplied by the number of matching days, found a month at a time.
+ * Dates outside of the years 1-9999 are not counted.
+ *
+ * @param expr parsed cron expression
+ * @param from start of the range (exclusive)
+ * @param to end of the range (inclusive)
+ * @return number of 'fire' dates in the range, -1 in case of error.
+ */
+int64_t cron_count_between(const cron_expr* expr, time_t from, time_t to);
+
+/**
+ * Writes up to 'n' 'fire' dates of the expression after the 'from' date and
+ * not after the 'to' date, the same dates as from 'cron_count_between'.
+ * Days that do not match are skipped a month at a time.
+ *
+ * @param expr parsed cron expression
+ * @param from start of the range (exclusive)
+ * @param to end of the range (inclusive)
+ * @param out array to write 'fire' dates to, must have space for 'n' dates
+ * @param n maximum number of dates to write
+ * @return number of dates written to 'out'.
+ */
+size_t cron_fill_between(const cron_expr* expr, time_t from, time_t to, time_t* out, size_t n);
+
+/**
+ * Uses the specified expression to calculate the previous 'fire' date before
+ * the specified date, the reverse of 'cron_next'. Dates are processed the
+ * same way as in 'cron_next' and this function is reentrant too.
+ * 
+ * @param expr parsed cron expression to use in previous date calculation
+ * @param date start date to start calculation from
+ * @return previous 'fire' date in case of success, '((time_t) -1)' in case of error.
+ */
+time_t cron_prev(const cron_expr* expr, time_t date);
+
+/**
+ * Time zone loaded from TZif data (the format of zoneinfo files), holds
+ * the table of UTC offset transitions and the rule for the dates after
+ * the last transition. Can be shared between threads, no global state
+ * (like 'TZ' environment variable) is used.
+ */
+typedef struct cron_tz cron_tz;
+
+/**
+ * Loads time zone from TZif data in memory, data is not needed after this call.
+ *
+ * @param data TZif data (contents of a zoneinfo file)
+ * @param len length of the data in bytes
+ * @param error output error message, will be set to string literal
+ *        error message in case of error. Will be set to NULL on success.
+ * @return time zone in case of success, must be freed by client using
+ *         'cron_tz_free' function. NULL is returned on error.
+ */
+cron_tz* cron_tz_load(const void* data, size_t len, const char** error);
+
+/**
+ * Loads time zone from TZif file, like '/usr/share/zoneinfo/Europe/Berlin'.
+ * Not supported (always returns NULL) when compiled with '-DCRON_NO_FILE_IO'
+ * and on ESP8266/AVR boards.
+ *
+ * @param path path to the TZif file
+ * @param error output error message, will be set to string literal
+ *        error message in case of error. Will be set to NULL on success.
+ * @return time zone in case of success, must be freed by client using
+ *         'cron_tz_free' function. NULL is returned on error.
+ */
+cron_tz* cron_tz_load_file(const char* path, const char** error);
+
+/**
+ * Returns UTC offset of the time zone at the specified date.
+ *
+ * @param tz time zone
+ * @param date date
+ * @return offset in seconds east of UTC
+ */
+long cron_tz_offset(const cron_tz* tz, time_t date);
+
+/**
+ * Same as 'cron_next', but the expression is matched against the wall clock
+ * time of the specified time zone, independently of '-DCRON_USE_LOCAL_TIME'.
+ * Wall clock times skipped by a forward offset change (DST gap) fire once at
+ * the end of the gap. Wall clock times repeated by a backward offset change
+ * (DST overlap) fire only in their first occurrence.
+ *
  * @param expr parsed cron expression to use in next date calculation
+ * @param tz time zone
  * @param date start date to start calculation from
  * @return next 'fire' date in case of success, '((time_t) -1)' in case of error.
  */
-time_t cron_next(cron_expr* expr, time_t date);
+time_t cron_next_tz(const cron_expr* expr, const cron_tz* tz, time_t date);
+
+/**
+ * Frees the time zone.
+ *
+ * @param tz time zone to free
+ */
+void cron_tz_free(cron_tz* tz);
 
 /**
  * Frees the memory allocated by the specified cron expression
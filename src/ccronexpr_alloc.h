@@ -0,0 +1,21 @@
+/*
+ * File:   ccronexpr_alloc.h
+ *
+ * Allocation functions used by the library sources, not a public header.
+ */
+
+#ifndef CCRONEXPR_ALLOC_H
+#define	CCRONEXPR_ALLOC_H
+
+#include <stdlib.h>
+
+/* Allocation functions can be overridden to count allocations in tests */
+#ifdef CRON_TEST_MALLOC
+void* cron_malloc(size_t n);
+void cron_free(void* p);
+#else /* CRON_TEST_MALLOC */
+#define cron_malloc(x) malloc(x)
+#define cron_free(x) free(x)
+#endif /* CRON_TEST_MALLOC */
+
+#endif	/* CCRONEXPR_ALLOC_H */
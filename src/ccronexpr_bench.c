@@ -0,0 +1,601 @@
+/*
+ * File:   ccronexpr_bench.c
+ *
+ * Benchmarks, compile with '-DCRON_BENCH' and optimizations enabled,
+ * add '-DCRON_TEST_MALLOC' to report allocation counts.
+ */
+#ifdef CRON_BENCH
+#ifndef _WIN32
+/* clock_gettime */
+#define _POSIX_C_SOURCE 200809L
+#endif /* _WIN32 */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ccronexpr.h"
+#include "ccronexpr_sched.h"
+#include "ccronexpr_cache.h"
+#include "ccronexpr_set.h"
+#include "ccronexpr_store.h"
+#include "ccronexpr_wheel.h"
+
+#define BENCH_START_DATE 1341136430
+#define INVALID_INSTANT ((time_t) -1)
+
+/* each operation is timed in batches, percentiles are over per-batch ns/op */
+#define BENCH_BATCHES 200
+#define BENCH_BATCH_SIZE 64
+
+typedef struct {
+    const char* kind;
+    const char* expr;
+} bench_case;
+
+static const bench_case BENCH_CORPUS[] = {
+    {"dense", "* * * * * *"},
+    {"dense", "*/5 * * * * *"},
+    {"dense", "0-30 */2 * * * *"},
+    {"sparse", "0 0 0 1 1 *"},
+    {"sparse", "0 30 23 31 12 *"},
+    {"sparse", "0 0 12 13 * FRI"},
+    {"leap_day", "0 0 0 29 2 *"},
+    {"leap_day", "0 0 12 29 2 ?"},
+    {"weekday", "0 0 7 ? * MON-FRI"},
+    {"weekday", "0 */15 9-17 * * MON-FRI"},
+    {"weekday", "0 0 0 ? * SAT,SUN"},
+    /* distinct expressions of 'test_expr' in ccronexpr_test.c */
+    {"test_expr", "*/15 * 1-4 * * *"},
+    {"test_expr", "0 */2 1-4 * * *"},
+    {"test_expr", "10 * * * * *"},
+    {"test_expr", "11 * * * * *"},
+    {"test_expr", "10-15 * * * * *"},
+    {"test_expr", "0 * * * * *"},
+    {"test_expr", "0 11 * * * *"},
+    {"test_expr", "0 10 * * * *"},
+    {"test_expr", "0 0 * * * *"},
+    {"test_expr", "0 0 0 * * *"},
+    {"test_expr", "* * * 10 * *"},
+    {"test_expr", "0 0 0 1 * *"},
+    {"test_expr", "0 0 0 31 * *"},
+    {"test_expr", "* * * * * 2"},
+    {"test_expr", "55 5 * * * *"},
+    {"test_expr", "55 * 10 * * *"},
+    {"test_expr", "* 5 10 * * *"},
+    {"test_expr", "55 * * 3 * *"},
+    {"test_expr", "* * * 3 11 *"},
+    {"test_expr", "0 30 23 30 1/3 ?"},
+    {"test_expr", "0 0 0 * 4,5 *"},
+    {"test_expr", "0 0 0 1-7 * MON"},
+    {"test_expr", "0 0 0 31 * MON"}
+};
+
+#define BENCH_CORPUS_LEN (sizeof(BENCH_CORPUS) / sizeof(BENCH_CORPUS[0]))
+
+#ifdef CRON_TEST_MALLOC
+static long bench_allocations = 0;
+static long bench_frees = 0;
+
+void* cron_malloc(size_t n) {
+    bench_allocations += 1;
+    return malloc(n);
+}
+
+void cron_free(void* p) {
+    bench_frees += 1;
+    free(p);
+}
+#endif /* CRON_TEST_MALLOC */
+
+static double now_ns(void) {
+#ifndef _WIN32
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+#else /* _WIN32 */
+    return (double) clock() * 1e9 / CLOCKS_PER_SEC;
+#endif /* _WIN32 */
+}
+
+static double elapsed_ns(clock_t start) {
+    return (double) (clock() - start) * 1e9 / CLOCKS_PER_SEC;
+}
+
+/* statistics of one operation over all of its batches */
+typedef struct {
+    double samples[BENCH_CORPUS_LEN * BENCH_BATCHES];
+    size_t len;
+    double total_ns;
+    long ops;
+    long allocs;
+} bench_stats;
+
+static void stats_add(bench_stats* stats, double ns, long ops, long allocs) {
+    stats->samples[stats->len] = ns / ops;
+    stats->len += 1;
+    stats->total_ns += ns;
+    stats->ops += ops;
+    stats->allocs += allocs;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double da = *(const double*) a;
+    double db = *(const double*) b;
+    return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+/* machine-readable line: 'key=value' pairs separated by spaces, expression is quoted */
+static void stats_print(bench_stats* stats, const char* op, const char* kind, const char* expr) {
+    qsort(stats->samples, stats->len, sizeof(double), compare_doubles);
+    printf("op=%s kind=%s expr=\"%s\" ops=%ld ns/op=%.1f p50=%.1f p90=%.1f p99=%.1f",
+            op, kind, expr, stats->ops, stats->total_ns / stats->ops,
+            stats->samples[stats->len * 50 / 100], stats->samples[stats->len * 90 / 100],
+            stats->samples[stats->len * 99 / 100]);
+#ifdef CRON_TEST_MALLOC
+    printf(" allocs/op=%.2f\n", (double) stats->allocs / stats->ops);
+#else /* CRON_TEST_MALLOC */
+    printf(" allocs/op=na\n");
+#endif /* CRON_TEST_MALLOC */
+}
+
+static long allocs_count(void) {
+#ifdef CRON_TEST_MALLOC
+    return bench_allocations + bench_frees;
+#else /* CRON_TEST_MALLOC */
+    return 0;
+#endif /* CRON_TEST_MALLOC */
+}
+
+#define BENCH_OP_PARSE 0
+#define BENCH_OP_PARSE_INTO 1
+#define BENCH_OP_NEXT 2
+#define BENCH_OP_FREE 3
+#define BENCH_OP_MATCHES 4
+#define BENCH_OP_MATCHES_N 5
+#define BENCH_OPS_COUNT 6
+
+static const char* BENCH_OP_NAMES[BENCH_OPS_COUNT] = {"parse", "parse_into", "next", "free", "matches", "matches_n"};
+
+static void bench_expr(const bench_case* bc, bench_stats* per_expr, bench_stats* all) {
+    cron_expr* exprs[BENCH_BATCH_SIZE];
+    cron_expr target;
+    time_t dates[BENCH_BATCH_SIZE];
+    unsigned char matched[BENCH_BATCH_SIZE];
+    long matches = 0;
+    time_t date = BENCH_START_DATE;
+    double start;
+    double ns;
+    long allocs;
+    int op;
+    int batch;
+    int i;
+    for (batch = 0; batch < BENCH_BATCHES; batch++) {
+        allocs = allocs_count();
+        start = now_ns();
+        for (i = 0; i < BENCH_BATCH_SIZE; i++) {
+            exprs[i] = cron_parse_expr(bc->expr, NULL);
+        }
+        ns = now_ns() - start;
+        stats_add(&per_expr[BENCH_OP_PARSE], ns, BENCH_BATCH_SIZE, allocs_count() - allocs);
+        stats_add(&all[BENCH_OP_PARSE], ns, BENCH_BATCH_SIZE, allocs_count() - allocs);
+
+        allocs = allocs_count();
+        start = now_ns();
+        for (i = 0; i < BENCH_BATCH_SIZE; i++) {
+            date = cron_next(exprs[0], date);
+            if (INVALID_INSTANT == date) {
+                date = BENCH_START_DATE;
+            }
+        }
+        ns = now_ns() - start;
+        stats_add(&per_expr[BENCH_OP_NEXT], ns, BENCH_BATCH_SIZE, allocs_count() - allocs);
+        stats_add(&all[BENCH_OP_NEXT], ns, BENCH_BATCH_SIZE, allocs_count() - allocs);
+
+        allocs = allocs_count();
+        start = now_ns();
+        for (i = 0; i < BENCH_BATCH_SIZE; i++) {
+            cron_expr_free(exprs[i]);
+        }
+        ns = now_ns() - start;
+        stats_add(&per_expr[BENCH_OP_FREE], ns, BENCH_BATCH_SIZE, allocs_count() - allocs);
+        stats_add(&all[BENCH_OP_FREE], ns, BENCH_BATCH_SIZE, allocs_count() - allocs);
+
+        allocs = allocs_count();
+        start = now_ns();
+        for (i = 0; i < BENCH_BATCH_SIZE; i++) {
+            cron_parse_expr_into(bc->expr, &target, NULL);
+        }
+        ns = now_ns() - start;
+        stats_add(&per_expr[BENCH_OP_PARSE_INTO], ns, BENCH_BATCH_SIZE, allocs_count() - allocs);
+        stats_add(&all[BENCH_OP_PARSE_INTO], ns, BENCH_BATCH_SIZE, allocs_count() - allocs);
+
+        /* log of dates a minute apart */
+        for (i = 0; i < BENCH_BATCH_SIZE; i++) {
+            dates[i] = BENCH_START_DATE + (time_t) (batch * BENCH_BATCH_SIZE + i) * 60;
+        }
+        allocs = allocs_count();
+        start = now_ns();
+        for (i = 0; i < BENCH_BATCH_SIZE; i++) {
+            matches += cron_matches(&target, dates[i]);
+        }
+        ns = now_ns() - start;
+        stats_add(&per_expr[BENCH_OP_MATCHES], ns, BENCH_BATCH_SIZE, allocs_count() - allocs);
+        stats_add(&all[BENCH_OP_MATCHES], ns, BENCH_BATCH_SIZE, allocs_count() - allocs);
+
+        allocs = allocs_count();
+        start = now_ns();
+        matches -= (long) cron_matches_n(&target, dates, BENCH_BATCH_SIZE, matched);
+        ns = now_ns() - start;
+        stats_add(&per_expr[BENCH_OP_MATCHES_N], ns, BENCH_BATCH_SIZE, allocs_count() - allocs);
+        stats_add(&all[BENCH_OP_MATCHES_N], ns, BENCH_BATCH_SIZE, allocs_count() - allocs);
+    }
+    if (0 != matches) {
+        fprintf(stderr, "cron_matches and cron_matches_n differ for '%s'\n", bc->expr);
+    }
+    for (op = 0; op < BENCH_OPS_COUNT; op++) {
+        stats_print(&per_expr[op], BENCH_OP_NAMES[op], bc->kind, bc->expr);
+    }
+}
+
+/* per-expression lines and a summary line ('kind=all') for each operation */
+static void bench_corpus(void) {
+    bench_stats* per_expr = (bench_stats*) malloc(BENCH_OPS_COUNT * sizeof(bench_stats));
+    bench_stats* all = (bench_stats*) malloc(BENCH_OPS_COUNT * sizeof(bench_stats));
+    size_t i;
+    int op;
+    if (!per_expr || !all) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    memset(all, 0, BENCH_OPS_COUNT * sizeof(bench_stats));
+    for (i = 0; i < BENCH_CORPUS_LEN; i++) {
+        memset(per_expr, 0, BENCH_OPS_COUNT * sizeof(bench_stats));
+        bench_expr(&BENCH_CORPUS[i], per_expr, all);
+    }
+    for (op = 0; op < BENCH_OPS_COUNT; op++) {
+        stats_print(&all[op], BENCH_OP_NAMES[op], "all", "");
+    }
+    free(per_expr);
+    free(all);
+}
+
+static void bench_scheduler(int njobs) {
+    const char* patterns[] = {"0 * * * * *", "0 */5 * * * *", "0 0 * * * *", "*/30 * * * * *", "0 0 7 ? * MON-FRI"};
+    cron_expr* exprs[5];
+    cron_scheduler* sched;
+    clock_t start;
+    double ns;
+    time_t fired;
+    time_t date;
+    int pops = 0;
+    int i;
+    int job;
+    for (i = 0; i < 5; i++) {
+        exprs[i] = cron_parse_expr(patterns[i], NULL);
+    }
+    sched = cron_scheduler_new(0);
+    start = clock();
+    for (i = 0; i < njobs; i++) {
+        cron_scheduler_add(sched, exprs[i % 5], NULL, BENCH_START_DATE + i % 3600);
+    }
+    ns = elapsed_ns(start);
+    printf("op=scheduler_add jobs=%d ns/op=%.1f\n", njobs, ns / njobs);
+
+    start = clock();
+    date = cron_scheduler_peek(sched);
+    while (pops < njobs) {
+        while (-1 != (job = cron_scheduler_pop_due(sched, date, NULL, &fired))) {
+            cron_scheduler_rearm(sched, job, fired);
+            pops += 1;
+        }
+        date = cron_scheduler_peek(sched);
+    }
+    ns = elapsed_ns(start);
+    printf("op=scheduler_pop_rearm jobs=%d ns/op=%.1f\n", njobs, ns / pops);
+
+    cron_scheduler_free(sched);
+    for (i = 0; i < 5; i++) {
+        cron_expr_free(exprs[i]);
+    }
+}
+
+static void bench_cache(int nlookups) {
+    const char* patterns[] = {"0 0 * * * *", "0 */5 * * * *", "0 0 7 ? * MON-FRI", "0 30 23 30 1/3 ?"};
+    const cron_expr** shared = (const cron_expr**) malloc(nlookups * sizeof(cron_expr*));
+    cron_expr_cache* cache = cron_expr_cache_new();
+    clock_t start;
+    double ns;
+    int i;
+    start = clock();
+    for (i = 0; i < nlookups; i++) {
+        cron_expr_free(cron_parse_expr(patterns[i % 4], NULL));
+    }
+    ns = elapsed_ns(start);
+    printf("op=parse_free exprs=%d ns/op=%.1f\n", nlookups, ns / nlookups);
+    start = clock();
+    for (i = 0; i < nlookups; i++) {
+        shared[i] = cron_expr_cache_get(cache, patterns[i % 4], NULL);
+    }
+    ns = elapsed_ns(start);
+    printf("op=cache_get exprs=%d distinct=%d ns/op=%.1f\n", nlookups, (int) cron_expr_cache_size(cache), ns / nlookups);
+    for (i = 0; i < nlookups; i++) {
+        cron_expr_cache_release(cache, shared[i]);
+    }
+    cron_expr_cache_free(cache);
+    free((void*) shared);
+}
+
+static void bench_set(int nexprs) {
+    cron_expr* exprs = (cron_expr*) malloc(nexprs * sizeof(cron_expr));
+    int* ids = (int*) malloc(nexprs * sizeof(int));
+    cron_expr_set* set = cron_expr_set_new(0);
+    clock_t start;
+    double ns;
+    time_t date;
+    long matched = 0;
+    long fired = 0;
+    int nseconds = 600;
+    int i;
+    if (!exprs || !ids || !set) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    for (i = 0; i < nexprs; i++) {
+        cron_parse_expr_into(BENCH_CORPUS[i % BENCH_CORPUS_LEN].expr, &exprs[i], NULL);
+        cron_expr_set_add(set, &exprs[i]);
+    }
+    start = clock();
+    for (date = BENCH_START_DATE; date < BENCH_START_DATE + nseconds; date++) {
+        struct tm calendar = *gmtime(&date);
+        matched += (long) cron_expr_set_match(set, &calendar, ids, (size_t) nexprs);
+    }
+    ns = elapsed_ns(start);
+    printf("op=set_match exprs=%d ns/op=%.1f ns/expr=%.3f\n", nexprs, ns / nseconds, ns / nseconds / nexprs);
+
+    /* same seconds with one search per expression */
+    start = clock();
+    for (date = BENCH_START_DATE; date < BENCH_START_DATE + nseconds / 60; date++) {
+        for (i = 0; i < nexprs; i++) {
+            fired += cron_next(&exprs[i], date - 1) == date;
+        }
+    }
+    ns = elapsed_ns(start);
+    printf("op=set_next_loop exprs=%d ns/op=%.1f ns/expr=%.3f\n", nexprs, ns / (nseconds / 60), ns / (nseconds / 60) / nexprs);
+    if (matched < fired) {
+        fprintf(stderr, "cron_expr_set_match and cron_next differ\n");
+    }
+    cron_expr_set_free(set);
+    free(ids);
+    free(exprs);
+}
+
+static void bench_between(void) {
+    cron_expr expr;
+    clock_t start;
+    double ns_count = 0;
+    double ns_iter = 0;
+    time_t to = BENCH_START_DATE + 30 * 86400;
+    int64_t counted = 0;
+    int64_t iterated = 0;
+    size_t i;
+    int rep;
+    for (i = 0; i < BENCH_CORPUS_LEN; i++) {
+        cron_iter iter;
+        cron_parse_expr_into(BENCH_CORPUS[i].expr, &expr, NULL);
+        start = clock();
+        for (rep = 0; rep < 1000; rep++) {
+            counted += cron_count_between(&expr, BENCH_START_DATE + rep, to);
+        }
+        ns_count += elapsed_ns(start) / 1000;
+        start = clock();
+        cron_iter_init(&iter, &expr, BENCH_START_DATE);
+        while (cron_iter_next(&iter) <= to) {
+            iterated += 1;
+        }
+        ns_iter += elapsed_ns(start);
+    }
+    printf("op=count_between days=30 exprs=%d ns/op=%.1f\n", (int) BENCH_CORPUS_LEN, ns_count / BENCH_CORPUS_LEN);
+    printf("op=count_iter days=30 exprs=%d ns/op=%.1f fires/op=%.1f\n", (int) BENCH_CORPUS_LEN,
+            ns_iter / BENCH_CORPUS_LEN, (double) iterated / BENCH_CORPUS_LEN);
+    if (0 == counted) {
+        fprintf(stderr, "cron_count_between counted nothing\n");
+    }
+}
+
+/* loading of stored expressions: parsing the strings again or reading the binary records */
+static void bench_records(int nexprs) {
+    unsigned char* records = (unsigned char*) malloc((size_t) nexprs * CRON_EXPR_RECORD_SIZE);
+    cron_expr expr;
+    clock_t start;
+    double ns;
+    uint64_t check = 0;
+    int i;
+    start = clock();
+    for (i = 0; i < nexprs; i++) {
+        cron_parse_expr_into(BENCH_CORPUS[i % BENCH_CORPUS_LEN].expr, &expr, NULL);
+        check += expr.seconds;
+    }
+    ns = elapsed_ns(start);
+    printf("op=load_parse exprs=%d ns/op=%.1f\n", nexprs, ns / nexprs);
+    start = clock();
+    for (i = 0; i < nexprs; i++) {
+        cron_parse_expr_into(BENCH_CORPUS[i % BENCH_CORPUS_LEN].expr, &expr, NULL);
+        cron_expr_serialize(&expr, records + (size_t) i * CRON_EXPR_RECORD_SIZE);
+    }
+    ns = elapsed_ns(start);
+    printf("op=parse_serialize exprs=%d ns/op=%.1f\n", nexprs, ns / nexprs);
+    start = clock();
+    for (i = 0; i < nexprs; i++) {
+        cron_expr_view(records + (size_t) i * CRON_EXPR_RECORD_SIZE, &expr, NULL);
+        check -= expr.seconds;
+    }
+    ns = elapsed_ns(start);
+    printf("op=load_view exprs=%d bytes/expr=%d ns/op=%.1f\n", nexprs, CRON_EXPR_RECORD_SIZE, ns / nexprs);
+    if (0 != check) {
+        fprintf(stderr, "records differ from parsed expressions\n");
+    }
+    free(records);
+}
+
+/* takes and rearms all jobs due at the date, from the wheel if it is not NULL or from the scheduler */
+static long dispatch_due(cron_wheel* wheel, cron_scheduler* sched, time_t date) {
+    time_t fired;
+    long fires = 0;
+    int job;
+    if (wheel) {
+        while (-1 != (job = cron_wheel_pop_due(wheel, date, NULL, &fired))) {
+            cron_wheel_rearm(wheel, job, fired);
+            fires += 1;
+        }
+    } else {
+        while (-1 != (job = cron_scheduler_pop_due(sched, date, NULL, &fired))) {
+            cron_scheduler_rearm(sched, job, fired);
+            fires += 1;
+        }
+    }
+    return fires;
+}
+
+/* one second steps over 10 minutes of mixed jobs, then two top-of-hour storms of hourly jobs */
+static void bench_dispatch(int njobs, int use_wheel) {
+    const char* patterns[] = {"0 * * * * *", "0 */5 * * * *", "0 0 * * * *", "*/30 * * * * *", "0 0 7 ? * MON-FRI"};
+    const char* name = use_wheel ? "wheel" : "scheduler";
+    cron_expr exprs[5];
+    cron_wheel* wheel = NULL;
+    cron_scheduler* sched = NULL;
+    time_t hour = BENCH_START_DATE - BENCH_START_DATE % 3600 + 3600;
+    time_t date;
+    double start;
+    double ns;
+    double storm_ns = 0;
+    long fires = 0;
+    long storm_fires = 0;
+    int i;
+    for (i = 0; i < 5; i++) {
+        cron_parse_expr_into(patterns[i], &exprs[i], NULL);
+    }
+    if (use_wheel) {
+        wheel = cron_wheel_new(BENCH_START_DATE, (size_t) njobs);
+    } else {
+        sched = cron_scheduler_new((size_t) njobs);
+    }
+    start = now_ns();
+    for (i = 0; i < njobs; i++) {
+        if (wheel) {
+            cron_wheel_add(wheel, &exprs[i % 5], NULL, BENCH_START_DATE + i % 3600);
+        } else {
+            cron_scheduler_add(sched, &exprs[i % 5], NULL, BENCH_START_DATE + i % 3600);
+        }
+    }
+    printf("op=%s_add jobs=%d ns/op=%.1f\n", name, njobs, (now_ns() - start) / njobs);
+    start = now_ns();
+    for (date = BENCH_START_DATE; date < BENCH_START_DATE + 600; date++) {
+        fires += dispatch_due(wheel, sched, date);
+    }
+    ns = now_ns() - start;
+    printf("op=%s_dispatch jobs=%d fires=%ld ns/op=%.1f\n", name, njobs, fires, ns / fires);
+    cron_wheel_free(wheel);
+    cron_scheduler_free(sched);
+
+    /* every job fires at the top of the hour, the other seconds have nothing due */
+    wheel = NULL;
+    sched = NULL;
+    if (use_wheel) {
+        wheel = cron_wheel_new(BENCH_START_DATE, (size_t) njobs);
+    } else {
+        sched = cron_scheduler_new((size_t) njobs);
+    }
+    for (i = 0; i < njobs; i++) {
+        if (wheel) {
+            cron_wheel_add(wheel, &exprs[2], NULL, BENCH_START_DATE);
+        } else {
+            cron_scheduler_add(sched, &exprs[2], NULL, BENCH_START_DATE);
+        }
+    }
+    fires = 0;
+    start = now_ns();
+    for (date = BENCH_START_DATE; date < hour + 3601; date++) {
+        if (0 == date % 3600) {
+            double storm_start = now_ns();
+            long storm = dispatch_due(wheel, sched, date);
+            storm_ns += now_ns() - storm_start;
+            storm_fires += storm;
+            fires += storm;
+        } else {
+            fires += dispatch_due(wheel, sched, date);
+        }
+    }
+    ns = now_ns() - start;
+    printf("op=%s_storm jobs=%d storms=2 fires=%ld ms/storm=%.1f ns/op=%.1f idle_ns/second=%.1f\n", name, njobs,
+            storm_fires, storm_ns / 2e6, storm_ns / storm_fires, (ns - storm_ns) / (hour + 3601 - BENCH_START_DATE - 2));
+    if (fires != storm_fires || fires != 2L * njobs) {
+        fprintf(stderr, "%s fired %ld jobs out of the storms, %ld in them\n", name, fires - storm_fires, storm_fires);
+    }
+    cron_wheel_free(wheel);
+    cron_scheduler_free(sched);
+}
+
+/* store file: adding jobs, clean reopen (first due job is ready without 'cron_next' calls) and recovery */
+static void bench_store(int njobs) {
+    const char* patterns[] = {"0 * * * * *", "0 */5 * * * *", "0 0 * * * *", "*/30 * * * * *", "0 0 7 ? * MON-FRI"};
+    const char* path = "ccronexpr_bench.store";
+    cron_expr exprs[5];
+    cron_store* store;
+    const char* err = NULL;
+    double start;
+    time_t fired;
+    int i;
+    for (i = 0; i < 5; i++) {
+        cron_parse_expr_into(patterns[i], &exprs[i], NULL);
+    }
+    remove(path);
+    store = cron_store_open(path, (size_t) njobs, &err);
+    if (!store) {
+        fprintf(stderr, "store not opened: %s\n", err);
+        return;
+    }
+    start = now_ns();
+    for (i = 0; i < njobs; i++) {
+        cron_store_add(store, &exprs[i % 5], i, BENCH_START_DATE + i % 3600);
+    }
+    printf("op=store_add jobs=%d ns/op=%.1f\n", njobs, (now_ns() - start) / njobs);
+    start = now_ns();
+    cron_store_close(store);
+    printf("op=store_close jobs=%d ms=%.1f\n", njobs, (now_ns() - start) / 1e6);
+
+    start = now_ns();
+    store = cron_store_open(path, 0, &err);
+    fired = INVALID_INSTANT;
+    cron_store_pop_due(store, cron_store_peek(store), NULL, &fired);
+    printf("op=store_reopen_first_due jobs=%d ms=%.3f\n", njobs, (now_ns() - start) / 1e6);
+    if (INVALID_INSTANT == fired || cron_store_recovered(store)) {
+        fprintf(stderr, "store not reopened cleanly\n");
+    }
+
+    /* the taken job is not rearmed, so the file is not marked as clean and the heap is rebuilt */
+    cron_store_close(store);
+    start = now_ns();
+    store = cron_store_open(path, 0, &err);
+    printf("op=store_recover jobs=%d ms=%.1f\n", njobs, (now_ns() - start) / 1e6);
+    if (!store || !cron_store_recovered(store) || cron_store_size(store) != (size_t) njobs) {
+        fprintf(stderr, "store not recovered\n");
+    }
+    cron_store_close(store);
+    remove(path);
+}
+
+int main(int argc, char** argv) {
+    int njobs = argc > 1 ? atoi(argv[1]) : 1000000;
+    bench_corpus();
+    bench_scheduler(njobs);
+    bench_cache(njobs / 10);
+    bench_set(njobs / 10);
+    bench_between();
+    bench_records(njobs);
+    bench_dispatch(njobs, 0);
+    bench_dispatch(njobs, 1);
+    bench_store(10 * njobs);
+    return 0;
+}
+#endif /* CRON_BENCH */
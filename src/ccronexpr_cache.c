@@ -0,0 +1,193 @@
+/*
+ * File:   ccronexpr_cache.c
+ *
+ * Cache of parsed cron expressions shared between clients using the same expression.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "ccronexpr_cache.h"
+#include "ccronexpr_alloc.h"
+
+/* same limit as in the parser */
+#define CRON_CACHE_MAX_KEY_LEN 256
+#define CRON_CACHE_MIN_BUCKETS 64
+
+typedef struct cron_cache_entry {
+    /* first member, shared expressions point to the entry */
+    cron_expr expr;
+    struct cron_cache_entry* next;
+    size_t refs;
+    uint32_t hash;
+    size_t key_len;
+    /* normalized expression text follows the entry */
+} cron_cache_entry;
+
+struct cron_expr_cache {
+    cron_cache_entry** buckets;
+    size_t buckets_len;
+    size_t size;
+};
+
+static char* entry_key(cron_cache_entry* entry) {
+    return (char*) (entry + 1);
+}
+
+/**
+ * Collapses whitespace runs into single spaces and converts letters to upper case,
+ * the parser does the same so the normalized text parses to the same expression.
+ * Returns the length of the normalized text, 0 if it is empty or too long.
+ */
+static size_t normalize(const char* expression, char* buf) {
+    size_t len = 0;
+    int space = 0;
+    const char* ch;
+    for (ch = expression; '\0' != *ch; ch++) {
+        if (isspace((unsigned char) *ch)) {
+            space = 1;
+            continue;
+        }
+        if (len + 2 >= CRON_CACHE_MAX_KEY_LEN) return 0;
+        if (space && len > 0) {
+            buf[len++] = ' ';
+        }
+        space = 0;
+        buf[len++] = (char) toupper((unsigned char) *ch);
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/* FNV-1a */
+static uint32_t hash_key(const char* key, size_t len) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int grow_buckets(cron_expr_cache* cache) {
+    size_t new_len = cache->buckets_len * 2;
+    size_t i;
+    cron_cache_entry** buckets = (cron_cache_entry**) cron_malloc(new_len * sizeof(cron_cache_entry*));
+    if (!buckets) return 1;
+    memset(buckets, 0, new_len * sizeof(cron_cache_entry*));
+    for (i = 0; i < cache->buckets_len; i++) {
+        cron_cache_entry* entry = cache->buckets[i];
+        while (entry) {
+            cron_cache_entry* next = entry->next;
+            size_t idx = entry->hash & (new_len - 1);
+            entry->next = buckets[idx];
+            buckets[idx] = entry;
+            entry = next;
+        }
+    }
+    cron_free(cache->buckets);
+    cache->buckets = buckets;
+    cache->buckets_len = new_len;
+    return 0;
+}
+
+cron_expr_cache* cron_expr_cache_new(void) {
+    cron_expr_cache* cache = (cron_expr_cache*) cron_malloc(sizeof(cron_expr_cache));
+    if (!cache) return NULL;
+    cache->buckets = (cron_cache_entry**) cron_malloc(CRON_CACHE_MIN_BUCKETS * sizeof(cron_cache_entry*));
+    if (!cache->buckets) {
+        cron_free(cache);
+        return NULL;
+    }
+    memset(cache->buckets, 0, CRON_CACHE_MIN_BUCKETS * sizeof(cron_cache_entry*));
+    cache->buckets_len = CRON_CACHE_MIN_BUCKETS;
+    cache->size = 0;
+    return cache;
+}
+
+const cron_expr* cron_expr_cache_get(cron_expr_cache* cache, const char* expression, const char** error) {
+    const char* err_local;
+    char key[CRON_CACHE_MAX_KEY_LEN];
+    size_t len;
+    uint32_t hash;
+    cron_cache_entry* entry;
+    cron_expr parsed;
+    if (!error) {
+        error = &err_local;
+    }
+    *error = NULL;
+    if (!cache || !expression) {
+        *error = "Invalid NULL cache or expression";
+        return NULL;
+    }
+    len = normalize(expression, key);
+    if (0 == len) {
+        *error = "Invalid empty or too long expression";
+        return NULL;
+    }
+    hash = hash_key(key, len);
+    for (entry = cache->buckets[hash & (cache->buckets_len - 1)]; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->key_len == len && 0 == memcmp(entry_key(entry), key, len)) {
+            entry->refs += 1;
+            return &entry->expr;
+        }
+    }
+
+    if (0 != cron_parse_expr_into(key, &parsed, error)) return NULL;
+    entry = (cron_cache_entry*) cron_malloc(sizeof(cron_cache_entry) + len + 1);
+    if (!entry) {
+        *error = "Memory allocation error";
+        return NULL;
+    }
+    entry->expr = parsed;
+    entry->refs = 1;
+    entry->hash = hash;
+    entry->key_len = len;
+    memcpy(entry_key(entry), key, len + 1);
+    if (cache->size >= cache->buckets_len) {
+        /* on failure the cache keeps working with longer chains */
+        grow_buckets(cache);
+    }
+    entry->next = cache->buckets[hash & (cache->buckets_len - 1)];
+    cache->buckets[hash & (cache->buckets_len - 1)] = entry;
+    cache->size += 1;
+    return &entry->expr;
+}
+
+void cron_expr_cache_release(cron_expr_cache* cache, const cron_expr* expr) {
+    cron_cache_entry* entry = (cron_cache_entry*) expr;
+    cron_cache_entry** link;
+    if (!cache || !entry) return;
+    entry->refs -= 1;
+    if (entry->refs > 0) return;
+    for (link = &cache->buckets[entry->hash & (cache->buckets_len - 1)]; *link; link = &(*link)->next) {
+        if (*link == entry) {
+            *link = entry->next;
+            cache->size -= 1;
+            cron_free(entry);
+            return;
+        }
+    }
+}
+
+size_t cron_expr_cache_size(const cron_expr_cache* cache) {
+    if (!cache) return 0;
+    return cache->size;
+}
+
+void cron_expr_cache_free(cron_expr_cache* cache) {
+    size_t i;
+    if (!cache) return;
+    for (i = 0; i < cache->buckets_len; i++) {
+        cron_cache_entry* entry = cache->buckets[i];
+        while (entry) {
+            cron_cache_entry* next = entry->next;
+            cron_free(entry);
+            entry = next;
+        }
+    }
+    cron_free(cache->buckets);
+    cron_free(cache);
+}
@@ -0,0 +1,76 @@
+/*
+ * File:   ccronexpr_cache.h
+ *
+ * Cache of parsed cron expressions shared between clients using the same expression.
+ */
+
+#ifndef CCRONEXPR_CACHE_H
+#define	CCRONEXPR_CACHE_H
+
+#include "ccronexpr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Cache of parsed expressions keyed by the expression text, each distinct
+ * expression is parsed once and shared, with a reference count.
+ * Expressions that differ only in whitespace or letter case are the same entry.
+ * Cache is not thread-safe.
+ */
+typedef struct cron_expr_cache cron_expr_cache;
+
+/**
+ * Creates empty cache.
+ *
+ * @return cache in case of success, must be freed by client using
+ *         'cron_expr_cache_free' function. NULL is returned on error.
+ */
+cron_expr_cache* cron_expr_cache_new(void);
+
+/**
+ * Returns shared parsed expression for the specified expression text,
+ * parsing it only if it is not in the cache yet, and increments its
+ * reference count.
+ *
+ * @param cache cache
+ * @param expression cron expression as nul-terminated string
+ * @param error output error message, will be set to string literal
+ *        error message in case of error. Will be set to NULL on success.
+ * @return shared parsed expression in case of success, must be released by client
+ *         using 'cron_expr_cache_release' function (NOT 'cron_expr_free').
+ *         NULL is returned on error.
+ */
+const cron_expr* cron_expr_cache_get(cron_expr_cache* cache, const char* expression, const char** error);
+
+/**
+ * Decrements reference count of the shared expression, the expression
+ * is freed and removed from the cache when it is not referenced anymore.
+ *
+ * @param cache cache the expression was taken from
+ * @param expr shared expression returned from 'cron_expr_cache_get'
+ */
+void cron_expr_cache_release(cron_expr_cache* cache, const cron_expr* expr);
+
+/**
+ * Returns number of distinct expressions in the cache.
+ *
+ * @param cache cache
+ * @return number of cached expressions
+ */
+size_t cron_expr_cache_size(const cron_expr_cache* cache);
+
+/**
+ * Frees the cache and all expressions in it, expressions taken from
+ * the cache must not be used after this call.
+ *
+ * @param cache cache to free
+ */
+void cron_expr_cache_free(cron_expr_cache* cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* CCRONEXPR_CACHE_H */
@@ -0,0 +1,50 @@
+/*
+ * File:   ccronexpr_internal.h
+ *
+ * Helpers shared by the library sources, not a public header.
+ */
+
+#ifndef CCRONEXPR_INTERNAL_H
+#define	CCRONEXPR_INTERNAL_H
+
+#include "ccronexpr.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+#include <intrin.h>
+#endif
+
+/* static functions of this header, inline where the compiler allows it even in C89 mode */
+#if defined(__GNUC__) || defined(__clang__)
+#define CRON_INTERNAL static __inline__
+#elif defined(_MSC_VER)
+#define CRON_INTERNAL static __inline
+#else
+#define CRON_INTERNAL static
+#endif
+
+/* number of trailing zero bits, 'bits' must not be zero */
+CRON_INTERNAL unsigned int ctz64(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned int) __builtin_ctzll(bits);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    unsigned long idx;
+    _BitScanForward64(&idx, bits);
+    return (unsigned int) idx;
+#else
+    unsigned int n = 0;
+    if (!(bits & 0xFFFFFFFFu)) { n += 32; bits >>= 32; }
+    if (!(bits & 0xFFFFu)) { n += 16; bits >>= 16; }
+    if (!(bits & 0xFFu)) { n += 8; bits >>= 8; }
+    if (!(bits & 0xFu)) { n += 4; bits >>= 4; }
+    if (!(bits & 0x3u)) { n += 2; bits >>= 2; }
+    if (!(bits & 0x1u)) { n += 1; }
+    return n;
+#endif
+}
+
+/* 'L', 'W' or '#' items in the days of month or week */
+CRON_INTERNAL int has_day_items(const cron_expr* expr) {
+    return 0 != (expr->last_day_of_month | expr->nearest_weekday | expr->last_days_of_week | expr->nth_day_of_week);
+}
+
+#endif	/* CCRONEXPR_INTERNAL_H */
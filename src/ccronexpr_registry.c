@@ -0,0 +1,421 @@
+/*
+ * File:   ccronexpr_registry.c
+ *
+ * Registry of cron expressions shared between threads without locks.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ccronexpr_registry.h"
+#include "ccronexpr_alloc.h"
+
+/* removed jobs of a thread are freed in batches */
+#define CRON_REGISTRY_RECLAIM_BATCH 64
+/* epoch of a thread outside of read sections */
+#define CRON_REGISTRY_IDLE ((uint64_t) -1)
+/* ids are kept in the low 32 bits of the free ids stack head */
+#define CRON_REGISTRY_MAX_CAPACITY 0x7FFFFFFEu
+#define CRON_REGISTRY_ID_MASK ((uint64_t) 0xFFFFFFFFu)
+/* thread records take a cache line each */
+#define CRON_REGISTRY_CACHE_LINE 64
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CRON_REGISTRY_ATOMICS
+
+static uint64_t load_seq(const volatile uint64_t* p) {
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static void store_seq(volatile uint64_t* p, uint64_t val) {
+    __atomic_store_n(p, val, __ATOMIC_SEQ_CST);
+}
+
+/* on failure 'expected' is set to the current value */
+static int compare_swap(volatile uint64_t* p, uint64_t* expected, uint64_t desired) {
+    return __atomic_compare_exchange_n(p, expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static void add_fetch(volatile uint64_t* p, uint64_t val) {
+    __atomic_add_fetch(p, val, __ATOMIC_SEQ_CST);
+}
+
+static void* load_ptr(void* const volatile* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void store_ptr(void* volatile* p, void* val) {
+    __atomic_store_n(p, val, __ATOMIC_RELEASE);
+}
+
+static void* exchange_ptr(void* volatile* p, void* val) {
+    return __atomic_exchange_n(p, val, __ATOMIC_SEQ_CST);
+}
+
+static void full_fence(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define CRON_REGISTRY_ATOMICS
+#include <intrin.h>
+
+/* aligned loads and stores are atomic on x64, the barriers keep the compiler from reordering them */
+static uint64_t load_seq(const volatile uint64_t* p) {
+    uint64_t val = *p;
+    _ReadWriteBarrier();
+    return val;
+}
+
+static void store_seq(volatile uint64_t* p, uint64_t val) {
+    _InterlockedExchange64((volatile __int64*) p, (__int64) val);
+}
+
+static int compare_swap(volatile uint64_t* p, uint64_t* expected, uint64_t desired) {
+    uint64_t prev = (uint64_t) _InterlockedCompareExchange64((volatile __int64*) p, (__int64) desired, (__int64) *expected);
+    if (prev == *expected) return 1;
+    *expected = prev;
+    return 0;
+}
+
+static void add_fetch(volatile uint64_t* p, uint64_t val) {
+    _InterlockedExchangeAdd64((volatile __int64*) p, (__int64) val);
+}
+
+static void* load_ptr(void* const volatile* p) {
+    void* val = *p;
+    _ReadWriteBarrier();
+    return val;
+}
+
+static void store_ptr(void* volatile* p, void* val) {
+    _ReadWriteBarrier();
+    *p = val;
+}
+
+static void* exchange_ptr(void* volatile* p, void* val) {
+    return _InterlockedExchangePointer(p, val);
+}
+
+static void full_fence(void) {
+    __faststorefence();
+}
+
+#else /* no atomics, 'cron_registry_new' fails and the rest is never called */
+
+static uint64_t load_seq(const volatile uint64_t* p) {
+    return *p;
+}
+
+static void store_seq(volatile uint64_t* p, uint64_t val) {
+    *p = val;
+}
+
+static int compare_swap(volatile uint64_t* p, uint64_t* expected, uint64_t desired) {
+    if (*p != *expected) {
+        *expected = *p;
+        return 0;
+    }
+    *p = desired;
+    return 1;
+}
+
+static void add_fetch(volatile uint64_t* p, uint64_t val) {
+    *p += val;
+}
+
+static void* load_ptr(void* const volatile* p) {
+    return *p;
+}
+
+static void store_ptr(void* volatile* p, void* val) {
+    *p = val;
+}
+
+static void* exchange_ptr(void* volatile* p, void* val) {
+    void* prev = *p;
+    *p = val;
+    return prev;
+}
+
+static void full_fence(void) {
+}
+
+#endif
+
+typedef struct cron_registry_entry {
+    cron_expr* expr;
+    void* payload;
+    struct cron_registry_entry* next_retired;
+    /* registry epoch when the job was removed, freed two epochs later */
+    uint64_t retired_epoch;
+} cron_registry_entry;
+
+typedef struct {
+    volatile uint64_t attached;
+    /* registry epoch seen when the read section started, CRON_REGISTRY_IDLE outside of them */
+    volatile uint64_t epoch;
+    /* removed and not freed jobs, used only by the attached thread */
+    cron_registry_entry* retired;
+    size_t retired_len;
+    /* to a cache line, threads do not write to the lines of the others */
+    unsigned char pad[CRON_REGISTRY_CACHE_LINE - 2 * sizeof(uint64_t) - sizeof(cron_registry_entry*) - sizeof(size_t)];
+} cron_registry_thread;
+
+struct cron_registry {
+    /* job entries by id, NULL for free ids */
+    void* volatile* slots;
+    /* free ids stack, next id + 1 for each id in the stack (0 for the last one) */
+    volatile uint64_t* next_free;
+    /* aligned to a cache line within 'threads_mem' */
+    cron_registry_thread* threads;
+    void* threads_mem;
+    size_t capacity;
+    size_t max_threads;
+    /* top of the free ids stack: change counter in the high 32 bits against ABA, id + 1 in the low ones */
+    volatile uint64_t free_head;
+    /* ids given out at least once */
+    volatile uint64_t used;
+    volatile uint64_t size;
+    /* advanced when all threads in read sections have seen the current one */
+    volatile uint64_t epoch;
+};
+
+static int pop_free_id(cron_registry* reg) {
+    uint64_t head = load_seq(&reg->free_head);
+    while (0 != (head & CRON_REGISTRY_ID_MASK)) {
+        uint64_t id = (head & CRON_REGISTRY_ID_MASK) - 1;
+        uint64_t next = load_seq(&reg->next_free[id]);
+        if (compare_swap(&reg->free_head, &head, (((head >> 32) + 1) << 32) | next)) return (int) id;
+    }
+    return -1;
+}
+
+static void push_free_id(cron_registry* reg, int id) {
+    uint64_t head = load_seq(&reg->free_head);
+    do {
+        store_seq(&reg->next_free[id], head & CRON_REGISTRY_ID_MASK);
+    } while (!compare_swap(&reg->free_head, &head, (((head >> 32) + 1) << 32) | (uint64_t) (id + 1)));
+}
+
+static int claim_new_id(cron_registry* reg) {
+    uint64_t used = load_seq(&reg->used);
+    while (used < reg->capacity) {
+        if (compare_swap(&reg->used, &used, used + 1)) return (int) used;
+    }
+    return -1;
+}
+
+static int valid_thread(const cron_registry* reg, int thread) {
+    return reg && thread >= 0 && (size_t) thread < reg->max_threads;
+}
+
+static void free_entry(cron_registry_entry* entry) {
+    cron_expr_free(entry->expr);
+    cron_free(entry);
+}
+
+/* the epoch is advanced only if every thread in a read section has seen it */
+static void try_advance_epoch(cron_registry* reg) {
+    uint64_t epoch = load_seq(&reg->epoch);
+    size_t i;
+    for (i = 0; i < reg->max_threads; i++) {
+        uint64_t seen = load_seq(&reg->threads[i].epoch);
+        if (CRON_REGISTRY_IDLE != seen && epoch != seen) return;
+    }
+    compare_swap(&reg->epoch, &epoch, epoch + 1);
+}
+
+cron_registry* cron_registry_new(size_t capacity, size_t max_threads) {
+#ifdef CRON_REGISTRY_ATOMICS
+    cron_registry* reg;
+    size_t i;
+    if (0 == capacity || capacity > CRON_REGISTRY_MAX_CAPACITY || 0 == max_threads ||
+            max_threads > (((size_t) -1) - CRON_REGISTRY_CACHE_LINE) / sizeof(cron_registry_thread)) return NULL;
+    reg = (cron_registry*) cron_malloc(sizeof(cron_registry));
+    if (!reg) return NULL;
+    memset(reg, 0, sizeof(cron_registry));
+    reg->slots = (void* volatile*) cron_malloc(capacity * sizeof(void*));
+    reg->next_free = (volatile uint64_t*) cron_malloc(capacity * sizeof(uint64_t));
+    reg->threads_mem = cron_malloc(max_threads * sizeof(cron_registry_thread) + CRON_REGISTRY_CACHE_LINE - 1);
+    if (!reg->slots || !reg->next_free || !reg->threads_mem) {
+        cron_registry_free(reg);
+        return NULL;
+    }
+    reg->threads = (cron_registry_thread*) ((char*) reg->threads_mem +
+            (CRON_REGISTRY_CACHE_LINE - (size_t) reg->threads_mem % CRON_REGISTRY_CACHE_LINE) % CRON_REGISTRY_CACHE_LINE);
+    for (i = 0; i < capacity; i++) {
+        reg->slots[i] = NULL;
+        reg->next_free[i] = 0;
+    }
+    memset(reg->threads, 0, max_threads * sizeof(cron_registry_thread));
+    for (i = 0; i < max_threads; i++) {
+        reg->threads[i].epoch = CRON_REGISTRY_IDLE;
+    }
+    reg->capacity = capacity;
+    reg->max_threads = max_threads;
+    full_fence();
+    return reg;
+#else /* CRON_REGISTRY_ATOMICS */
+    (void) capacity;
+    (void) max_threads;
+    return NULL;
+#endif /* CRON_REGISTRY_ATOMICS */
+}
+
+int cron_registry_attach(cron_registry* reg) {
+    size_t i;
+    if (!reg) return -1;
+    for (i = 0; i < reg->max_threads; i++) {
+        uint64_t free_slot = 0;
+        if (compare_swap(&reg->threads[i].attached, &free_slot, 1)) return (int) i;
+    }
+    return -1;
+}
+
+void cron_registry_detach(cron_registry* reg, int thread) {
+    if (!valid_thread(reg, thread)) return;
+    cron_registry_reclaim(reg, thread);
+    /* the jobs left in 'retired' are freed by the next thread taking the slot */
+    store_seq(&reg->threads[thread].attached, 0);
+}
+
+int cron_registry_add(cron_registry* reg, cron_expr* expr, void* payload) {
+    cron_registry_entry* entry;
+    int id;
+    if (!reg || !expr) return -1;
+    entry = (cron_registry_entry*) cron_malloc(sizeof(cron_registry_entry));
+    if (!entry) return -1;
+    entry->expr = expr;
+    entry->payload = payload;
+    entry->next_retired = NULL;
+    entry->retired_epoch = 0;
+    id = pop_free_id(reg);
+    if (-1 == id) {
+        id = claim_new_id(reg);
+    }
+    if (-1 == id) {
+        cron_free(entry);
+        return -1;
+    }
+    store_ptr(&reg->slots[id], entry);
+    add_fetch(&reg->size, 1);
+    return id;
+}
+
+int cron_registry_remove(cron_registry* reg, int thread, int job) {
+    cron_registry_thread* th;
+    cron_registry_entry* entry;
+    if (!valid_thread(reg, thread) || job < 0 || (size_t) job >= reg->capacity) return -1;
+    entry = (cron_registry_entry*) exchange_ptr(&reg->slots[job], NULL);
+    if (!entry) return -1;
+    add_fetch(&reg->size, (uint64_t) -1);
+    /* read after the job is not reachable, readers that saw it have not left an epoch before this one */
+    entry->retired_epoch = load_seq(&reg->epoch);
+    th = &reg->threads[thread];
+    entry->next_retired = th->retired;
+    th->retired = entry;
+    th->retired_len += 1;
+    push_free_id(reg, job);
+    if (th->retired_len >= CRON_REGISTRY_RECLAIM_BATCH) {
+        cron_registry_reclaim(reg, thread);
+    }
+    return 0;
+}
+
+size_t cron_registry_size(const cron_registry* reg) {
+    if (!reg) return 0;
+    return (size_t) load_seq(&reg->size);
+}
+
+void cron_registry_enter(cron_registry* reg, int thread) {
+    if (!valid_thread(reg, thread)) return;
+    store_seq(&reg->threads[thread].epoch, load_seq(&reg->epoch));
+    /* the epoch is visible to the writers before any job is read */
+    full_fence();
+}
+
+void cron_registry_leave(cron_registry* reg, int thread) {
+    if (!valid_thread(reg, thread)) return;
+    store_seq(&reg->threads[thread].epoch, CRON_REGISTRY_IDLE);
+}
+
+const cron_expr* cron_registry_get(const cron_registry* reg, int job, void** payload) {
+    const cron_registry_entry* entry;
+    if (!reg || job < 0 || (size_t) job >= reg->capacity) return NULL;
+    entry = (const cron_registry_entry*) load_ptr(&reg->slots[job]);
+    if (!entry) return NULL;
+    if (payload) {
+        *payload = entry->payload;
+    }
+    return entry->expr;
+}
+
+int cron_registry_next_job(const cron_registry* reg, int after, const cron_expr** expr, void** payload) {
+    uint64_t used;
+    uint64_t id;
+    if (!reg || after < -1) return -1;
+    used = load_seq(&reg->used);
+    for (id = (uint64_t) (after + 1); id < used; id++) {
+        const cron_registry_entry* entry = (const cron_registry_entry*) load_ptr(&reg->slots[id]);
+        if (entry) {
+            if (expr) {
+                *expr = entry->expr;
+            }
+            if (payload) {
+                *payload = entry->payload;
+            }
+            return (int) id;
+        }
+    }
+    return -1;
+}
+
+size_t cron_registry_reclaim(cron_registry* reg, int thread) {
+    cron_registry_thread* th;
+    cron_registry_entry** link;
+    uint64_t epoch;
+    if (!valid_thread(reg, thread)) return 0;
+    th = &reg->threads[thread];
+    try_advance_epoch(reg);
+    epoch = load_seq(&reg->epoch);
+    link = &th->retired;
+    while (*link) {
+        cron_registry_entry* entry = *link;
+        if (entry->retired_epoch + 2 <= epoch) {
+            *link = entry->next_retired;
+            free_entry(entry);
+            th->retired_len -= 1;
+        } else {
+            link = &entry->next_retired;
+        }
+    }
+    return th->retired_len;
+}
+
+void cron_registry_free(cron_registry* reg) {
+    size_t i;
+    if (!reg) return;
+    if (reg->slots) {
+        for (i = 0; i < reg->capacity; i++) {
+            if (reg->slots[i]) {
+                free_entry((cron_registry_entry*) reg->slots[i]);
+            }
+        }
+        cron_free((void*) reg->slots);
+    }
+    if (reg->next_free) {
+        cron_free((void*) reg->next_free);
+    }
+    if (reg->threads_mem) {
+        for (i = 0; i < reg->max_threads; i++) {
+            while (reg->threads[i].retired) {
+                cron_registry_entry* entry = reg->threads[i].retired;
+                reg->threads[i].retired = entry->next_retired;
+                free_entry(entry);
+            }
+        }
+        cron_free(reg->threads_mem);
+    }
+    cron_free(reg);
+}
@@ -0,0 +1,156 @@
+/*
+ * File:   ccronexpr_registry.h
+ *
+ * Registry of cron expressions shared between threads without locks.
+ */
+
+#ifndef CCRONEXPR_REGISTRY_H
+#define	CCRONEXPR_REGISTRY_H
+
+#include "ccronexpr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Registry of jobs (parsed cron expression with client payload) that threads
+ * add, remove and read concurrently without locks. Readers do not write to
+ * the shared jobs, a removed job is freed (with 'cron_expr_free') only after
+ * all readers that could see it have left their read sections (epoch based
+ * reclamation).
+ *
+ * Every thread using the registry takes a thread slot with
+ * 'cron_registry_attach' and passes it to the other calls. Reads are done
+ * between 'cron_registry_enter' and 'cron_registry_leave'; expressions
+ * and payloads returned there must not be used after leaving.
+ *
+ * Capacity (number of jobs and threads) is fixed when the registry is created.
+ * Requires atomic operations of GCC, Clang or MSVC (x64),
+ * 'cron_registry_new' returns NULL with other compilers.
+ */
+typedef struct cron_registry cron_registry;
+
+/**
+ * Creates empty registry.
+ *
+ * @param capacity maximum number of jobs
+ * @param max_threads maximum number of threads attached at the same time
+ * @return registry in case of success, must be freed by client using
+ *         'cron_registry_free' function. NULL is returned on error.
+ */
+cron_registry* cron_registry_new(size_t capacity, size_t max_threads);
+
+/**
+ * Takes a thread slot for the calling thread.
+ *
+ * @param reg registry
+ * @return thread slot (not negative) in case of success, -1 if all slots are taken.
+ */
+int cron_registry_attach(cron_registry* reg);
+
+/**
+ * Releases the thread slot, the thread must not be in a read section.
+ * Jobs removed by the thread and not freed yet are freed later.
+ *
+ * @param reg registry
+ * @param thread thread slot returned by 'cron_registry_attach'
+ */
+void cron_registry_detach(cron_registry* reg, int thread);
+
+/**
+ * Adds a job to the registry, the registry takes ownership of the expression
+ * and frees it when the job is removed (or the registry is freed).
+ *
+ * @param reg registry
+ * @param expr expression parsed with 'cron_parse_expr'
+ * @param payload client data of the job
+ * @return job id (not negative) in case of success, ids of removed jobs
+ *         are reused. -1 is returned if the registry is full or on error,
+ *         the expression is not taken then.
+ */
+int cron_registry_add(cron_registry* reg, cron_expr* expr, void* payload);
+
+/**
+ * Removes the job from the registry. Its expression is freed after all
+ * readers that could see it have left their read sections.
+ *
+ * @param reg registry
+ * @param thread thread slot of the calling thread
+ * @param job job id returned by 'cron_registry_add'
+ * @return 0 in case of success, -1 if there is no such job.
+ */
+int cron_registry_remove(cron_registry* reg, int thread, int job);
+
+/**
+ * Returns number of jobs in the registry.
+ *
+ * @param reg registry
+ * @return number of jobs
+ */
+size_t cron_registry_size(const cron_registry* reg);
+
+/**
+ * Starts a read section of the thread, jobs seen in it are not freed
+ * until it ends. Read sections should be short, they delay freeing
+ * of all jobs removed meanwhile.
+ *
+ * @param reg registry
+ * @param thread thread slot of the calling thread
+ */
+void cron_registry_enter(cron_registry* reg, int thread);
+
+/**
+ * Ends the read section of the thread.
+ *
+ * @param reg registry
+ * @param thread thread slot of the calling thread
+ */
+void cron_registry_leave(cron_registry* reg, int thread);
+
+/**
+ * Reads the job, must be called in a read section.
+ *
+ * @param reg registry
+ * @param job job id
+ * @param payload output client data of the job, can be NULL
+ * @return expression of the job, NULL if there is no such job.
+ */
+const cron_expr* cron_registry_get(const cron_registry* reg, int job, void** payload);
+
+/**
+ * Finds the job with the lowest id after the specified one, must be called
+ * in a read section. Jobs added or removed during the iteration may be
+ * seen or not.
+ *
+ * @param reg registry
+ * @param after job id to start after, -1 to start from the first job
+ * @param expr output expression of the job, can be NULL
+ * @param payload output client data of the job, can be NULL
+ * @return job id, -1 if there are no more jobs.
+ */
+int cron_registry_next_job(const cron_registry* reg, int after, const cron_expr** expr, void** payload);
+
+/**
+ * Frees the expressions of the removed jobs that no reader can see anymore.
+ * Called by 'cron_registry_remove' from time to time, can be called
+ * by writers to free them sooner.
+ *
+ * @param reg registry
+ * @param thread thread slot of the calling thread
+ * @return number of jobs removed by the thread and not freed yet.
+ */
+size_t cron_registry_reclaim(cron_registry* reg, int thread);
+
+/**
+ * Frees the registry with all its expressions, no threads may use it anymore.
+ *
+ * @param reg registry to free
+ */
+void cron_registry_free(cron_registry* reg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* CCRONEXPR_REGISTRY_H */
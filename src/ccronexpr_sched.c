@@ -0,0 +1,235 @@
+/*
+ * File:   ccronexpr_sched.c
+ *
+ * Scheduler over a set of cron expressions ordered by their next 'fire' dates.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "ccronexpr_sched.h"
+#include "ccronexpr_alloc.h"
+
+#define CRON_INVALID_INSTANT ((time_t) -1)
+
+/* heap arity, half the depth of a binary heap, the children of a node are 64 adjacent bytes (4 * 16) */
+#define CRON_SCHED_ARITY 4
+#define CRON_SCHED_MIN_CAPACITY 16
+
+/* 'heap_index' of a job that is not armed */
+#define CRON_SCHED_NOT_ARMED -1
+/* 'heap_index' of a removed job, its slot is in the free list */
+#define CRON_SCHED_REMOVED -2
+
+typedef struct {
+    time_t next;
+    int job;
+} cron_sched_node;
+
+typedef struct {
+    const cron_expr* expr;
+    void* payload;
+    int heap_index;
+    int next_free;
+} cron_sched_job;
+
+struct cron_scheduler {
+    cron_sched_node* heap;
+    size_t heap_len;
+    size_t heap_cap;
+    cron_sched_job* jobs;
+    size_t jobs_len;
+    size_t jobs_cap;
+    int free_head;
+};
+
+static void* grow_array(void* arr, size_t len, size_t* cap, size_t elem_size) {
+    size_t new_cap = *cap >= CRON_SCHED_MIN_CAPACITY ? *cap * 2 : CRON_SCHED_MIN_CAPACITY;
+    void* res = cron_malloc(new_cap * elem_size);
+    if (!res) return NULL;
+    if (arr) {
+        memcpy(res, arr, len * elem_size);
+        cron_free(arr);
+    }
+    *cap = new_cap;
+    return res;
+}
+
+static void heap_set(cron_scheduler* sched, size_t idx, cron_sched_node node) {
+    sched->heap[idx] = node;
+    sched->jobs[node.job].heap_index = (int) idx;
+}
+
+static void sift_up(cron_scheduler* sched, size_t idx) {
+    cron_sched_node node = sched->heap[idx];
+    while (idx > 0) {
+        size_t parent = (idx - 1) / CRON_SCHED_ARITY;
+        if (sched->heap[parent].next <= node.next) break;
+        heap_set(sched, idx, sched->heap[parent]);
+        idx = parent;
+    }
+    heap_set(sched, idx, node);
+}
+
+static void sift_down(cron_scheduler* sched, size_t idx) {
+    cron_sched_node node = sched->heap[idx];
+    for (;;) {
+        size_t first = idx * CRON_SCHED_ARITY + 1;
+        size_t last = first + CRON_SCHED_ARITY;
+        size_t min = idx;
+        time_t min_next = node.next;
+        size_t i;
+        if (first >= sched->heap_len) break;
+        if (last > sched->heap_len) {
+            last = sched->heap_len;
+        }
+        for (i = first; i < last; i++) {
+            if (sched->heap[i].next < min_next) {
+                min = i;
+                min_next = sched->heap[i].next;
+            }
+        }
+        if (min == idx) break;
+        heap_set(sched, idx, sched->heap[min]);
+        idx = min;
+    }
+    heap_set(sched, idx, node);
+}
+
+static int heap_push(cron_scheduler* sched, int job, time_t next) {
+    cron_sched_node node;
+    if (sched->heap_len == sched->heap_cap) {
+        void* grown = grow_array(sched->heap, sched->heap_len, &sched->heap_cap, sizeof(cron_sched_node));
+        if (!grown) return -1;
+        sched->heap = (cron_sched_node*) grown;
+    }
+    node.next = next;
+    node.job = job;
+    sched->heap[sched->heap_len] = node;
+    sched->heap_len += 1;
+    sift_up(sched, sched->heap_len - 1);
+    return 0;
+}
+
+static void heap_remove(cron_scheduler* sched, size_t idx) {
+    int job = sched->heap[idx].job;
+    sched->heap_len -= 1;
+    if (idx != sched->heap_len) {
+        time_t removed_next = sched->heap[idx].next;
+        heap_set(sched, idx, sched->heap[sched->heap_len]);
+        if (sched->heap[idx].next < removed_next) {
+            sift_up(sched, idx);
+        } else {
+            sift_down(sched, idx);
+        }
+    }
+    sched->jobs[job].heap_index = CRON_SCHED_NOT_ARMED;
+}
+
+static int valid_job(const cron_scheduler* sched, int job) {
+    return sched && job >= 0 && (size_t) job < sched->jobs_len &&
+            CRON_SCHED_REMOVED != sched->jobs[job].heap_index;
+}
+
+cron_scheduler* cron_scheduler_new(size_t capacity) {
+    cron_scheduler* sched = (cron_scheduler*) cron_malloc(sizeof(cron_scheduler));
+    if (!sched) return NULL;
+    memset(sched, 0, sizeof(cron_scheduler));
+    sched->free_head = -1;
+    if (capacity > 0) {
+        sched->heap = (cron_sched_node*) cron_malloc(capacity * sizeof(cron_sched_node));
+        sched->jobs = (cron_sched_job*) cron_malloc(capacity * sizeof(cron_sched_job));
+        if (!sched->heap || !sched->jobs) {
+            cron_scheduler_free(sched);
+            return NULL;
+        }
+        sched->heap_cap = capacity;
+        sched->jobs_cap = capacity;
+    }
+    return sched;
+}
+
+int cron_scheduler_add(cron_scheduler* sched, const cron_expr* expr, void* payload, time_t date) {
+    int job;
+    time_t next;
+    if (!sched || !expr) return -1;
+    next = cron_next(expr, date);
+    if (CRON_INVALID_INSTANT == next) return -1;
+    if (-1 != sched->free_head) {
+        job = sched->free_head;
+        sched->free_head = sched->jobs[job].next_free;
+    } else {
+        if (sched->jobs_len >= INT_MAX) return -1;
+        if (sched->jobs_len == sched->jobs_cap) {
+            void* grown = grow_array(sched->jobs, sched->jobs_len, &sched->jobs_cap, sizeof(cron_sched_job));
+            if (!grown) return -1;
+            sched->jobs = (cron_sched_job*) grown;
+        }
+        job = (int) sched->jobs_len;
+        sched->jobs_len += 1;
+    }
+    sched->jobs[job].expr = expr;
+    sched->jobs[job].payload = payload;
+    sched->jobs[job].heap_index = CRON_SCHED_NOT_ARMED;
+    sched->jobs[job].next_free = -1;
+    if (0 != heap_push(sched, job, next)) {
+        cron_scheduler_remove(sched, job);
+        return -1;
+    }
+    return job;
+}
+
+int cron_scheduler_remove(cron_scheduler* sched, int job) {
+    if (!valid_job(sched, job)) return -1;
+    if (CRON_SCHED_NOT_ARMED != sched->jobs[job].heap_index) {
+        heap_remove(sched, (size_t) sched->jobs[job].heap_index);
+    }
+    sched->jobs[job].expr = NULL;
+    sched->jobs[job].payload = NULL;
+    sched->jobs[job].heap_index = CRON_SCHED_REMOVED;
+    sched->jobs[job].next_free = sched->free_head;
+    sched->free_head = job;
+    return 0;
+}
+
+time_t cron_scheduler_peek(const cron_scheduler* sched) {
+    if (!sched || 0 == sched->heap_len) return CRON_INVALID_INSTANT;
+    return sched->heap[0].next;
+}
+
+int cron_scheduler_pop_due(cron_scheduler* sched, time_t date, void** payload, time_t* fire_date) {
+    int job;
+    if (!sched || 0 == sched->heap_len || sched->heap[0].next > date) return -1;
+    job = sched->heap[0].job;
+    if (fire_date) {
+        *fire_date = sched->heap[0].next;
+    }
+    if (payload) {
+        *payload = sched->jobs[job].payload;
+    }
+    heap_remove(sched, 0);
+    return job;
+}
+
+int cron_scheduler_rearm(cron_scheduler* sched, int job, time_t date) {
+    time_t next;
+    if (!valid_job(sched, job)) return -1;
+    if (CRON_SCHED_NOT_ARMED != sched->jobs[job].heap_index) {
+        heap_remove(sched, (size_t) sched->jobs[job].heap_index);
+    }
+    next = cron_next(sched->jobs[job].expr, date);
+    if (CRON_INVALID_INSTANT == next) return -1;
+    return heap_push(sched, job, next);
+}
+
+void cron_scheduler_free(cron_scheduler* sched) {
+    if (!sched) return;
+    if (sched->heap) {
+        cron_free(sched->heap);
+    }
+    if (sched->jobs) {
+        cron_free(sched->jobs);
+    }
+    cron_free(sched);
+}
@@ -0,0 +1,102 @@
+/*
+ * File:   ccronexpr_sched.h
+ *
+ * Scheduler over a set of cron expressions ordered by their next 'fire' dates.
+ */
+
+#ifndef CCRONEXPR_SCHED_H
+#define	CCRONEXPR_SCHED_H
+
+#include "ccronexpr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Scheduler, holds jobs (cron expression with client payload) in a 4-ary
+ * min-heap ordered by the next 'fire' date of each job.
+ * Scheduler is not thread-safe.
+ */
+typedef struct cron_scheduler cron_scheduler;
+
+/**
+ * Creates empty scheduler.
+ *
+ * @param capacity number of jobs to preallocate space for, can be 0
+ * @return scheduler in case of success, must be freed by client using
+ *         'cron_scheduler_free' function. NULL is returned on error.
+ */
+cron_scheduler* cron_scheduler_new(size_t capacity);
+
+/**
+ * Adds a job to the scheduler and arms it with the next 'fire' date
+ * of the expression after the specified date.
+ * Scheduler does not copy the expression, it must stay valid
+ * until the job is removed or the scheduler is freed.
+ *
+ * @param sched scheduler
+ * @param expr parsed cron expression of the job
+ * @param payload client data returned with the job when it is due
+ * @param date date to calculate the first 'fire' date from
+ * @return job id (not negative) in case of success, ids of removed jobs
+ *         are reused. -1 is returned on error or if the expression never fires.
+ */
+int cron_scheduler_add(cron_scheduler* sched, const cron_expr* expr, void* payload, time_t date);
+
+/**
+ * Removes the job from the scheduler.
+ *
+ * @param sched scheduler
+ * @param job job id returned by 'cron_scheduler_add'
+ * @return 0 in case of success, -1 if there is no such job.
+ */
+int cron_scheduler_remove(cron_scheduler* sched, int job);
+
+/**
+ * Returns the earliest 'fire' date of all armed jobs, can be used
+ * to find out how long to sleep before the next 'cron_scheduler_pop_due' call.
+ *
+ * @param sched scheduler
+ * @return earliest 'fire' date, '((time_t) -1)' if no jobs are armed.
+ */
+time_t cron_scheduler_peek(const cron_scheduler* sched);
+
+/**
+ * Takes the job with the earliest 'fire' date if it is due (not after
+ * the specified date). The job stays in the scheduler, but is not armed
+ * until 'cron_scheduler_rearm' is called for it.
+ *
+ * @param sched scheduler
+ * @param date current date
+ * @param payload output client data of the job, can be NULL
+ * @param fire_date output 'fire' date of the job, can be NULL
+ * @return due job id, -1 if no job is due.
+ */
+int cron_scheduler_pop_due(cron_scheduler* sched, time_t date, void** payload, time_t* fire_date);
+
+/**
+ * Arms the job again with the next 'fire' date of its expression after the
+ * specified date (usually the 'fire' date returned from 'cron_scheduler_pop_due').
+ * If the job is already armed its 'fire' date is replaced.
+ *
+ * @param sched scheduler
+ * @param job job id
+ * @param date date to calculate the next 'fire' date from
+ * @return 0 in case of success, -1 if there is no such job or its
+ *         expression does not fire anymore (the job is left not armed).
+ */
+int cron_scheduler_rearm(cron_scheduler* sched, int job, time_t date);
+
+/**
+ * Frees the scheduler, expressions of the jobs are not freed.
+ *
+ * @param sched scheduler to free
+ */
+void cron_scheduler_free(cron_scheduler* sched);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* CCRONEXPR_SCHED_H */
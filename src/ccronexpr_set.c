@@ -0,0 +1,294 @@
+/*
+ * File:   ccronexpr_set.c
+ *
+ * Set of cron expressions matched against a date all at once.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "ccronexpr_set.h"
+#include "ccronexpr_alloc.h"
+#include "ccronexpr_internal.h"
+
+#if !defined(CRON_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define CRON_SET_AVX2
+#elif !defined(CRON_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define CRON_SET_SSE2
+#endif
+
+#define CRON_SET_MIN_CAPACITY 256
+/* rows are matched in blocks of 256 bits (one AVX2 register, two SSE2 registers) */
+#define CRON_SET_BLOCK_WORDS 4
+#define CRON_SET_BLOCK_BITS (CRON_SET_BLOCK_WORDS * 64)
+
+/* 'next_free' of an expression in the set */
+#define CRON_SET_USED -2
+
+#define CRON_SET_FIELDS_COUNT 6
+/* one row per field value, days of month use rows for values 0-31 (0 is never set) */
+#define CRON_SET_FIELD_ROWS (60 + 60 + 24 + 32 + 12 + 7)
+/* expressions with day items ('L', 'W', '#') have all the day rows set, they and
+   the expressions with a year field are marked in the last row, their days
+   are checked after the rows are matched */
+#define CRON_SET_CHECKED_ROW CRON_SET_FIELD_ROWS
+#define CRON_SET_ROWS (CRON_SET_FIELD_ROWS + 1)
+
+/* first row of each field, in the order seconds, minutes, hours, days of month, months, days of week */
+static const int FIELD_ROWS[CRON_SET_FIELDS_COUNT] = {0, 60, 120, 144, 176, 188};
+
+typedef struct {
+    cron_expr expr;
+    int next_free;
+} cron_set_slot;
+
+struct cron_expr_set {
+    cron_set_slot* slots;
+    size_t slots_len;
+    size_t slots_cap;
+    /* CRON_SET_ROWS rows of 'words_cap' words each */
+    uint64_t* rows;
+    size_t words_cap;
+    size_t size;
+    int free_head;
+};
+
+/* values of the field that have rows, bits outside of the field range are ignored */
+static uint64_t field_bits(const cron_expr* expr, int field) {
+    switch (field) {
+        case 0: return expr->seconds & 0x0FFFFFFFFFFFFFFFULL;
+        case 1: return expr->minutes & 0x0FFFFFFFFFFFFFFFULL;
+        case 2: return expr->hours & 0xFFFFFFu;
+        case 3: return has_day_items(expr) ? 0xFFFFFFFEu : expr->days_of_month & 0xFFFFFFFEu;
+        case 4: return expr->months & 0xFFFu;
+        default: return has_day_items(expr) ? 0x7Fu : expr->days_of_week & 0x7Fu;
+    }
+}
+
+static size_t words_for(size_t exprs) {
+    return (exprs + CRON_SET_BLOCK_BITS - 1) / CRON_SET_BLOCK_BITS * CRON_SET_BLOCK_WORDS;
+}
+
+static int reserve(cron_expr_set* set, size_t capacity) {
+    size_t words = words_for(capacity);
+    cron_set_slot* slots;
+    if (capacity <= set->slots_cap) return 0;
+    slots = (cron_set_slot*) cron_malloc(capacity * sizeof(cron_set_slot));
+    if (!slots) return -1;
+    if (words > set->words_cap) {
+        uint64_t* rows = (uint64_t*) cron_malloc(CRON_SET_ROWS * words * sizeof(uint64_t));
+        size_t row;
+        if (!rows) {
+            cron_free(slots);
+            return -1;
+        }
+        memset(rows, 0, CRON_SET_ROWS * words * sizeof(uint64_t));
+        if (set->rows) {
+            for (row = 0; row < CRON_SET_ROWS; row++) {
+                memcpy(rows + row * words, set->rows + row * set->words_cap, set->words_cap * sizeof(uint64_t));
+            }
+            cron_free(set->rows);
+        }
+        set->rows = rows;
+        set->words_cap = words;
+    }
+    if (set->slots) {
+        memcpy(slots, set->slots, set->slots_len * sizeof(cron_set_slot));
+        cron_free(set->slots);
+    }
+    set->slots = slots;
+    set->slots_cap = capacity;
+    return 0;
+}
+
+static void set_rows(cron_expr_set* set, int id, const cron_expr* expr, int on) {
+    size_t word = (size_t) id / 64;
+    uint64_t bit = 1ULL << (id % 64);
+    int field;
+    if (has_day_items(expr) || expr->year_first) {
+        uint64_t* row = set->rows + CRON_SET_CHECKED_ROW * set->words_cap;
+        row[word] = on ? row[word] | bit : row[word] & ~bit;
+    }
+    for (field = 0; field < CRON_SET_FIELDS_COUNT; field++) {
+        uint64_t bits = field_bits(expr, field);
+        while (bits) {
+            uint64_t* row = set->rows + (FIELD_ROWS[field] + ctz64(bits)) * set->words_cap;
+            if (on) {
+                row[word] |= bit;
+            } else {
+                row[word] &= ~bit;
+            }
+            bits &= bits - 1;
+        }
+    }
+}
+
+/* ANDs the block of the rows starting at word 'w' into 'block', returns 0 if all bits are zero */
+static int and_block(const uint64_t* const* rows, int rows_len, size_t w, uint64_t* block) {
+    int r;
+#if defined(CRON_SET_AVX2)
+    __m256i acc = _mm256_loadu_si256((const __m256i*) (rows[0] + w));
+    for (r = 1; r < rows_len; r++) {
+        acc = _mm256_and_si256(acc, _mm256_loadu_si256((const __m256i*) (rows[r] + w)));
+    }
+    if (_mm256_testz_si256(acc, acc)) return 0;
+    _mm256_storeu_si256((__m256i*) block, acc);
+    return 1;
+#elif defined(CRON_SET_SSE2)
+    __m128i lo = _mm_loadu_si128((const __m128i*) (rows[0] + w));
+    __m128i hi = _mm_loadu_si128((const __m128i*) (rows[0] + w + 2));
+    for (r = 1; r < rows_len; r++) {
+        lo = _mm_and_si128(lo, _mm_loadu_si128((const __m128i*) (rows[r] + w)));
+        hi = _mm_and_si128(hi, _mm_loadu_si128((const __m128i*) (rows[r] + w + 2)));
+    }
+    if (0xFFFF == _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(lo, hi), _mm_setzero_si128()))) return 0;
+    _mm_storeu_si128((__m128i*) block, lo);
+    _mm_storeu_si128((__m128i*) (block + 2), hi);
+    return 1;
+#else
+    uint64_t any = 0;
+    int i;
+    for (i = 0; i < CRON_SET_BLOCK_WORDS; i++) {
+        uint64_t acc = rows[0][w + i];
+        for (r = 1; r < rows_len; r++) {
+            acc &= rows[r][w + i];
+        }
+        block[i] = acc;
+        any |= acc;
+    }
+    return 0 != any;
+#endif
+}
+
+static size_t match_rows(const cron_expr_set* set, const uint64_t* const* rows, int rows_len,
+        const struct tm* calendar, int with_seconds, int* ids, size_t max_ids) {
+    const uint64_t* checked = set->rows + CRON_SET_CHECKED_ROW * set->words_cap;
+    size_t words = words_for(set->slots_len);
+    size_t written = 0;
+    size_t w;
+    uint64_t block[CRON_SET_BLOCK_WORDS];
+    for (w = 0; w < words && written < max_ids; w += CRON_SET_BLOCK_WORDS) {
+        int i;
+        if (!and_block(rows, rows_len, w, block)) continue;
+        for (i = 0; i < CRON_SET_BLOCK_WORDS; i++) {
+            uint64_t bits = block[i];
+            uint64_t check = bits & checked[w + i];
+            while (check) {
+                const cron_expr* expr = &set->slots[(w + i) * 64 + ctz64(check)].expr;
+                struct tm day = *calendar;
+                /* only the day is left to check, seconds are matched by the rows or not at all */
+                if (!with_seconds) {
+                    day.tm_sec = (int) ctz64(expr->seconds);
+                }
+                if (!cron_matches_calendar(expr, &day)) {
+                    bits &= ~(check & (0 - check));
+                }
+                check &= check - 1;
+            }
+            while (bits && written < max_ids) {
+                ids[written++] = (int) ((w + i) * 64 + ctz64(bits));
+                bits &= bits - 1;
+            }
+        }
+    }
+    return written;
+}
+
+static int valid_calendar(const struct tm* calendar) {
+    return calendar->tm_min >= 0 && calendar->tm_min < 60 && calendar->tm_hour >= 0 && calendar->tm_hour < 24 &&
+            calendar->tm_mday >= 1 && calendar->tm_mday <= 31 && calendar->tm_mon >= 0 && calendar->tm_mon < 12 && calendar->tm_wday >= 0 && calendar->tm_wday < 7;
+}
+
+static size_t match_calendar(const cron_expr_set* set, const struct tm* calendar, int with_seconds, int* ids, size_t max_ids) {
+    const uint64_t* rows[CRON_SET_FIELDS_COUNT];
+    int values[CRON_SET_FIELDS_COUNT];
+    int rows_len = 0;
+    int field;
+    if (!set || !calendar || !ids || 0 == set->size || !valid_calendar(calendar)) return 0;
+    if (with_seconds && (calendar->tm_sec < 0 || calendar->tm_sec >= 60)) return 0;
+    values[0] = calendar->tm_sec;
+    values[1] = calendar->tm_min;
+    values[2] = calendar->tm_hour;
+    values[3] = calendar->tm_mday;
+    values[4] = calendar->tm_mon;
+    values[5] = calendar->tm_wday;
+    /* every expression in the set has some second, seconds are skipped to match the whole minute */
+    for (field = with_seconds ? 0 : 1; field < CRON_SET_FIELDS_COUNT; field++) {
+        rows[rows_len++] = set->rows + (FIELD_ROWS[field] + values[field]) * set->words_cap;
+    }
+    return match_rows(set, rows, rows_len, calendar, with_seconds, ids, max_ids);
+}
+
+cron_expr_set* cron_expr_set_new(size_t capacity) {
+    cron_expr_set* set = (cron_expr_set*) cron_malloc(sizeof(cron_expr_set));
+    if (!set) return NULL;
+    memset(set, 0, sizeof(cron_expr_set));
+    set->free_head = -1;
+    if (capacity > 0 && 0 != reserve(set, capacity)) {
+        cron_expr_set_free(set);
+        return NULL;
+    }
+    return set;
+}
+
+int cron_expr_set_add(cron_expr_set* set, const cron_expr* expr) {
+    int id;
+    int field;
+    if (!set || !expr) return -1;
+    for (field = 0; field < CRON_SET_FIELDS_COUNT; field++) {
+        if (0 == field_bits(expr, field)) return -1;
+    }
+    if (-1 != set->free_head) {
+        id = set->free_head;
+        set->free_head = set->slots[id].next_free;
+    } else {
+        if (set->slots_len >= INT_MAX) return -1;
+        if (set->slots_len == set->slots_cap) {
+            size_t capacity = set->slots_cap >= CRON_SET_MIN_CAPACITY ? set->slots_cap * 2 : CRON_SET_MIN_CAPACITY;
+            if (0 != reserve(set, capacity)) return -1;
+        }
+        id = (int) set->slots_len;
+        set->slots_len += 1;
+    }
+    set->slots[id].expr = *expr;
+    set->slots[id].next_free = CRON_SET_USED;
+    set_rows(set, id, expr, 1);
+    set->size += 1;
+    return id;
+}
+
+int cron_expr_set_remove(cron_expr_set* set, int id) {
+    if (!set || id < 0 || (size_t) id >= set->slots_len || CRON_SET_USED != set->slots[id].next_free) return -1;
+    set_rows(set, id, &set->slots[id].expr, 0);
+    set->slots[id].next_free = set->free_head;
+    set->free_head = id;
+    set->size -= 1;
+    return 0;
+}
+
+size_t cron_expr_set_size(const cron_expr_set* set) {
+    if (!set) return 0;
+    return set->size;
+}
+
+size_t cron_expr_set_match(const cron_expr_set* set, const struct tm* calendar, int* ids, size_t max_ids) {
+    return match_calendar(set, calendar, 1, ids, max_ids);
+}
+
+size_t cron_expr_set_match_minute(const cron_expr_set* set, const struct tm* calendar, int* ids, size_t max_ids) {
+    return match_calendar(set, calendar, 0, ids, max_ids);
+}
+
+void cron_expr_set_free(cron_expr_set* set) {
+    if (!set) return;
+    if (set->slots) {
+        cron_free(set->slots);
+    }
+    if (set->rows) {
+        cron_free(set->rows);
+    }
+    cron_free(set);
+}
@@ -0,0 +1,107 @@
+/*
+ * File:   ccronexpr_set.h
+ *
+ * Set of cron expressions matched against a date all at once.
+ */
+
+#ifndef CCRONEXPR_SET_H
+#define	CCRONEXPR_SET_H
+
+#include "ccronexpr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Set of expressions stored as structure of arrays: for every value of every
+ * field (second 0-59, minute 0-59, ..., day of week 0-6) the set keeps a bit array
+ * with one bit per expression, so matching a date is an AND of six bit arrays,
+ * done with AVX2 or SSE2 when the compiler targets it (scalar code otherwise,
+ * or when compiled with '-DCRON_NO_SIMD'). Days of the expressions with day items
+ * ('L', 'W', '#') or a year field are checked one by one after that, so the set
+ * also keeps a copy of every expression. Per expression the set takes about
+ * 25 bytes of bit arrays and a slot of 'sizeof(cron_expr)' plus an int
+ * (with padding).
+ * Set is not thread-safe, but matching does not modify it and can be done
+ * concurrently.
+ */
+typedef struct cron_expr_set cron_expr_set;
+
+/**
+ * Creates empty set.
+ *
+ * @param capacity number of expressions to preallocate space for, can be 0
+ * @return set in case of success, must be freed by client using
+ *         'cron_expr_set_free' function. NULL is returned on error.
+ */
+cron_expr_set* cron_expr_set_new(size_t capacity);
+
+/**
+ * Adds a copy of the expression to the set, the expression itself
+ * is not needed after this call.
+ *
+ * @param set set
+ * @param expr parsed cron expression
+ * @return expression id (not negative) in case of success, ids of removed
+ *         expressions are reused. -1 is returned on error or if the expression
+ *         never fires (one of its fields is empty).
+ */
+int cron_expr_set_add(cron_expr_set* set, const cron_expr* expr);
+
+/**
+ * Removes the expression from the set.
+ *
+ * @param set set
+ * @param id expression id returned by 'cron_expr_set_add'
+ * @return 0 in case of success, -1 if there is no such expression.
+ */
+int cron_expr_set_remove(cron_expr_set* set, int id);
+
+/**
+ * Returns number of expressions in the set.
+ *
+ * @param set set
+ * @return number of expressions
+ */
+size_t cron_expr_set_size(const cron_expr_set* set);
+
+/**
+ * Finds expressions that fire at the specified second. The date is passed
+ * decomposed, so the same calendar (from 'gmtime', 'localtime' or shifted by
+ * 'cron_tz_offset') is used for all expressions.
+ *
+ * @param set set
+ * @param calendar date to match, only 'tm_sec', 'tm_min', 'tm_hour',
+ *        'tm_mday', 'tm_mon', 'tm_wday' and 'tm_year' (for the expressions
+ *        with day items like 'L' or a year field) are used
+ * @param ids output array of matching expression ids in increasing order
+ * @param max_ids size of 'ids' array, no more ids than that are written
+ * @return number of ids written to 'ids'.
+ */
+size_t cron_expr_set_match(const cron_expr_set* set, const struct tm* calendar, int* ids, size_t max_ids);
+
+/**
+ * Same as 'cron_expr_set_match', but finds expressions that fire at any second
+ * of the minute of the specified date, 'tm_sec' is not used.
+ *
+ * @param set set
+ * @param calendar date to match
+ * @param ids output array of matching expression ids in increasing order
+ * @param max_ids size of 'ids' array, no more ids than that are written
+ * @return number of ids written to 'ids'.
+ */
+size_t cron_expr_set_match_minute(const cron_expr_set* set, const struct tm* calendar, int* ids, size_t max_ids);
+
+/**
+ * Frees the set.
+ *
+ * @param set set to free
+ */
+void cron_expr_set_free(cron_expr_set* set);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* CCRONEXPR_SET_H */
@@ -0,0 +1,559 @@
+/*
+ * File:   ccronexpr_store.c
+ *
+ * Schedule of jobs kept in a memory mapped file, survives process restarts.
+ */
+
+#if defined(__unix__) || defined(__APPLE__)
+/* 'ftruncate', 'fsync' and 'msync' in strict C89 mode */
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "ccronexpr_store.h"
+#include "ccronexpr_alloc.h"
+
+/* ESP and AVR boards have no files to map */
+#if defined(ESP8266) || defined(__AVR__) || defined (ARDUINO_ARCH_NRF52)
+#define CRON_NO_FILE_IO
+#endif
+
+#if !defined(CRON_NO_FILE_IO) && (defined(__unix__) || defined(__APPLE__))
+#define CRON_STORE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define CRON_INVALID_INSTANT ((time_t) -1)
+
+#define CRON_STORE_MAGIC "CRONSTOR"
+#define CRON_STORE_VERSION 1
+/* written in native byte order, files of the platforms with other byte order are rejected */
+#define CRON_STORE_BYTE_ORDER 0x01020304u
+
+/* heap arity, same as in the scheduler */
+#define CRON_STORE_ARITY 4
+/* 'next_fire' of a removed job, its 'last_fire' is the next slot of the free list */
+#define CRON_STORE_REMOVED -2
+/* 'heap_index' of a job that is not armed */
+#define CRON_STORE_NOT_ARMED 0xFFFFFFFFu
+
+/*
+ * The file is the header, 'capacity' job records and 'capacity' heap nodes.
+ * Records are the source of truth, the free list and the heap are rebuilt
+ * from them if the file was not closed cleanly.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    uint64_t capacity;
+    /* slots used at least once, only they are scanned by the recovery */
+    uint64_t used;
+    uint64_t heap_len;
+    int64_t free_head;
+    uint64_t size;
+    /* 1 if all changes were written when the file was closed, 0 while it is open */
+    uint32_t clean;
+    uint32_t reserved;
+} cron_store_header;
+
+/* state of the job, a new state is written to the copy with the lower 'seq' */
+typedef struct {
+    int64_t last_fire;
+    int64_t next_fire;
+    uint32_t seq;
+    /* checksum of the state and the job fields, detects torn writes */
+    uint32_t check;
+} cron_store_state;
+
+typedef struct {
+    unsigned char expr[CRON_EXPR_RECORD_SIZE];
+    int64_t job_id;
+    cron_store_state states[2];
+    /* position in the heap, not covered by the checksums */
+    uint32_t heap_index;
+    uint32_t reserved;
+} cron_store_record;
+
+typedef struct {
+    int64_t next;
+    uint32_t slot;
+    uint32_t reserved;
+} cron_store_node;
+
+struct cron_store {
+    unsigned char* map;
+    size_t map_len;
+    int fd;
+    cron_store_header* header;
+    cron_store_record* records;
+    cron_store_node* heap;
+    /* taken and not rearmed jobs, if there are any the file is not marked as clean */
+    size_t pending;
+    int recovered;
+};
+
+static uint64_t mix_word(uint64_t hash, uint64_t word) {
+    hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 29);
+}
+
+static uint32_t state_check(const cron_store_record* record, const cron_store_state* state) {
+    uint64_t hash = 0x243F6A8885A308D3ULL;
+    uint64_t word;
+    size_t i;
+    for (i = 0; i < CRON_EXPR_RECORD_SIZE; i += 8) {
+        memcpy(&word, record->expr + i, 8);
+        hash = mix_word(hash, word);
+    }
+    hash = mix_word(hash, (uint64_t) record->job_id);
+    hash = mix_word(hash, (uint64_t) state->last_fire);
+    hash = mix_word(hash, (uint64_t) state->next_fire);
+    hash = mix_word(hash, state->seq);
+    return (uint32_t) (hash ^ (hash >> 32));
+}
+
+static int state_valid(const cron_store_record* record, int copy) {
+    return record->states[copy].check == state_check(record, &record->states[copy]);
+}
+
+/* both copies are valid while the store is open (see 'recover'), the newer one is current */
+static const cron_store_state* current_state(const cron_store_record* record) {
+    return (int32_t) (record->states[1].seq - record->states[0].seq) > 0 ? &record->states[1] : &record->states[0];
+}
+
+static void write_state(cron_store_record* record, int64_t last_fire, int64_t next_fire) {
+    const cron_store_state* current = current_state(record);
+    cron_store_state* older = current == &record->states[0] ? &record->states[1] : &record->states[0];
+    cron_store_state state;
+    state.last_fire = last_fire;
+    state.next_fire = next_fire;
+    state.seq = current->seq + 1;
+    state.check = state_check(record, &state);
+    *older = state;
+}
+
+/* writes the same state to both copies, used when the job fields change */
+static void write_both_states(cron_store_record* record, int64_t last_fire, int64_t next_fire, uint32_t seq) {
+    record->states[0].last_fire = last_fire;
+    record->states[0].next_fire = next_fire;
+    record->states[0].seq = seq;
+    record->states[0].check = state_check(record, &record->states[0]);
+    record->states[1] = record->states[0];
+}
+
+static void heap_set(cron_store* store, size_t idx, cron_store_node node) {
+    store->heap[idx] = node;
+    store->records[node.slot].heap_index = (uint32_t) idx;
+}
+
+static void sift_up(cron_store* store, size_t idx) {
+    cron_store_node node = store->heap[idx];
+    while (idx > 0) {
+        size_t parent = (idx - 1) / CRON_STORE_ARITY;
+        if (store->heap[parent].next <= node.next) break;
+        heap_set(store, idx, store->heap[parent]);
+        idx = parent;
+    }
+    heap_set(store, idx, node);
+}
+
+static void sift_down(cron_store* store, size_t idx) {
+    size_t len = (size_t) store->header->heap_len;
+    cron_store_node node = store->heap[idx];
+    for (;;) {
+        size_t first = idx * CRON_STORE_ARITY + 1;
+        size_t last = first + CRON_STORE_ARITY;
+        size_t min = idx;
+        int64_t min_next = node.next;
+        size_t i;
+        if (first >= len) break;
+        if (last > len) {
+            last = len;
+        }
+        for (i = first; i < last; i++) {
+            if (store->heap[i].next < min_next) {
+                min = i;
+                min_next = store->heap[i].next;
+            }
+        }
+        if (min == idx) break;
+        heap_set(store, idx, store->heap[min]);
+        idx = min;
+    }
+    heap_set(store, idx, node);
+}
+
+static void heap_push(cron_store* store, int slot, int64_t next) {
+    cron_store_node node;
+    node.next = next;
+    node.slot = (uint32_t) slot;
+    node.reserved = 0;
+    store->heap[store->header->heap_len] = node;
+    store->header->heap_len += 1;
+    sift_up(store, (size_t) store->header->heap_len - 1);
+}
+
+static void heap_remove(cron_store* store, size_t idx) {
+    uint32_t slot = store->heap[idx].slot;
+    size_t len = (size_t) store->header->heap_len - 1;
+    store->header->heap_len = len;
+    if (idx != len) {
+        int64_t removed_next = store->heap[idx].next;
+        heap_set(store, idx, store->heap[len]);
+        if (store->heap[idx].next < removed_next) {
+            sift_up(store, idx);
+        } else {
+            sift_down(store, idx);
+        }
+    }
+    store->records[slot].heap_index = CRON_STORE_NOT_ARMED;
+}
+
+static int valid_slot(const cron_store* store, int slot) {
+    return store && slot >= 0 && (uint64_t) slot < store->header->used &&
+            CRON_STORE_REMOVED != current_state(&store->records[slot])->next_fire;
+}
+
+/* heap position of the job is checked before it is used, files closed cleanly are not fully validated */
+static int valid_heap_index(const cron_store* store, int slot) {
+    uint32_t idx = store->records[slot].heap_index;
+    return CRON_STORE_NOT_ARMED == idx || (idx < store->header->heap_len && (uint32_t) slot == store->heap[idx].slot);
+}
+
+/* taken by 'cron_store_pop_due' and not rearmed */
+static int is_pending(const cron_store_record* record) {
+    return CRON_STORE_NOT_ARMED == record->heap_index && CRON_INVALID_INSTANT != (time_t) current_state(record)->next_fire;
+}
+
+/**
+ * Rebuilds the free list and the heap from the job records after a crash. Records
+ * with one torn copy of the state get the other copy, records with none valid
+ * were being added or reused when the crash happened and are removed.
+ */
+static void recover(cron_store* store) {
+    cron_store_header* header = store->header;
+    uint64_t slot;
+    size_t i;
+    header->free_head = -1;
+    header->heap_len = 0;
+    header->size = 0;
+    /* from the end, so that the free list is in the order of slots */
+    for (slot = header->used; slot-- > 0;) {
+        cron_store_record* record = &store->records[slot];
+        int valid0 = state_valid(record, 0);
+        int valid1 = state_valid(record, 1);
+        const cron_store_state* state;
+        if (!valid0 && !valid1) {
+            write_both_states(record, -1, CRON_STORE_REMOVED, 0);
+        } else if (!valid0) {
+            record->states[0] = record->states[1];
+        } else if (!valid1) {
+            record->states[1] = record->states[0];
+        }
+        record->heap_index = CRON_STORE_NOT_ARMED;
+        state = current_state(record);
+        if (CRON_STORE_REMOVED == state->next_fire) {
+            write_state(record, header->free_head, CRON_STORE_REMOVED);
+            header->free_head = (int64_t) slot;
+        } else {
+            header->size += 1;
+            if (CRON_INVALID_INSTANT != (time_t) state->next_fire) {
+                store->heap[header->heap_len].next = state->next_fire;
+                store->heap[header->heap_len].slot = (uint32_t) slot;
+                store->heap[header->heap_len].reserved = 0;
+                header->heap_len += 1;
+            }
+        }
+    }
+    for (i = (size_t) header->heap_len; i-- > 0;) {
+        store->records[store->heap[i].slot].heap_index = (uint32_t) i;
+    }
+    if (header->heap_len > 1) {
+        for (i = ((size_t) header->heap_len - 2) / CRON_STORE_ARITY + 1; i-- > 0;) {
+            sift_down(store, i);
+        }
+    }
+}
+
+#ifdef CRON_STORE_MMAP
+static size_t file_len(uint64_t capacity) {
+    return sizeof(cron_store_header) + (size_t) capacity * (sizeof(cron_store_record) + sizeof(cron_store_node));
+}
+
+static int valid_header(const cron_store_header* header, size_t len) {
+    return 0 == memcmp(header->magic, CRON_STORE_MAGIC, 8) && CRON_STORE_BYTE_ORDER == header->byte_order &&
+            CRON_STORE_VERSION == header->version && header->capacity <= INT_MAX &&
+            len == file_len(header->capacity) && header->used <= header->capacity &&
+            header->heap_len <= header->used && header->size <= header->used;
+}
+
+/**
+ * Checks the heap and the free list of a file closed cleanly before they are
+ * used as indexes: heap slots and free list slots must be jobs of the file,
+ * the free list must end and hold all the removed jobs.
+ */
+static int valid_index(const cron_store* store) {
+    const cron_store_header* header = store->header;
+    uint64_t free_len = 0;
+    int64_t slot;
+    uint64_t i;
+    if (header->heap_len > header->size) return 0;
+    for (i = 0; i < header->heap_len; i++) {
+        if (store->heap[i].slot >= header->used) return 0;
+    }
+    for (slot = header->free_head; -1 != slot; slot = current_state(&store->records[slot])->last_fire) {
+        if (slot < 0 || (uint64_t) slot >= header->used || free_len == header->used - header->size ||
+                CRON_STORE_REMOVED != current_state(&store->records[slot])->next_fire) return 0;
+        free_len += 1;
+    }
+    return free_len == header->used - header->size;
+}
+#endif /* CRON_STORE_MMAP */
+
+cron_store* cron_store_open(const char* path, size_t capacity, const char** error) {
+    const char* err_local;
+#ifdef CRON_STORE_MMAP
+    cron_store* store = NULL;
+    struct stat st;
+    int created = 0;
+    if (!error) {
+        error = &err_local;
+    }
+    *error = NULL;
+    if (!path) {
+        *error = "Invalid NULL path";
+        return NULL;
+    }
+    store = (cron_store*) cron_malloc(sizeof(cron_store));
+    if (!store) {
+        *error = "Memory allocation error";
+        return NULL;
+    }
+    memset(store, 0, sizeof(cron_store));
+    store->map = (unsigned char*) MAP_FAILED;
+    store->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (-1 == store->fd) {
+        *error = "Store file open error";
+        goto return_error;
+    }
+    if (0 != fstat(store->fd, &st)) {
+        *error = "Store file read error";
+        goto return_error;
+    }
+    if (0 == st.st_size) {
+        if (0 == capacity || capacity > INT_MAX ||
+                capacity > (((size_t) -1) - sizeof(cron_store_header)) / (sizeof(cron_store_record) + sizeof(cron_store_node))) {
+            *error = "Invalid store capacity";
+            goto return_error;
+        }
+        store->map_len = file_len(capacity);
+        if (0 != ftruncate(store->fd, (off_t) store->map_len)) {
+            *error = "Store file write error";
+            goto return_error;
+        }
+        created = 1;
+    } else {
+        if ((uint64_t) st.st_size < sizeof(cron_store_header) || (uint64_t) st.st_size > (size_t) -1) {
+            *error = "Invalid store file";
+            goto return_error;
+        }
+        store->map_len = (size_t) st.st_size;
+    }
+    store->map = (unsigned char*) mmap(NULL, store->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+    if (MAP_FAILED == (void*) store->map) {
+        *error = "Store file map error";
+        goto return_error;
+    }
+    store->header = (cron_store_header*) store->map;
+    if (created) {
+        memcpy(store->header->magic, CRON_STORE_MAGIC, 8);
+        store->header->byte_order = CRON_STORE_BYTE_ORDER;
+        store->header->version = CRON_STORE_VERSION;
+        store->header->capacity = capacity;
+        store->header->free_head = -1;
+        store->header->clean = 1;
+    }
+    if (!valid_header(store->header, store->map_len)) {
+        *error = "Invalid store file";
+        goto return_error;
+    }
+    store->records = (cron_store_record*) (store->map + sizeof(cron_store_header));
+    store->heap = (cron_store_node*) (store->records + store->header->capacity);
+    if (!store->header->clean || !valid_index(store)) {
+        recover(store);
+        store->recovered = 1;
+    }
+    /* on disk before any change, so that a crash is always noticed */
+    store->header->clean = 0;
+    if (0 != msync(store->map, sizeof(cron_store_header), MS_SYNC)) {
+        *error = "Store file write error";
+        goto return_error;
+    }
+    return store;
+
+    return_error:
+        if (MAP_FAILED != (void*) store->map) {
+            munmap(store->map, store->map_len);
+        }
+        if (-1 != store->fd) {
+            close(store->fd);
+        }
+        cron_free(store);
+        return NULL;
+#else /* CRON_STORE_MMAP */
+    (void) path;
+    (void) capacity;
+    if (!error) {
+        error = &err_local;
+    }
+    *error = "Stores are not supported on this platform";
+    return NULL;
+#endif /* CRON_STORE_MMAP */
+}
+
+int cron_store_recovered(const cron_store* store) {
+    return store ? store->recovered : 0;
+}
+
+int cron_store_add(cron_store* store, const cron_expr* expr, int64_t job_id, time_t date) {
+    unsigned char expr_record[CRON_EXPR_RECORD_SIZE];
+    cron_store_header* header;
+    cron_store_record* record;
+    uint32_t seq = 0;
+    time_t next;
+    int slot;
+    if (!store || !expr || 0 != cron_expr_serialize(expr, expr_record)) return -1;
+    next = cron_next(expr, date);
+    if (CRON_INVALID_INSTANT == next) return -1;
+    header = store->header;
+    if (header->heap_len >= header->capacity) return -1;
+    /* the slot is taken first, a crash while the job is written leaves it without valid state */
+    if (-1 != header->free_head) {
+        slot = (int) header->free_head;
+        record = &store->records[slot];
+        seq = current_state(record)->seq + 1;
+        header->free_head = current_state(record)->last_fire;
+    } else {
+        if (header->used == header->capacity) return -1;
+        slot = (int) header->used;
+        header->used += 1;
+        record = &store->records[slot];
+    }
+    memcpy(record->expr, expr_record, CRON_EXPR_RECORD_SIZE);
+    record->job_id = job_id;
+    write_both_states(record, -1, (int64_t) next, seq);
+    record->heap_index = CRON_STORE_NOT_ARMED;
+    record->reserved = 0;
+    header->size += 1;
+    heap_push(store, slot, (int64_t) next);
+    return slot;
+}
+
+int cron_store_remove(cron_store* store, int slot) {
+    cron_store_record* record;
+    if (!valid_slot(store, slot) || !valid_heap_index(store, slot)) return -1;
+    record = &store->records[slot];
+    if (is_pending(record)) {
+        store->pending -= 1;
+    } else if (CRON_STORE_NOT_ARMED != record->heap_index) {
+        heap_remove(store, record->heap_index);
+    }
+    write_state(record, store->header->free_head, CRON_STORE_REMOVED);
+    store->header->free_head = slot;
+    store->header->size -= 1;
+    return 0;
+}
+
+size_t cron_store_size(const cron_store* store) {
+    return store ? (size_t) store->header->size : 0;
+}
+
+time_t cron_store_peek(const cron_store* store) {
+    if (!store || 0 == store->header->heap_len) return CRON_INVALID_INSTANT;
+    return (time_t) store->heap[0].next;
+}
+
+int cron_store_pop_due(cron_store* store, time_t date, int64_t* job_id, time_t* fire_date) {
+    int slot;
+    if (!store || 0 == store->header->heap_len || store->heap[0].next > (int64_t) date) return -1;
+    slot = (int) store->heap[0].slot;
+    if (fire_date) {
+        *fire_date = (time_t) store->heap[0].next;
+    }
+    if (job_id) {
+        *job_id = store->records[slot].job_id;
+    }
+    heap_remove(store, 0);
+    store->pending += 1;
+    return slot;
+}
+
+int cron_store_rearm(cron_store* store, int slot, time_t date) {
+    cron_store_record* record;
+    cron_expr expr;
+    time_t next;
+    if (!valid_slot(store, slot) || !valid_heap_index(store, slot)) return -1;
+    record = &store->records[slot];
+    if (0 != cron_expr_view(record->expr, &expr, NULL)) return -1;
+    if (CRON_STORE_NOT_ARMED == record->heap_index && store->header->heap_len >= store->header->capacity) return -1;
+    if (is_pending(record)) {
+        store->pending -= 1;
+    } else if (CRON_STORE_NOT_ARMED != record->heap_index) {
+        heap_remove(store, record->heap_index);
+    }
+    next = cron_next(&expr, date);
+    write_state(record, (int64_t) date, (int64_t) next);
+    if (CRON_INVALID_INSTANT == next) return -1;
+    heap_push(store, slot, (int64_t) next);
+    return 0;
+}
+
+int cron_store_get(const cron_store* store, int slot, int64_t* job_id, time_t* last_fire, time_t* next_fire) {
+    const cron_store_state* state;
+    if (!valid_slot(store, slot)) return -1;
+    state = current_state(&store->records[slot]);
+    if (job_id) {
+        *job_id = store->records[slot].job_id;
+    }
+    if (last_fire) {
+        *last_fire = (time_t) state->last_fire;
+    }
+    if (next_fire) {
+        *next_fire = (time_t) state->next_fire;
+    }
+    return 0;
+}
+
+int cron_store_sync(cron_store* store) {
+    if (!store) return -1;
+#ifdef CRON_STORE_MMAP
+    if (0 != msync(store->map, store->map_len, MS_SYNC)) return -1;
+    return 0 == fsync(store->fd) ? 0 : -1;
+#else /* CRON_STORE_MMAP */
+    return -1;
+#endif /* CRON_STORE_MMAP */
+}
+
+int cron_store_close(cron_store* store) {
+    int res;
+    if (!store) return -1;
+    res = cron_store_sync(store);
+#ifdef CRON_STORE_MMAP
+    /* the heap is rebuilt on the next open if some taken jobs were not rearmed */
+    if (0 == res && 0 == store->pending) {
+        store->header->clean = 1;
+        res = msync(store->map, sizeof(cron_store_header), MS_SYNC);
+    }
+    munmap(store->map, store->map_len);
+    close(store->fd);
+#endif /* CRON_STORE_MMAP */
+    cron_free(store);
+    return 0 == res ? 0 : -1;
+}
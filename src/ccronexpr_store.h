@@ -0,0 +1,157 @@
+/*
+ * File:   ccronexpr_store.h
+ *
+ * Schedule of jobs kept in a memory mapped file, survives process restarts.
+ */
+
+#ifndef CCRONEXPR_STORE_H
+#define	CCRONEXPR_STORE_H
+
+#include "ccronexpr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Store of jobs (expression, client job id, last and next 'fire' dates) in a
+ * memory mapped file, with the jobs ordered by their next 'fire' dates in a
+ * 4-ary min-heap kept in the same file. Reopening the file after a clean close
+ * takes the jobs and their order as they are, no 'cron_next' is calculated.
+ *
+ * The state of each job is written to the older of its two checksummed copies,
+ * so after a crash (of the process or of the machine, for the changes written
+ * with 'cron_store_sync') every job is in the state before or after its last
+ * change. After a crash the heap is rebuilt from the jobs when the file is opened.
+ *
+ * The file is written in native byte order and can be opened only on platforms
+ * with the same one. Supported on POSIX systems, elsewhere and when compiled with
+ * '-DCRON_NO_FILE_IO' the stores can not be opened.
+ * Store is not thread-safe.
+ */
+typedef struct cron_store cron_store;
+
+/**
+ * Opens the store file, creates it if it does not exist or is empty.
+ *
+ * @param path path to the store file
+ * @param capacity maximum number of jobs of a new store, not used if the file exists
+ * @param error output error message, will be set to string literal
+ *        error message in case of error. Will be set to NULL on success.
+ * @return store in case of success, must be closed by client using
+ *         'cron_store_close' function. NULL is returned on error.
+ */
+cron_store* cron_store_open(const char* path, size_t capacity, const char** error);
+
+/**
+ * Returns whether the store was not closed cleanly the last time and
+ * its heap was rebuilt when it was opened.
+ *
+ * @param store store
+ * @return 1 if the heap was rebuilt, 0 otherwise.
+ */
+int cron_store_recovered(const cron_store* store);
+
+/**
+ * Adds a job to the store and arms it with the next 'fire' date of the
+ * expression after the specified date. The expression is stored as a
+ * binary record (see 'cron_expr_serialize'), it is not needed after this call.
+ *
+ * @param store store
+ * @param expr parsed cron expression of the job
+ * @param job_id client id of the job
+ * @param date date to calculate the first 'fire' date from
+ * @return slot of the job (not negative) in case of success, slots of removed
+ *         jobs are reused. -1 is returned if the store is full, on error
+ *         or if the expression never fires.
+ */
+int cron_store_add(cron_store* store, const cron_expr* expr, int64_t job_id, time_t date);
+
+/**
+ * Removes the job from the store.
+ *
+ * @param store store
+ * @param slot slot returned by 'cron_store_add'
+ * @return 0 in case of success, -1 if there is no such job.
+ */
+int cron_store_remove(cron_store* store, int slot);
+
+/**
+ * Returns number of jobs in the store.
+ *
+ * @param store store
+ * @return number of jobs
+ */
+size_t cron_store_size(const cron_store* store);
+
+/**
+ * Returns the earliest 'fire' date of all armed jobs.
+ *
+ * @param store store
+ * @return earliest 'fire' date, '((time_t) -1)' if no jobs are armed.
+ */
+time_t cron_store_peek(const cron_store* store);
+
+/**
+ * Takes the job with the earliest 'fire' date if it is due (not after
+ * the specified date). The job is not armed until 'cron_store_rearm' is called
+ * for it. The taking is not written to the file: if the store is reopened
+ * before the job is rearmed, the job is due again.
+ *
+ * @param store store
+ * @param date current date
+ * @param job_id output client id of the job, can be NULL
+ * @param fire_date output 'fire' date of the job, can be NULL
+ * @return due job slot, -1 if no job is due.
+ */
+int cron_store_pop_due(cron_store* store, time_t date, int64_t* job_id, time_t* fire_date);
+
+/**
+ * Records the specified date (usually the 'fire' date returned from
+ * 'cron_store_pop_due') as the last 'fire' date of the job and arms it
+ * with the next 'fire' date of its expression after it.
+ *
+ * @param store store
+ * @param slot job slot
+ * @param date last 'fire' date of the job
+ * @return 0 in case of success, -1 if there is no such job or its
+ *         expression does not fire anymore (the job is left not armed).
+ */
+int cron_store_rearm(cron_store* store, int slot, time_t date);
+
+/**
+ * Reads the job from the store.
+ *
+ * @param store store
+ * @param slot job slot
+ * @param job_id output client id of the job, can be NULL
+ * @param last_fire output last 'fire' date passed to 'cron_store_rearm',
+ *        '((time_t) -1)' if there was none, can be NULL
+ * @param next_fire output next 'fire' date, '((time_t) -1)' if the job
+ *        does not fire anymore, can be NULL
+ * @return 0 in case of success, -1 if there is no such job.
+ */
+int cron_store_get(const cron_store* store, int slot, int64_t* job_id, time_t* last_fire, time_t* next_fire);
+
+/**
+ * Writes all changes to the file and waits until they are on disk.
+ *
+ * @param store store
+ * @return 0 in case of success, -1 on error.
+ */
+int cron_store_sync(cron_store* store);
+
+/**
+ * Writes all changes to the file, marks it as closed cleanly (unless some
+ * taken jobs were not rearmed) and frees the store.
+ *
+ * @param store store to close
+ * @return 0 in case of success, -1 if the changes could not be written.
+ */
+int cron_store_close(cron_store* store);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* CCRONEXPR_STORE_H */
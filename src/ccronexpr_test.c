@@ -5,6 +5,9 @@
  * Created on February 24, 2015, 9:36 AM
  */
 #ifdef CRON_TEST
+#ifdef CRON_TEST_THREADS
+#define _POSIX_C_SOURCE 200809L
+#endif /* CRON_TEST_THREADS */
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -12,18 +15,37 @@
 #include <limits.h>
 
 #include "ccronexpr.h"
+#include "ccronexpr_sched.h"
+#include "ccronexpr_cache.h"
+#include "ccronexpr_set.h"
+#include "ccronexpr_store.h"
+#include "ccronexpr_wheel.h"
+#include "ccronexpr_registry.h"
 
-#define MAX_SECONDS 60
-#define CRON_MAX_MINUTES 60
-#define CRON_MAX_HOURS 24
-#define CRON_MAX_DAYS_OF_WEEK 8
-#define CRON_MAX_DAYS_OF_MONTH 32
-#define CRON_MAX_MONTHS 12
+#ifdef CRON_TEST_THREADS
+#include <pthread.h>
+#endif /* CRON_TEST_THREADS */
 
 #define INVALID_INSTANT ((time_t) -1)
 
 #define DATE_FORMAT "%Y-%m-%d_%H:%M:%S"
 
+#ifdef CRON_TEST_MALLOC
+static int cron_allocations = 0;
+static int cron_total_allocations = 0;
+
+void* cron_malloc(size_t n) {
+    cron_allocations++;
+    cron_total_allocations++;
+    return malloc(n);
+}
+
+void cron_free(void* p) {
+    cron_allocations--;
+    free(p);
+}
+#endif /* CRON_TEST_MALLOC */
+
 #ifndef ANDROID
     #ifndef _WIN32
 time_t timegm(struct tm* __tp);
@@ -45,38 +67,12 @@ static time_t timegm(struct tm * const t) {
 #endif
 
 static int crons_equal(cron_expr* cr1, cron_expr* cr2) {
-    int i;
-    for (i = 0; i < MAX_SECONDS; i++) {
-        if (cr1->seconds[i] != cr2->seconds[i]) {
-            return 0;
-        }
-    }
-    for (i = 0; i < CRON_MAX_MINUTES; i++) {
-        if (cr1->minutes[i] != cr2->minutes[i]) {
-            return 0;
-        }
-    }
-    for (i = 0; i < CRON_MAX_HOURS; i++) {
-        if (cr1->hours[i] != cr2->hours[i]) {
-            return 0;
-        }
-    }
-    for (i = 0; i < CRON_MAX_DAYS_OF_WEEK; i++) {
-        if (cr1->days_of_week[i] != cr2->days_of_week[i]) {
-            return 0;
-        }
-    }
-    for (i = 0; i < CRON_MAX_DAYS_OF_MONTH; i++) {
-        if (cr1->days_of_month[i] != cr2->days_of_month[i]) {
-            return 0;
-        }
-    }
-    for (i = 0; i < CRON_MAX_MONTHS; i++) {
-        if (cr1->months[i] != cr2->months[i]) {
-            return 0;
-        }
-    }
-    return 1;
+    return cr1->seconds == cr2->seconds &&
+            cr1->minutes == cr2->minutes &&
+            cr1->hours == cr2->hours &&
+            cr1->days_of_week == cr2->days_of_week &&
+            cr1->days_of_month == cr2->days_of_month &&
+            cr1->months == cr2->months;
 }
 
 int one_dec_num(const char ch) {
@@ -104,14 +100,7 @@ int two_dec_num(const char* first) {
 /* 0123456789012345678 */
 struct tm* poors_mans_strptime(const char* str) {
     struct tm* cal = (struct tm*) malloc(sizeof (struct tm));
-    switch(str[3]) {
-        case '7': cal->tm_year = 107; break;
-        case '8': cal->tm_year = 108; break;
-        case '9': cal->tm_year = 109; break;
-        case '0': cal->tm_year = 110; break;
-        case '1': cal->tm_year = 111; break;
-        case '2': cal->tm_year = 112; break;
-    }
+    cal->tm_year = two_dec_num(str) * 100 + two_dec_num(str + 2) - 1900;
     cal->tm_mon = two_dec_num(str + 5) - 1;
     cal->tm_mday = two_dec_num(str + 8);
     cal->tm_wday = 0;
@@ -144,6 +133,89 @@ void check_next(const char* pattern, const char* initial, const char* expected)
     cron_expr_free(parsed);
 }
 
+void check_prev(const char* pattern, const char* initial, const char* expected) {
+    const char* err = NULL;
+    cron_expr* parsed = cron_parse_expr(pattern, &err);
+    struct tm* calinit = poors_mans_strptime(initial);
+    time_t dateinit = timegm(calinit);
+    assert(-1 != dateinit);
+    time_t dateprev = cron_prev(parsed, dateinit);
+    struct tm* calprev = gmtime(&dateprev);
+    assert(calprev);
+    char* buffer = (char*) malloc(21);
+    memset(buffer, 0, 21);
+    strftime(buffer, 20, DATE_FORMAT, calprev);
+    if(0 != strcmp(expected, buffer)) {
+        puts(expected);
+        puts(buffer);
+        assert(0);
+    }
+    free(buffer);
+    free(calinit);
+    cron_expr_free(parsed);
+}
+
+void check_next_tz(const char* pattern, const cron_tz* tz, const char* initial, const char* expected) {
+    cron_expr* parsed = cron_parse_expr(pattern, NULL);
+    struct tm* calinit = poors_mans_strptime(initial);
+    time_t dateinit = timegm(calinit);
+    time_t datenext = cron_next_tz(parsed, tz, dateinit);
+    struct tm* calnext = gmtime(&datenext);
+    char buffer[21];
+    assert(calnext);
+    memset(buffer, 0, 21);
+    strftime(buffer, 20, DATE_FORMAT, calnext);
+    if(0 != strcmp(expected, buffer)) {
+        puts(expected);
+        puts(buffer);
+        assert(0);
+    }
+    free(calinit);
+    cron_expr_free(parsed);
+}
+
+void check_next_n(const char* pattern, const char* initial, size_t n) {
+    size_t i;
+    cron_expr* parsed = cron_parse_expr(pattern, NULL);
+    struct tm* calinit = poors_mans_strptime(initial);
+    time_t date = timegm(calinit);
+    time_t* dates = (time_t*) malloc(n * sizeof(time_t));
+    assert(n == cron_next_n(parsed, date, dates, n));
+    for (i = 0; i < n; i++) {
+        date = cron_next(parsed, date);
+        assert(date == dates[i]);
+    }
+    free(dates);
+    free(calinit);
+    cron_expr_free(parsed);
+}
+
+void check_iter(const char* pattern, const char* initial, int n) {
+    int i;
+    cron_iter iter;
+    cron_expr* parsed = cron_parse_expr(pattern, NULL);
+    struct tm* calinit = poors_mans_strptime(initial);
+    time_t date = timegm(calinit);
+    cron_iter_init(&iter, parsed, date);
+    for (i = 0; i < n; i++) {
+        date = cron_next(parsed, date);
+        assert(date == cron_iter_next(&iter));
+    }
+    free(calinit);
+    cron_expr_free(parsed);
+}
+
+void check_iter_invalid() {
+    cron_iter iter;
+    cron_expr* parsed = cron_parse_expr("0 0 0 31 6 *", NULL);
+    cron_iter_init(&iter, parsed, 1341136430);
+    assert(INVALID_INSTANT == cron_iter_next(&iter));
+    assert(INVALID_INSTANT == cron_iter_next(&iter));
+    cron_iter_init(&iter, NULL, 1341136430);
+    assert(INVALID_INSTANT == cron_iter_next(&iter));
+    cron_expr_free(parsed);
+}
+
 void check_same(const char* expr1, const char* expr2) {
     cron_expr* parsed1 = cron_parse_expr(expr1, NULL);
     cron_expr* parsed2 = cron_parse_expr(expr2, NULL);
@@ -158,6 +230,18 @@ void check_calc_invalid() {
     time_t dateinit = timegm(calinit);
     time_t res = cron_next(parsed, dateinit);
     assert(INVALID_INSTANT == res);
+    assert(INVALID_INSTANT == cron_prev(parsed, dateinit));
+    cron_expr_free(parsed);
+    parsed = cron_parse_expr("0 0 0 31 2,4,6 MON", NULL);
+    assert(INVALID_INSTANT == cron_next(parsed, dateinit));
+    assert(INVALID_INSTANT == cron_prev(parsed, dateinit));
+    cron_expr_free(parsed);
+    /* the last Monday, February 29th before the year 10000 is in 9988 */
+    parsed = cron_parse_expr("0 0 0 29 2 MON", NULL);
+    free(calinit);
+    calinit = poors_mans_strptime("9990-01-01_00:00:00");
+    dateinit = timegm(calinit);
+    assert(INVALID_INSTANT == cron_next(parsed, dateinit));
     free(calinit);
     cron_expr_free(parsed);
 }
@@ -168,9 +252,22 @@ void check_expr_invalid(const char* expr) {
     assert(err);
 }
 
+void check_bits() {
+    cron_expr* parsed = cron_parse_expr("0,59 */30 23 31 JAN,DEC 7", NULL);
+    assert(parsed);
+    assert(parsed->seconds == ((((uint64_t) 1) << 59) | 1));
+    assert(parsed->minutes == ((((uint64_t) 1) << 30) | 1));
+    assert(parsed->hours == (((uint32_t) 1) << 23));
+    assert(parsed->days_of_month == (((uint32_t) 1) << 31));
+    assert(parsed->months == ((1 << 11) | 1));
+    assert(parsed->days_of_week == 1);
+    cron_expr_free(parsed);
+}
+
 void test_expr() {
     check_next("*/15 * 1-4 * * *",  "2012-07-01_09:53:50", "2012-07-02_01:00:00");
     check_next("*/15 * 1-4 * * *",  "2012-07-01_09:53:00", "2012-07-02_01:00:00");
+    check_next("*/15 * 1-4 * * *",  "2012-07-01_09:53:10", "2012-07-02_01:00:00");
     check_next("0 */2 1-4 * * *",   "2012-07-01_09:00:00", "2012-07-02_01:00:00");
     check_next("* * * * * *",       "2012-07-01_09:00:00", "2012-07-01_09:00:01");
     check_next("* * * * * *",       "2012-12-01_09:00:58", "2012-12-01_09:00:59");
@@ -223,6 +320,161 @@ void test_expr() {
     check_next("0 30 23 30 1/3 ?",  "2010-12-30_00:00:00", "2011-01-30_23:30:00");
     check_next("0 30 23 30 1/3 ?",  "2011-01-30_23:30:00", "2011-04-30_23:30:00");
     check_next("0 30 23 30 1/3 ?",  "2011-04-30_23:30:00", "2011-07-30_23:30:00");    
+    check_next("0 0 0 * 4,5 *",     "2012-03-31_00:00:00", "2012-04-01_00:00:00");
+    check_next("0 0 12 13 * FRI",   "2011-11-13_00:59:46", "2012-01-13_12:00:00");
+    check_next("0 0 0 1-7 * MON",   "2012-07-03_00:00:00", "2012-08-06_00:00:00");
+    check_next("0 0 0 31 * MON",    "2012-01-01_00:00:00", "2012-12-31_00:00:00");
+    check_next("0 0 0 29 2 MON",    "2016-03-01_00:00:00", "2044-02-29_00:00:00");
+    check_next("0 0 0 29 2 MON",    "2072-02-29_00:00:00", "2112-02-29_00:00:00");
+    check_next("0 0 0 29 2 *",      "2096-03-01_00:00:00", "2104-02-29_00:00:00");
+    check_next("0 0 12 29 2 SUN",   "2000-01-01_00:00:00", "2004-02-29_12:00:00");
+}
+
+void test_prev() {
+    check_prev("*/15 * 1-4 * * *",  "2012-07-01_09:53:50", "2012-07-01_04:59:45");
+    check_prev("*/15 * 1-4 * * *",  "2012-07-01_01:00:00", "2012-06-30_04:59:45");
+    check_prev("* * * * * *",       "2012-07-01_09:00:00", "2012-07-01_08:59:59");
+    check_prev("10 * * * * *",      "2012-12-01_09:42:11", "2012-12-01_09:42:10");
+    check_prev("10 * * * * *",      "2012-12-01_09:42:10", "2012-12-01_09:41:10");
+    check_prev("0 0 * * * *",       "2012-09-11_00:00:00", "2012-09-10_23:00:00");
+    check_prev("0 0 0 * * *",       "2012-03-01_00:00:00", "2012-02-29_00:00:00");
+    check_prev("0 0 0 1 * *",       "2011-01-01_00:00:00", "2010-12-01_00:00:00");
+    check_prev("0 0 0 31 * *",      "2011-12-01_00:00:00", "2011-10-31_00:00:00");
+    check_prev("* * * 10 * *",      "2012-10-09_15:12:42", "2012-09-10_23:59:59");
+    check_prev("* * * * * 2",       "2010-10-27_15:12:42", "2010-10-26_23:59:59");
+    check_prev("0 0 0 29 2 *",      "2012-02-29_00:00:00", "2008-02-29_00:00:00");
+    check_prev("0 0 7 ? * MON-FRI", "2009-09-28_07:00:00", "2009-09-25_07:00:00");
+    check_prev("0 30 23 30 1/3 ?",  "2011-07-30_23:30:00", "2011-04-30_23:30:00");
+    check_prev("0 30 23 30 1/3 ?",  "2011-01-30_23:30:00", "2010-10-30_23:30:00");
+    check_prev("0 0 0 * 4,5 *",     "2012-07-15_00:00:00", "2012-05-31_00:00:00");
+    check_prev("0 0 0 31 * *",      "2012-03-31_00:00:00", "2012-01-31_00:00:00");
+    check_prev("0 0 12 13 * FRI",   "2012-01-13_11:00:00", "2011-05-13_12:00:00");
+    check_prev("0 0 0 1-7 * MON",   "2012-08-06_00:00:00", "2012-07-02_00:00:00");
+    check_prev("0 0 0 31 * MON",    "2012-12-30_00:00:00", "2011-10-31_00:00:00");
+    check_prev("0 0 0 29 2 MON",    "2044-02-29_00:00:00", "2016-02-29_00:00:00");
+    check_prev("0 0 0 29 2 MON",    "2112-02-29_00:00:00", "2072-02-29_00:00:00");
+    check_prev("0 0 0 29 2 *",      "2104-02-29_00:00:00", "2096-02-29_00:00:00");
+    check_prev("0 0 12 29 2 SUN",   "2000-01-01_00:00:00", "1976-02-29_12:00:00");
+    /* fields without values, rejected by the parser and never matching when set by client */
+    check_expr_invalid("50-10 0 0 * * *");
+    {
+        cron_expr parsed;
+        assert(0 == cron_parse_expr_into("0 0 0 * * *", &parsed, NULL));
+        parsed.seconds = 0;
+        assert(INVALID_INSTANT == cron_prev(&parsed, 1700000000));
+        parsed.seconds = 1;
+        parsed.minutes = 0;
+        assert(INVALID_INSTANT == cron_prev(&parsed, 1700000000));
+    }
+}
+
+void test_next_n() {
+    check_next_n("* * * * * *",        "2012-07-01_09:53:50", 1000);
+    check_next_n("*/15 * 1-4 * * *",   "2012-07-01_09:53:50", 1000);
+    check_next_n("0 0 7 ? * MON-FRI",  "2009-09-26_00:42:55", 100);
+    check_next_n("0 0 0 29 2 *",       "2007-02-10_14:42:55", 3);
+    check_next_n("0 30 23 30 1/3 ?",   "2010-12-30_00:00:00", 20);
+    check_next_n("59 59 23 31 12 *",   "2010-12-31_23:59:59", 5);
+}
+
+void test_iter() {
+    check_iter("* * * * * *",        "2012-07-01_09:53:50", 1000);
+    check_iter("*/15 * 1-4 * * *",   "2012-07-01_09:53:50", 1000);
+    check_iter("0 0 12 13 * FRI",    "2007-11-13_00:59:46", 8);
+    check_iter("0 30 23 30 1/3 ?",   "2010-12-30_00:00:00", 20);
+    check_iter_invalid();
+}
+
+void test_scheduler() {
+    const char* patterns[] = {"*/15 * * * * *", "0 */2 * * * *", "0 0 7 ? * MON-FRI", "0 30 23 30 1/3 ?", "10-15 * * * * *"};
+    cron_expr* exprs[5];
+    time_t last[64];
+    int payloads[64];
+    int i;
+    int job;
+    int removed = 0;
+    void* payload = NULL;
+    time_t fired = 0;
+    time_t prev_fired = 0;
+    time_t start = 1341136430;
+    time_t date;
+    cron_scheduler* sched = cron_scheduler_new(0);
+    assert(sched);
+    assert(INVALID_INSTANT == cron_scheduler_peek(sched));
+    for (i = 0; i < 5; i++) {
+        exprs[i] = cron_parse_expr(patterns[i], NULL);
+    }
+    for (i = 0; i < 64; i++) {
+        payloads[i] = i;
+        last[i] = start;
+        assert(i == cron_scheduler_add(sched, exprs[i % 5], &payloads[i], start));
+    }
+    assert(0 == cron_scheduler_remove(sched, 7));
+    assert(-1 == cron_scheduler_remove(sched, 7));
+    assert(-1 == cron_scheduler_rearm(sched, 7, start));
+    /* removed ids are reused */
+    assert(7 == cron_scheduler_add(sched, exprs[7 % 5], &payloads[7], start));
+    for (date = start; date < start + 3 * 24 * 3600; date += 7) {
+        while (-1 != (job = cron_scheduler_pop_due(sched, date, &payload, &fired))) {
+            assert(*((int*) payload) == job);
+            assert(fired <= date && fired >= prev_fired);
+            assert(fired == cron_next(exprs[job % 5], last[job]));
+            prev_fired = fired;
+            last[job] = fired;
+            if (0 == job % 9 && removed < 3) {
+                assert(0 == cron_scheduler_remove(sched, job));
+                removed += 1;
+            } else {
+                assert(0 == cron_scheduler_rearm(sched, job, fired));
+            }
+        }
+        assert(cron_scheduler_peek(sched) > date);
+    }
+    cron_scheduler_free(sched);
+    for (i = 0; i < 5; i++) {
+        cron_expr_free(exprs[i]);
+    }
+}
+
+void test_cache() {
+    int i;
+    const char* err = NULL;
+    const cron_expr* shared[100];
+    cron_expr* parsed = cron_parse_expr("0 0 7 ? * MON-FRI", NULL);
+    cron_expr_cache* cache = cron_expr_cache_new();
+    assert(cache);
+    const cron_expr* expr1 = cron_expr_cache_get(cache, "0 0 7 ? * MON-FRI", &err);
+    assert(expr1 && !err);
+    assert(crons_equal((cron_expr*) expr1, parsed));
+    const cron_expr* expr2 = cron_expr_cache_get(cache, "  0  0 7 ?\t* mon-fri ", &err);
+    assert(expr1 == expr2);
+    assert(1 == cron_expr_cache_size(cache));
+    assert(NULL == cron_expr_cache_get(cache, "77 * * * * *", &err));
+    assert(err);
+    assert(NULL == cron_expr_cache_get(cache, "   ", &err));
+    assert(err);
+    /* many distinct expressions, to rehash the table */
+    for (i = 0; i < 100; i++) {
+        char buf[32];
+        sprintf(buf, "%d %d * * * *", i % 60, i / 60);
+        shared[i] = cron_expr_cache_get(cache, buf, &err);
+        assert(shared[i] && !err);
+        assert(shared[i] == cron_expr_cache_get(cache, buf, &err));
+    }
+    assert(101 == cron_expr_cache_size(cache));
+    for (i = 0; i < 100; i++) {
+        cron_expr_cache_release(cache, shared[i]);
+        cron_expr_cache_release(cache, shared[i]);
+    }
+    assert(1 == cron_expr_cache_size(cache));
+    cron_expr_cache_release(cache, expr1);
+    /* still referenced */
+    assert(1 == cron_expr_cache_size(cache));
+    assert(1341136430 < cron_next(expr2, 1341136430));
+    cron_expr_cache_release(cache, expr2);
+    assert(0 == cron_expr_cache_size(cache));
+    cron_expr_cache_free(cache);
+    cron_expr_free(parsed);
 }
 
 void test_parse() {
@@ -249,12 +501,1244 @@ void test_parse() {
     check_expr_invalid("0 0 0 25 0 ?");
     check_expr_invalid("0 0 0 32 12 ?");
     check_expr_invalid("* * * * 11-13 *");
+    /* reversed ranges and day of month 0 match no values */
+    check_expr_invalid("50-10 * * * * *");
+    check_expr_invalid("0 50-10 * * * *");
+    check_expr_invalid("0 0 10-5 * * *");
+    check_expr_invalid("0 0 0 20-10 * *");
+    check_expr_invalid("0 0 0 1 12-1 *");
+    check_expr_invalid("0 0 0 * * 5-1");
+    check_expr_invalid("0 0 0 * * SAT-SUN");
+    check_expr_invalid("0 0 0 0 * *");
+    check_expr_invalid("0 0 0 0/5 * *");
+    check_same("* * * * * sun-sat", "* * * * * SUN-SAT");
+    check_same("0 0 12 1 jan-mar/2 ?", "0 0 12 1 1,3 ?");
+    check_same("0\t0  12\t*\t*\t?  ", "0 0 12 * * ?");
+    check_same("0 0 0 ? * 7", "0 0 0 * * 0");
+    check_expr_invalid("*/0 * * * * *");
+    check_expr_invalid("5/ * * * * *");
+    check_expr_invalid("1- * * * * *");
+    check_expr_invalid("1,,2 * * * * *");
+    check_expr_invalid("* * * * * MON?");
+    check_expr_invalid("* * * * * ?,MON");
+    check_expr_invalid("* * * * ? *");
+    check_expr_invalid("* * * * MON *");
+    check_expr_invalid("* * * * * JAN");
+    check_expr_invalid("* * * * * MONDAY");
+    check_expr_invalid("* * * * *");
+    check_expr_invalid("* * * * * * * *");
+#ifdef CRON_TEST_MALLOC
+    {
+        int total_before = cron_total_allocations;
+        cron_expr* parsed = cron_parse_expr("0 0/5 14,18 * JAN-MAR,DEC MON-FRI", NULL);
+        assert(parsed);
+        /* the result is the only allocation */
+        assert(cron_total_allocations - total_before == 1);
+        cron_expr_free(parsed);
+    }
+#endif
+}
+
+void test_parse_into() {
+    cron_expr exprs[3];
+    cron_expr* parsed;
+    const char* err = NULL;
+    time_t date;
+#ifdef CRON_TEST_MALLOC
+    int total_before = cron_total_allocations;
+#endif /* CRON_TEST_MALLOC */
+    assert(0 == cron_parse_expr_into("0 0 7 ? * MON-FRI", &exprs[0], &err));
+    assert(!err);
+    assert(0 == cron_parse_expr_into("0 */5 * * * *", &exprs[1], NULL));
+    exprs[2] = exprs[1];
+    assert(-1 == cron_parse_expr_into("0 */5 * * *", &exprs[2], &err));
+    assert(err);
+    assert(-1 == cron_parse_expr_into("0 */5 * * * *", NULL, &err));
+    assert(-1 == cron_parse_expr_into(NULL, &exprs[2], &err));
+    /* target is not modified on error */
+    assert(crons_equal(&exprs[1], &exprs[2]));
+    date = cron_next(&exprs[0], 1341136430);
+    assert(1341212400 == date);
+    date = cron_next(&exprs[1], date);
+    assert(1341212700 == date);
+#ifdef CRON_TEST_MALLOC
+    assert(total_before == cron_total_allocations);
+#endif /* CRON_TEST_MALLOC */
+    parsed = cron_parse_expr("0 0 7 ? * MON-FRI", NULL);
+    assert(parsed);
+    assert(crons_equal(parsed, &exprs[0]));
+    cron_expr_free(parsed);
+}
+
+static unsigned char* put_be32(unsigned char* buf, uint32_t val) {
+    buf[0] = (unsigned char) (val >> 24);
+    buf[1] = (unsigned char) (val >> 16);
+    buf[2] = (unsigned char) (val >> 8);
+    buf[3] = (unsigned char) val;
+    return buf + 4;
+}
+
+/* TZif data block with the specified UTC offsets of types and transitions to these types */
+static unsigned char* put_tzif_block(unsigned char* buf, char version, const long* offsets, size_t typecnt,
+        const int64_t* times, const unsigned char* types, size_t timecnt, size_t time_size) {
+    size_t i;
+    memcpy(buf, "TZif", 4);
+    buf[4] = (unsigned char) version;
+    memset(buf + 5, 0, 15);
+    buf = put_be32(buf + 20, 0);
+    buf = put_be32(buf, 0);
+    buf = put_be32(buf, 0);
+    buf = put_be32(buf, (uint32_t) timecnt);
+    buf = put_be32(buf, (uint32_t) typecnt);
+    buf = put_be32(buf, 4);
+    for (i = 0; i < timecnt; i++) {
+        if (8 == time_size) {
+            buf = put_be32(buf, (uint32_t) ((uint64_t) times[i] >> 32));
+        }
+        buf = put_be32(buf, (uint32_t) times[i]);
+    }
+    for (i = 0; i < timecnt; i++) {
+        *buf++ = types[i];
+    }
+    for (i = 0; i < typecnt; i++) {
+        buf = put_be32(buf, (uint32_t) offsets[i]);
+        *buf++ = 0;
+        *buf++ = 0;
+    }
+    memcpy(buf, "ZZZ", 4);
+    return buf + 4;
+}
+
+static size_t make_tzif(unsigned char* buf, const long* offsets, size_t typecnt,
+        const int64_t* times, const unsigned char* types, size_t timecnt, const char* footer) {
+    unsigned char* end = put_tzif_block(buf, footer ? '2' : '\0', offsets, typecnt, times, types, timecnt, 4);
+    if (footer) {
+        end = put_tzif_block(end, '2', offsets, typecnt, times, types, timecnt, 8);
+        *end++ = '\n';
+        memcpy(end, footer, strlen(footer));
+        end += strlen(footer);
+        *end++ = '\n';
+    }
+    return (size_t) (end - buf);
+}
+
+static void check_new_york(const cron_tz* tz) {
+    check_next_tz("0 0 12 * * *", tz, "2012-01-10_00:00:00", "2012-01-10_17:00:00");
+    check_next_tz("0 0 12 * * *", tz, "2012-07-01_00:00:00", "2012-07-01_16:00:00");
+    /* 02:30 does not exist on 2012-03-11, fires at the end of the gap (03:00 EDT) */
+    check_next_tz("0 30 2 * * *", tz, "2012-03-10_12:00:00", "2012-03-11_07:00:00");
+    check_next_tz("0 30 2 * * *", tz, "2012-03-11_07:00:00", "2012-03-12_06:30:00");
+    check_next_tz("0 */15 2 * * *", tz, "2012-03-11_06:00:00", "2012-03-11_07:00:00");
+    check_next_tz("0 */15 2 * * *", tz, "2012-03-11_07:00:00", "2012-03-12_06:00:00");
+    /* 01:00-02:00 repeats on 2012-11-04, fires only in EDT */
+    check_next_tz("0 30 1 * * *", tz, "2012-11-03_12:00:00", "2012-11-04_05:30:00");
+    check_next_tz("0 30 1 * * *", tz, "2012-11-04_05:30:00", "2012-11-05_06:30:00");
+    check_next_tz("0 */15 * * * *", tz, "2012-11-04_05:45:00", "2012-11-04_07:00:00");
+    check_next_tz("0 */15 * * * *", tz, "2012-11-04_06:10:00", "2012-11-04_07:00:00");
+    /* after the last transition of the table */
+    check_next_tz("0 0 12 9 3 *", tz, "2012-12-01_00:00:00", "2013-03-09_17:00:00");
+    check_next_tz("0 0 12 10 3 *", tz, "2012-12-01_00:00:00", "2013-03-10_16:00:00");
+    check_next_tz("0 30 2 * * *", tz, "2013-03-09_12:00:00", "2013-03-10_07:00:00");
+    check_next_tz("0 30 1 * * *", tz, "2013-11-03_04:00:00", "2013-11-03_05:30:00");
+    check_next_tz("0 30 1 * * *", tz, "2013-11-03_05:30:00", "2013-11-04_06:30:00");
+}
+
+void test_tz() {
+    unsigned char data[512];
+    size_t len;
+    const char* err = NULL;
+    cron_tz* tz;
+    cron_expr* parsed;
+    long est_edt[] = {-18000, -14400};
+    long aest[] = {36000};
+    int64_t times_2012[] = {1331449200, 1352008800};
+    unsigned char types_2012[] = {1, 0};
+    int i;
+
+    len = make_tzif(data, est_edt, 2, times_2012, types_2012, 2, "EST5EDT,M3.2.0,M11.1.0");
+    tz = cron_tz_load(data, len, &err);
+    assert(tz && !err);
+    assert(-18000 == cron_tz_offset(tz, 1331449199));
+    assert(-14400 == cron_tz_offset(tz, 1331449200));
+    assert(-18000 == cron_tz_offset(tz, 1352008800));
+    check_new_york(tz);
+    parsed = cron_parse_expr("0 0 * * * *", NULL);
+#ifdef CRON_TEST_MALLOC
+    {
+        int total_before = cron_total_allocations;
+        assert(INVALID_INSTANT != cron_next_tz(parsed, tz, 1341136430));
+        assert(total_before == cron_total_allocations);
+    }
+#endif /* CRON_TEST_MALLOC */
+    assert(INVALID_INSTANT == cron_next_tz(parsed, NULL, 1341136430));
+    assert(INVALID_INSTANT == cron_next_tz(NULL, tz, 1341136430));
+    cron_tz_free(tz);
+
+    /* southern hemisphere, rule only */
+    len = make_tzif(data, aest, 1, NULL, NULL, 0, "AEST-10AEDT,M10.1.0,M4.1.0/3");
+    tz = cron_tz_load(data, len, &err);
+    assert(tz);
+    check_next_tz("0 0 12 * * *", tz, "2012-01-15_00:00:00", "2012-01-15_01:00:00");
+    check_next_tz("0 0 12 * * *", tz, "2012-07-15_00:00:00", "2012-07-15_02:00:00");
+    /* 02:30 on 2012-04-01 repeats, 2012-10-07 skipped */
+    check_next_tz("0 30 2 * * *", tz, "2012-03-31_00:00:00", "2012-03-31_15:30:00");
+    check_next_tz("0 30 2 * * *", tz, "2012-03-31_15:30:00", "2012-04-01_16:30:00");
+    check_next_tz("0 30 2 * * *", tz, "2012-10-06_00:00:00", "2012-10-06_16:00:00");
+    cron_tz_free(tz);
+
+    /* version 1 data without rule, fixed offset after the last transition */
+    len = make_tzif(data, est_edt, 2, times_2012, types_2012, 1, NULL);
+    tz = cron_tz_load(data, len, &err);
+    assert(tz);
+    assert(-14400 == cron_tz_offset(tz, 1393632000));
+    cron_tz_free(tz);
+
+    assert(NULL == cron_tz_load("TZif", 4, &err));
+    assert(err);
+    len = make_tzif(data, est_edt, 2, times_2012, types_2012, 2, "EST5EDT,M3.2.0,M11.1.0");
+    for (i = 0; i < (int) len - 1; i += 7) {
+        /* truncated */
+        assert(NULL == cron_tz_load(data, (size_t) i, &err));
+        assert(err);
+    }
+    len = make_tzif(data, est_edt, 2, times_2012, types_2012, 2, "EST5EDT,M3.2.0");
+    assert(NULL == cron_tz_load(data, len, &err));
+    assert(err);
+    assert(NULL == cron_tz_load_file("/nonexistent/zone", &err));
+    assert(err);
+
+    /* system time zone database, if available */
+    tz = cron_tz_load_file("/usr/share/zoneinfo/America/New_York", NULL);
+    if (tz) {
+        check_new_york(tz);
+        cron_tz_free(tz);
+    }
+    cron_expr_free(parsed);
+}
+
+/* expressions of simple shapes are evaluated without the general search, results must be the same */
+void test_shapes() {
+    const char* patterns[] = {"* * * * * *", "*/7 * * * * *", "0 */5 * * * *", "0 0 * * * *", "30 15 10 * * *",
+            "0 0 0 * * ?", "59 59 23 * * *", "0 0 7 ? * MON-FRI", "0 0 0 ? * SAT,SUN", "0 */15 9-17 * * 1-5",
+            "0 0 0 1 * *", "0 0 12 31 * ?", "0 30 23 29-31 * *", "0 0 0 1,15 1-12 *", "0 0 0 29 * ?"};
+    time_t dates[] = {0, 1341136430, 1330473600, 951782399, 4107542399LL, -2208988800LL,
+            253402300799LL, 253402300000LL, -62135596800LL, -62135596801LL};
+    size_t i;
+    size_t j;
+    int k;
+    uint32_t random = 12345;
+    for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        cron_expr shaped;
+        cron_expr general;
+        assert(0 == cron_parse_expr_into(patterns[i], &shaped, NULL));
+        assert(0 != shaped.shape);
+        general = shaped;
+        general.shape = 0;
+        for (j = 0; j < sizeof(dates) / sizeof(dates[0]) + 200; j++) {
+            time_t date;
+            if (j < sizeof(dates) / sizeof(dates[0])) {
+                date = dates[j];
+            } else {
+                random = random * 1103515245u + 12345u;
+                date = (time_t) (random % 2000000000u);
+            }
+            for (k = 0; k < 10; k++) {
+                time_t next = cron_next(&shaped, date);
+                assert(next == cron_next(&general, date));
+                if (INVALID_INSTANT == next) break;
+                date = next;
+            }
+        }
+    }
+    /* not simple */
+    check_next("0 0 0 ? 2 *", "2012-01-10_00:00:00", "2012-02-01_00:00:00");
+    {
+        cron_expr parsed;
+        assert(0 == cron_parse_expr_into("0 0 0 1 * MON", &parsed, NULL));
+        assert(0 == parsed.shape);
+    }
+    /* fields without values never fire, the parser and records do not accept them */
+    check_expr_invalid("0 0 0 0 * *");
+    check_expr_invalid("0 0 10-5 * * *");
+    check_expr_invalid("0 50-10 * * * *");
+    check_expr_invalid("0 0 0 * * 5-1");
+    {
+        const char* shaped[] = {"0 0 0 1 * *", "0 0 0 * * *", "0 0 0 * * *", "0 0 0 * * *", "0 0 0 * * MON"};
+        unsigned char record[CRON_EXPR_RECORD_SIZE];
+        cron_expr parsed;
+        for (k = 0; k < 5; k++) {
+            assert(0 == cron_parse_expr_into(shaped[k], &parsed, NULL));
+            assert(0 != parsed.shape);
+            switch (k) {
+                case 0: parsed.days_of_month = 0; break;
+                case 1: parsed.hours = 0; break;
+                case 2: parsed.minutes = 0; break;
+                case 3: parsed.seconds = 0; break;
+                default: parsed.days_of_week = 0;
+            }
+            parsed.shape = 0;
+            assert(-1 == cron_expr_serialize(&parsed, record));
+            assert(INVALID_INSTANT == cron_next(&parsed, 1700000000));
+        }
+        assert(0 == cron_parse_expr_into("0 0 0 * * *", &parsed, NULL));
+        assert(0 == cron_expr_serialize(&parsed, record));
+        record[16] = 0;
+        assert(-1 == cron_expr_view(record, &parsed, NULL));
+    }
+}
+
+void test_matches() {
+    const char* patterns[] = {"* * * * * *", "*/15 * 1-4 * * *", "0 0 0 29 2 *", "0 0 7 ? * MON-FRI",
+            "0 30 23 30 1/3 ?", "10-15 */2 * 1,29 * 2", "0 */5 * L * *", "* 0 0 ? * WED#5", "*/3 * * * * * 2011"};
+    time_t starts[] = {1330473600 - 5400, 1341100000, 1293839000};
+    size_t lens[] = {0, 1, 7, 8, 9, 17, 300, 599, 600, 601, 1000};
+    time_t dates[1000];
+    unsigned char out[1000];
+    size_t i;
+    size_t j;
+    size_t k;
+    uint32_t random = 777;
+    for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        cron_expr* parsed = cron_parse_expr(patterns[i], NULL);
+        for (j = 0; j < sizeof(starts) / sizeof(starts[0]); j++) {
+            time_t date;
+            for (date = starts[j]; date < starts[j] + 10800; date++) {
+                int matches = cron_matches(parsed, date);
+                assert(matches == (cron_next(parsed, date - 1) == date));
+            }
+        }
+        /* sequential dates across midnight, then unsorted dates, with dates out of range */
+        for (k = 0; k < 1000; k++) {
+            if (k < 600) {
+                dates[k] = 1330473600 - 300 + (time_t) k;
+            } else {
+                random = random * 1103515245u + 12345u;
+                dates[k] = (time_t) (random % 2000000000u);
+            }
+        }
+        dates[700] = (time_t) -62135596801LL;
+        dates[701] = (time_t) 253402300800LL;
+        /* lengths around the chunks of dates on the same day */
+        for (k = 0; k < sizeof(lens) / sizeof(lens[0]); k++) {
+            size_t expected = 0;
+            size_t count = cron_matches_n(parsed, dates, lens[k], out);
+            for (j = 0; j < lens[k]; j++) {
+                assert(out[j] == cron_matches(parsed, dates[j]));
+                expected += out[j];
+            }
+            assert(expected == count);
+        }
+        assert(0 == cron_matches_n(parsed, dates, 0, out));
+#ifndef CRON_USE_LOCAL_TIME
+        assert(0 == cron_matches(parsed, (time_t) -62135596801LL));
+#endif /* CRON_USE_LOCAL_TIME */
+        cron_expr_free(parsed);
+    }
+    assert(0 == cron_matches(NULL, 0));
+    assert(0 == cron_matches_n(NULL, dates, 10, out));
+}
+
+void test_day_items() {
+    cron_expr parsed;
+    struct tm calendar;
+    check_next("0 0 0 L * *", "2024-02-10_00:00:00", "2024-02-29_00:00:00");
+    check_next("0 0 0 L * *", "2024-02-29_00:00:00", "2024-03-31_00:00:00");
+    check_next("0 0 0 L 2 *", "2023-03-01_00:00:00", "2024-02-29_00:00:00");
+    check_next("0 0 0 L-3 * *", "2024-02-10_00:00:00", "2024-02-26_00:00:00");
+    check_next("0 0 0 L-3 * *", "2024-02-26_00:00:00", "2024-03-28_00:00:00");
+    check_next("0 0 0 LW * *", "2024-08-01_00:00:00", "2024-08-30_00:00:00");
+    check_next("0 0 0 15W * *", "2024-06-01_00:00:00", "2024-06-14_00:00:00");
+    check_next("0 0 0 15W * *", "2024-09-01_00:00:00", "2024-09-16_00:00:00");
+    /* nearest weekday does not leave the month */
+    check_next("0 0 0 1W * *", "2024-05-31_12:00:00", "2024-06-03_00:00:00");
+    check_next("0 0 0 31W * *", "2024-04-01_00:00:00", "2024-05-31_00:00:00");
+    check_next("0 0 0 31W * *", "2006-06-01_00:00:00", "2006-07-31_00:00:00");
+    check_next("0 0 0 ? * FRIL", "2024-02-01_00:00:00", "2024-02-23_00:00:00");
+    check_next("0 0 0 ? * 5L", "2024-02-01_00:00:00", "2024-02-23_00:00:00");
+    check_next("0 0 0 ? * MON#2", "2024-02-01_00:00:00", "2024-02-12_00:00:00");
+    check_next("0 0 0 ? * 6#3", "2024-02-01_00:00:00", "2024-02-17_00:00:00");
+    check_next("0 0 0 ? * MON#5", "2024-02-01_00:00:00", "2024-04-29_00:00:00");
+    check_next("0 0 0 1,L * *", "2024-02-02_00:00:00", "2024-02-29_00:00:00");
+    check_next("0 0 0 1,L * *", "2024-02-29_00:00:00", "2024-03-01_00:00:00");
+    check_next("0 0 0 ? * SUN,FRIL", "2024-02-19_00:00:00", "2024-02-23_00:00:00");
+    check_prev("0 0 0 L * *", "2024-03-15_00:00:00", "2024-02-29_00:00:00");
+    check_prev("0 0 0 ? * MON#5", "2024-03-01_00:00:00", "2024-01-29_00:00:00");
+    check_prev("0 0 0 LW * *", "2024-09-01_00:00:00", "2024-08-30_00:00:00");
+
+    check_expr_invalid("0 0 0 L/2 * *");
+    check_expr_invalid("0 0 0 L-31 * *");
+    check_expr_invalid("0 0 0 32W * *");
+    check_expr_invalid("0 0 0 1W,2W * *");
+    check_expr_invalid("0 0 0 L,L-2 * *");
+    check_expr_invalid("0 0 0 ? * MON#6");
+    check_expr_invalid("0 0 0 ? * MON#0");
+    check_expr_invalid("0 0 0 ? * MON#1,TUE#2");
+    check_expr_invalid("0 0 0 ? * L");
+    check_expr_invalid("0 0 0 ? * MON-FRIL");
+    check_expr_invalid("0 0 0 * L *");
+
+    assert(0 == cron_parse_expr_into("0 0 12 LW * ?", &parsed, NULL));
+    assert(0 == parsed.shape);
+    memset(&calendar, 0, sizeof(calendar));
+    calendar.tm_year = 2024 - 1900;
+    calendar.tm_mon = 7;
+    calendar.tm_mday = 30;
+    calendar.tm_wday = 5;
+    calendar.tm_hour = 12;
+    assert(1 == cron_matches_calendar(&parsed, &calendar));
+    calendar.tm_mday = 31;
+    calendar.tm_wday = 6;
+    assert(0 == cron_matches_calendar(&parsed, &calendar));
+    calendar.tm_mday = 32;
+    assert(0 == cron_matches_calendar(&parsed, &calendar));
+}
+
+void test_years() {
+    cron_expr parsed;
+    time_t date;
+    check_next("0 0 0 1 1 * 2027-2029", "2024-05-01_00:00:00", "2027-01-01_00:00:00");
+    check_next("0 0 0 1 1 * 2027-2029", "2027-01-01_00:00:00", "2028-01-01_00:00:00");
+    check_prev("0 0 0 1 1 * 2027-2029", "2035-01-01_00:00:00", "2029-01-01_00:00:00");
+    check_next("0 30 9 ? * MON 2025,2030", "2025-12-30_00:00:00", "2030-01-07_09:30:00");
+    check_prev("0 30 9 ? * MON 2025,2030", "2030-01-07_09:30:00", "2025-12-29_09:30:00");
+    check_next("0 0 12 29 2 * 2001-2100/3", "2001-01-01_00:00:00", "2004-02-29_12:00:00");
+    check_next("0 0 12 29 2 * 2001-2100/3", "2004-03-01_00:00:00", "2016-02-29_12:00:00");
+    check_next("0 0 0 L * * 2024", "2023-12-31_00:00:00", "2024-01-31_00:00:00");
+    check_next("59 59 23 31 12 * 9999", "2024-01-01_00:00:00", "9999-12-31_23:59:59");
+    check_next("0 0 0 * * * 1970-2099/100", "1969-12-31_00:00:00", "1970-01-01_00:00:00");
+    check_next("* * * * * * *", "2024-01-01_00:00:00", "2024-01-01_00:00:01");
+
+    assert(0 == cron_parse_expr_into("0 0 0 * * * 2027-2029", &parsed, NULL));
+    assert(0 == parsed.shape);
+    assert(2027 == parsed.year_first && 7 == parsed.years[0] && 0 == parsed.years[1]);
+    date = cron_next(&parsed, 1893455999);
+    assert(INVALID_INSTANT == date);
+    assert(INVALID_INSTANT == cron_prev(&parsed, 1798761600));
+    assert(1 == cron_matches(&parsed, 1798761600));
+    assert(0 == cron_matches(&parsed, 1798761600 - 86400));
+    assert(365 * 3 + 1 == cron_count_between(&parsed, 0, 2000000000));
+    assert(0 == cron_parse_expr_into("0 0 0 * * * 1900,2027", &parsed, NULL));
+    assert(1900 == parsed.year_first && 1 == parsed.years[0] && (1ULL << 63) == parsed.years[1]);
+    assert(0 == cron_parse_expr_into("0 0 0 * * * *", &parsed, NULL));
+    assert(0 == parsed.year_first && 0 != parsed.shape);
+    assert(0 == cron_parse_expr_into("0 0 0 * * * 2027,*", &parsed, NULL));
+    assert(0 == parsed.year_first);
+
+    check_expr_invalid("0 0 0 * * * 0");
+    check_expr_invalid("0 0 0 * * * 10000");
+    check_expr_invalid("0 0 0 * * * 2020-2200");
+    check_expr_invalid("0 0 0 * * * 2030-2025");
+    check_expr_invalid("0 0 0 1 1 * 2025,2029-2027");
+    check_expr_invalid("0 0 0 * * * 1900,2028");
+    check_expr_invalid("0 0 0 * * * 2025/1");
+    check_expr_invalid("0 0 0 * * * 2025,");
+    check_expr_invalid("0 0 0 * * * 2025/0");
+    check_expr_invalid("0 0 0 * * * ?");
+    check_expr_invalid("0 0 0 * * * JAN");
+}
+
+void test_serialize() {
+    const char* patterns[] = {"* * * * * *", "0 0 0 1 1 *", "59 59 23 31 12 SAT", "0 */5 * L * *", "* 0 0 ? * WED#5",
+            "0 0 0 L-30,LW * ?", "0 0 0 ? * SUNL,SATL,1#1", "0 0 12 29 2 * 2001-2100/3", "0 0 0 * * * 9872-9999",
+            "0 0 0 1W * ?", "0 0 7 ? * MON-FRI"};
+    /* "0 0 0 1 1 *": seconds with the version, minutes, hours, days of month, months, days of week */
+    const unsigned char expected[CRON_EXPR_RECORD_SIZE] = {0x01, 0, 0, 0, 0, 0, 0, 0x10, 0x01, 0, 0, 0, 0, 0, 0, 0,
+            0x01, 0, 0, 0x02, 0, 0, 0, 0x01, 0, 0x7F};
+    unsigned char record[CRON_EXPR_RECORD_SIZE];
+    unsigned char bad[CRON_EXPR_RECORD_SIZE];
+    cron_expr parsed;
+    cron_expr viewed;
+    const char* err = NULL;
+    size_t i;
+    int k;
+    for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        time_t date = 1330473600;
+        assert(0 == cron_parse_expr_into(patterns[i], &parsed, NULL));
+        assert(0 == cron_expr_serialize(&parsed, record));
+        if (1 == i) {
+            assert(0 == memcmp(record, expected, CRON_EXPR_RECORD_SIZE));
+        }
+        memset(&viewed, 0xFF, sizeof(viewed));
+        assert(0 == cron_expr_view(record, &viewed, &err));
+        assert(NULL == err);
+        assert(crons_equal(&parsed, &viewed));
+        assert(parsed.shape == viewed.shape && parsed.last_day_of_month == viewed.last_day_of_month &&
+                parsed.nearest_weekday == viewed.nearest_weekday && parsed.last_days_of_week == viewed.last_days_of_week &&
+                parsed.nth_day_of_week == viewed.nth_day_of_week && parsed.year_first == viewed.year_first &&
+                parsed.years[0] == viewed.years[0] && parsed.years[1] == viewed.years[1]);
+        for (k = 0; k < 5; k++) {
+            date = cron_next(&parsed, date);
+            assert(date == cron_next(&viewed, date - 1));
+        }
+    }
+    /* changed version, unused bits and day item values out of range */
+    memcpy(bad, record, sizeof(bad));
+    bad[7] = 0x20;
+    assert(-1 == cron_expr_view(bad, &viewed, &err) && err);
+    memcpy(bad, record, sizeof(bad));
+    bad[19] |= 1;
+    assert(-1 == cron_expr_view(bad, &viewed, &err) && err);
+    memcpy(bad, record, sizeof(bad));
+    bad[29] = 6 << 3;
+    assert(-1 == cron_expr_view(bad, &viewed, &err) && err);
+    assert(0 == cron_parse_expr_into("0 0 0 ? * MON#2", &parsed, NULL));
+    parsed.nth_day_of_week = 7 << 3;
+    assert(-1 == cron_expr_serialize(&parsed, record));
+    parsed.nth_day_of_week = 0;
+    parsed.years[0] = 1;
+    assert(-1 == cron_expr_serialize(&parsed, record));
+    assert(-1 == cron_expr_serialize(NULL, record));
+    assert(-1 == cron_expr_view(NULL, &viewed, &err) && err);
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+static void copy_file(const char* from, const char* to) {
+    char buf[4096];
+    size_t len;
+    FILE* in = fopen(from, "rb");
+    FILE* out = fopen(to, "wb");
+    assert(in && out);
+    while (0 != (len = fread(buf, 1, sizeof(buf), in))) {
+        assert(len == fwrite(buf, 1, len, out));
+    }
+    fclose(in);
+    fclose(out);
+}
+
+static void corrupt_file(const char* path, long offset) {
+    int byte;
+    FILE* file = fopen(path, "r+b");
+    assert(file);
+    assert(0 == fseek(file, offset, SEEK_SET));
+    byte = fgetc(file);
+    assert(EOF != byte);
+    assert(0 == fseek(file, offset, SEEK_SET));
+    fputc(byte ^ 0x5A, file);
+    fclose(file);
+}
+
+/* clears the flag of the cleanly closed file in the header */
+static void mark_not_clean(const char* path) {
+    FILE* file = fopen(path, "r+b");
+    assert(file);
+    assert(0 == fseek(file, 56, SEEK_SET));
+    fputc(0, file);
+    fclose(file);
+}
+
+/* offset of the 'last_fire' of the state copy in the file: header, then records
+   of the expression record, job id and two states each */
+static long state_offset(int slot, int copy) {
+    return 64 + slot * 112 + CRON_EXPR_RECORD_SIZE + 8 + copy * 24;
+}
+
+/* offset of the heap node in the file of a store with the capacity of 64 jobs */
+static long heap_offset(int idx) {
+    return 64 + 64 * 112 + idx * 16;
+}
+#endif /* __unix__ || __APPLE__ */
+
+void test_store() {
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(CRON_NO_FILE_IO)
+    const char* patterns[] = {"*/15 * * * * *", "0 */2 * * * *", "0 0 7 ? * MON-FRI", "0 30 23 30 1/3 ?", "10-15 * * * * *"};
+    const char* path = "ccronexpr_test.store";
+    const char* copy = "ccronexpr_test_copy.store";
+    cron_expr exprs[5];
+    time_t last[64];
+    time_t stored[64];
+    time_t prev_stored[64];
+    cron_store* store;
+    const char* err = NULL;
+    int64_t job_id;
+    time_t fired = 0;
+    time_t prev_fired = 0;
+    time_t start = 1341136430;
+    time_t date;
+    time_t last_fire;
+    time_t next_fire;
+    time_t torn_last;
+    int i;
+    int job;
+    int popped;
+    FILE* file;
+    for (i = 0; i < 5; i++) {
+        assert(0 == cron_parse_expr_into(patterns[i], &exprs[i], NULL));
+    }
+    remove(path);
+    remove(copy);
+    assert(NULL == cron_store_open(path, 0, &err) && err);
+    assert(NULL == cron_store_open(NULL, 64, &err) && err);
+    store = cron_store_open(path, 64, &err);
+    assert(store && NULL == err);
+    assert(0 == cron_store_recovered(store));
+    assert(INVALID_INSTANT == cron_store_peek(store));
+    assert(-1 == cron_store_pop_due(store, start, NULL, NULL));
+    for (i = 0; i < 64; i++) {
+        last[i] = start;
+        stored[i] = INVALID_INSTANT;
+        prev_stored[i] = INVALID_INSTANT;
+        assert(i == cron_store_add(store, &exprs[i % 5], 1000 + i, start));
+    }
+    /* full, then removed slots are reused */
+    assert(-1 == cron_store_add(store, &exprs[0], 2000, start));
+    assert(0 == cron_store_remove(store, 7));
+    assert(-1 == cron_store_remove(store, 7));
+    assert(-1 == cron_store_rearm(store, 7, start));
+    assert(-1 == cron_store_get(store, 7, NULL, NULL, NULL));
+    assert(63 == cron_store_size(store));
+    assert(7 == cron_store_add(store, &exprs[7 % 5], 1007, start));
+    assert(64 == cron_store_size(store));
+    for (date = start; date < start + 24 * 3600; date += 7) {
+        while (-1 != (job = cron_store_pop_due(store, date, &job_id, &fired))) {
+            assert(1000 + job == job_id);
+            assert(fired <= date && fired >= prev_fired);
+            assert(fired == cron_next(&exprs[job % 5], last[job]));
+            prev_fired = fired;
+            last[job] = fired;
+            prev_stored[job] = stored[job];
+            stored[job] = fired;
+            assert(0 == cron_store_rearm(store, job, fired));
+        }
+        assert(cron_store_peek(store) > date);
+    }
+    assert(0 == cron_store_get(store, 0, &job_id, &last_fire, &next_fire));
+    assert(1000 == job_id && stored[0] == last_fire && cron_next(&exprs[0], last[0]) == next_fire);
+    assert(INVALID_INSTANT != prev_stored[0]);
+    /* clean close and reopen, the order is taken from the file */
+    assert(0 == cron_store_close(store));
+    store = cron_store_open(path, 0, &err);
+    assert(store && NULL == err);
+    assert(0 == cron_store_recovered(store));
+    assert(64 == cron_store_size(store));
+    fired = cron_store_peek(store);
+    assert(fired > date - 7);
+    /* taken and not rearmed job is due again after a crash */
+    popped = cron_store_pop_due(store, fired, &job_id, NULL);
+    assert(-1 != popped);
+    assert(0 == cron_store_sync(store));
+    copy_file(path, copy);
+    assert(0 == cron_store_close(store));
+    store = cron_store_open(path, 0, &err);
+    assert(store && 1 == cron_store_recovered(store));
+    assert(fired == cron_store_peek(store));
+    assert(0 == cron_store_get(store, popped, NULL, NULL, &next_fire) && fired == next_fire);
+    assert(0 == cron_store_close(store));
+    store = cron_store_open(copy, 0, &err);
+    assert(store && 1 == cron_store_recovered(store));
+    assert(64 == cron_store_size(store));
+    assert(fired == cron_store_peek(store));
+    assert(0 == cron_store_close(store));
+    /* heap and free list of a file closed cleanly are checked, they are rebuilt if corrupt */
+    copy_file(path, copy);
+    corrupt_file(copy, heap_offset(0) + 9);
+    store = cron_store_open(copy, 0, &err);
+    assert(store && 1 == cron_store_recovered(store));
+    assert(64 == cron_store_size(store));
+    assert(fired == cron_store_peek(store));
+    popped = cron_store_pop_due(store, fired, NULL, NULL);
+    assert(0 == cron_store_get(store, popped, NULL, NULL, &next_fire) && fired == next_fire);
+    assert(0 == cron_store_rearm(store, popped, fired));
+    assert(0 == cron_store_close(store));
+    copy_file(path, copy);
+    corrupt_file(copy, 47);
+    store = cron_store_open(copy, 0, &err);
+    assert(store && 1 == cron_store_recovered(store));
+    assert(0 == cron_store_remove(store, 3));
+    assert(3 == cron_store_add(store, &exprs[3], 1003, start));
+    assert(0 == cron_store_close(store));
+    store = cron_store_open(copy, 0, &err);
+    assert(store && 0 == cron_store_recovered(store));
+    assert(0 == cron_store_close(store));
+    /* torn state copies, the other copy is used, jobs without valid copies are removed */
+    copy_file(path, copy);
+    corrupt_file(copy, state_offset(0, 0));
+    corrupt_file(copy, state_offset(1, 0));
+    corrupt_file(copy, state_offset(1, 1));
+    mark_not_clean(copy);
+    store = cron_store_open(copy, 0, &err);
+    assert(store && 1 == cron_store_recovered(store));
+    assert(63 == cron_store_size(store));
+    assert(-1 == cron_store_get(store, 1, NULL, NULL, NULL));
+    assert(0 == cron_store_get(store, 0, NULL, &torn_last, NULL));
+    assert(stored[0] == torn_last || prev_stored[0] == torn_last);
+    assert(1 == cron_store_add(store, &exprs[1], 1001, start));
+    assert(0 == cron_store_close(store));
+    copy_file(path, copy);
+    corrupt_file(copy, state_offset(0, 1));
+    mark_not_clean(copy);
+    store = cron_store_open(copy, 0, &err);
+    assert(store && 1 == cron_store_recovered(store));
+    assert(0 == cron_store_get(store, 0, NULL, &last_fire, NULL));
+    /* one of the copies is the last state, the other one the state before it */
+    assert((stored[0] == last_fire) != (stored[0] == torn_last));
+    assert(prev_stored[0] == last_fire || prev_stored[0] == torn_last);
+    assert(0 == cron_store_close(store));
+    /* not a store file */
+    file = fopen(copy, "wb");
+    assert(file);
+    fputs("not a store, but longer than the header of the store file, which is 64 bytes", file);
+    fclose(file);
+    assert(NULL == cron_store_open(copy, 64, &err) && err);
+    assert(-1 == cron_store_close(NULL));
+    remove(path);
+    remove(copy);
+#endif /* (__unix__ || __APPLE__) && !CRON_NO_FILE_IO */
+}
+
+typedef struct {
+    time_t fired;
+    int job;
+} fired_job;
+
+static int compare_fired(const void* a, const void* b) {
+    const fired_job* fa = (const fired_job*) a;
+    const fired_job* fb = (const fired_job*) b;
+    if (fa->fired != fb->fired) return fa->fired < fb->fired ? -1 : 1;
+    return fa->job - fb->job;
+}
+
+/* takes and rearms all jobs due at the date from the wheel and the scheduler, they must be the same,
+   the wheel takes them in the order of 'fire' dates if no jobs were armed before the wheel time */
+static void check_wheel_step(cron_wheel* wheel, cron_scheduler* sched, time_t date, int ordered) {
+    fired_job from_wheel[1024];
+    fired_job from_sched[1024];
+    size_t wheel_len = 0;
+    size_t sched_len = 0;
+    size_t i;
+    time_t prev_fired = 0;
+    time_t fired;
+    int job;
+    while (-1 != (job = cron_wheel_pop_due(wheel, date, NULL, &fired))) {
+        assert(wheel_len < 1024);
+        assert(fired <= date && (!ordered || fired >= prev_fired));
+        prev_fired = fired;
+        from_wheel[wheel_len].fired = fired;
+        from_wheel[wheel_len].job = job;
+        wheel_len += 1;
+        assert(0 == cron_wheel_rearm(wheel, job, fired));
+    }
+    while (-1 != (job = cron_scheduler_pop_due(sched, date, NULL, &fired))) {
+        assert(sched_len < 1024);
+        from_sched[sched_len].fired = fired;
+        from_sched[sched_len].job = job;
+        sched_len += 1;
+        assert(0 == cron_scheduler_rearm(sched, job, fired));
+    }
+    assert(wheel_len == sched_len);
+    qsort(from_wheel, wheel_len, sizeof(fired_job), compare_fired);
+    qsort(from_sched, sched_len, sizeof(fired_job), compare_fired);
+    for (i = 0; i < wheel_len; i++) {
+        assert(0 == compare_fired(&from_wheel[i], &from_sched[i]));
+    }
+    assert(cron_wheel_peek(wheel) == cron_scheduler_peek(sched));
+    assert(cron_wheel_peek(wheel) > date);
+}
+
+void test_wheel() {
+    const char* patterns[] = {"*/15 * * * * *", "0 */2 * * * *", "0 0 * * * *", "10-15 * * * * *", "0 0 7 ? * MON-FRI",
+            "0 30 23 30 1/3 ?", "0 0 0 LW * ?", "0 0 0 1 1 *", "0 0 12 29 2 *", "* * * * * *"};
+    cron_expr exprs[10];
+    cron_wheel* wheel;
+    cron_scheduler* sched;
+    time_t start = 1341136430;
+    time_t date;
+    time_t fired;
+    void* payload = NULL;
+    int i;
+    int job;
+    for (i = 0; i < 10; i++) {
+        assert(0 == cron_parse_expr_into(patterns[i], &exprs[i], NULL));
+    }
+    wheel = cron_wheel_new(start, 0);
+    sched = cron_scheduler_new(0);
+    assert(wheel && sched);
+    assert(INVALID_INSTANT == cron_wheel_peek(wheel));
+    assert(-1 == cron_wheel_pop_due(wheel, start, NULL, NULL));
+    for (i = 0; i < 60; i++) {
+        /* some jobs start before the wheel time and are due right away */
+        time_t from = 0 == i % 7 ? start - 90 : start;
+        assert(i == cron_wheel_add(wheel, &exprs[i % 10], NULL, from));
+        assert(i == cron_scheduler_add(sched, &exprs[i % 10], NULL, from));
+    }
+    assert(cron_wheel_peek(wheel) == cron_scheduler_peek(sched));
+    assert(0 == cron_wheel_remove(wheel, 5));
+    assert(-1 == cron_wheel_remove(wheel, 5));
+    assert(-1 == cron_wheel_rearm(wheel, 5, start));
+    assert(0 == cron_scheduler_remove(sched, 5));
+    /* removed ids are reused */
+    assert(5 == cron_wheel_add(wheel, &exprs[5], &exprs[5], start));
+    assert(5 == cron_scheduler_add(sched, &exprs[5], NULL, start));
+    check_wheel_step(wheel, sched, start, 0);
+    for (date = start + 7; date < start + 2 * 24 * 3600; date += 7) {
+        check_wheel_step(wheel, sched, date, 1);
+    }
+    /* rearmed before it is due */
+    assert(0 == cron_wheel_rearm(wheel, 2, date + 7200));
+    assert(0 == cron_scheduler_rearm(sched, 2, date + 7200));
+    /* jobs firing every few seconds are removed, the others are followed for years in long steps */
+    for (i = 0; i < 60; i++) {
+        if (0 == i % 10 || 1 == i % 10 || 3 == i % 10 || 9 == i % 10) {
+            assert(0 == cron_wheel_remove(wheel, i));
+            assert(0 == cron_scheduler_remove(sched, i));
+        }
+    }
+    for (; date < start + 5 * 366 * 24 * 3600; date += 5 * 24 * 3600 + 4567) {
+        check_wheel_step(wheel, sched, date, 1);
+    }
+    assert(-1 != (job = cron_wheel_pop_due(wheel, cron_wheel_peek(wheel), &payload, &fired)));
+    assert(fired == cron_scheduler_peek(sched) && job >= 0);
+    cron_wheel_free(wheel);
+    cron_scheduler_free(sched);
+    /* the wheel time only moves forward, jobs armed before it are due right away */
+    wheel = cron_wheel_new(start, 1);
+    assert(0 == cron_wheel_add(wheel, &exprs[2], &exprs[2], start));
+    fired = cron_wheel_peek(wheel);
+    assert(-1 == cron_wheel_pop_due(wheel, fired - 1, NULL, NULL));
+    assert(1 == cron_wheel_add(wheel, &exprs[1], NULL, fired - 1));
+    assert(0 == cron_wheel_remove(wheel, 1));
+    assert(0 == cron_wheel_pop_due(wheel, fired + 600, &payload, &date));
+    assert(&exprs[2] == payload && fired == date);
+    assert(-1 == cron_wheel_pop_due(wheel, fired + 600, NULL, NULL));
+    assert(0 == cron_wheel_rearm(wheel, 0, fired));
+    assert(0 == cron_wheel_pop_due(wheel, fired + 7200, NULL, &date));
+    assert(fired + 3600 == date);
+    assert(0 == cron_wheel_rearm(wheel, 0, fired - 1));
+    assert(fired == cron_wheel_peek(wheel));
+    /* dates before the wheel time take no jobs */
+    assert(-1 == cron_wheel_pop_due(wheel, fired, NULL, NULL));
+    assert(0 == cron_wheel_pop_due(wheel, fired + 3600, NULL, &date));
+    assert(fired == date);
+    assert(-1 == cron_wheel_remove(wheel, 3));
+    cron_wheel_free(wheel);
+}
+
+void test_registry() {
+    cron_registry* reg;
+    cron_expr* exprs[5];
+    const cron_expr* expr = NULL;
+    void* payload = NULL;
+    int values[5];
+    int writer;
+    int reader;
+    int job;
+    int i;
+#ifdef CRON_TEST_MALLOC
+    int allocations;
+#endif /* CRON_TEST_MALLOC */
+    assert(NULL == cron_registry_new(0, 1));
+    assert(NULL == cron_registry_new(4, 0));
+    reg = cron_registry_new(4, 2);
+    assert(reg);
+    writer = cron_registry_attach(reg);
+    reader = cron_registry_attach(reg);
+    assert(0 == writer && 1 == reader);
+    assert(-1 == cron_registry_attach(reg));
+    for (i = 0; i < 5; i++) {
+        values[i] = i;
+        exprs[i] = cron_parse_expr("0 0 * * * *", NULL);
+        assert(exprs[i]);
+    }
+    for (i = 0; i < 4; i++) {
+        assert(i == cron_registry_add(reg, exprs[i], &values[i]));
+    }
+    /* full, the expression is not taken */
+    assert(-1 == cron_registry_add(reg, exprs[4], &values[4]));
+    assert(4 == cron_registry_size(reg));
+    cron_registry_enter(reg, reader);
+    assert(exprs[2] == cron_registry_get(reg, 2, &payload) && &values[2] == payload);
+    for (i = 0, job = -1; -1 != (job = cron_registry_next_job(reg, job, &expr, &payload)); i++) {
+        assert(i == job && exprs[i] == expr && &values[i] == payload);
+    }
+    assert(4 == i);
+    /* removed job is not freed while the reader can still use it */
+    assert(0 == cron_registry_remove(reg, writer, 1));
+    assert(-1 == cron_registry_remove(reg, writer, 1));
+    assert(-1 == cron_registry_remove(reg, writer, 4));
+    assert(NULL == cron_registry_get(reg, 1, NULL));
+    assert(3 == cron_registry_size(reg));
+#ifdef CRON_TEST_MALLOC
+    allocations = cron_allocations;
+#endif /* CRON_TEST_MALLOC */
+    assert(1 == cron_registry_reclaim(reg, writer));
+    assert(1 == cron_registry_reclaim(reg, writer));
+#ifdef CRON_TEST_MALLOC
+    assert(allocations == cron_allocations);
+#endif /* CRON_TEST_MALLOC */
+    cron_registry_leave(reg, reader);
+    assert(0 == cron_registry_reclaim(reg, writer));
+#ifdef CRON_TEST_MALLOC
+    /* the expression and the entry of the job */
+    assert(allocations - 2 == cron_allocations);
+#endif /* CRON_TEST_MALLOC */
+    /* removed ids are reused */
+    assert(1 == cron_registry_add(reg, exprs[4], &values[4]));
+    cron_registry_detach(reg, reader);
+    assert(1 == cron_registry_attach(reg));
+    assert(0 == cron_registry_remove(reg, reader, 3));
+    cron_registry_detach(reg, reader);
+    cron_registry_free(reg);
+}
+
+void test_expr_set() {
+    const char* patterns[] = {"* * * * * *", "*/15 * 1-4 * * *", "0 0 0 29 2 *", "0 0 7 ? * MON-FRI",
+            "0 30 23 30 1/3 ?", "10-15 */2 * 1,29 * 2", "0 * * * * *", "30 5 * * * SUN", "0 */5 * L * *",
+            "* 0 0 ? * WED#5", "*/3 * * * * * 2011"};
+    size_t patterns_len = sizeof(patterns) / sizeof(patterns[0]);
+    time_t starts[] = {1330473600 - 5400, 1341100000, 1293839000};
+    cron_expr exprs[11];
+    cron_expr empty;
+    int ids[1100];
+    int expected[1100];
+    size_t count;
+    size_t i;
+    size_t j;
+    size_t k;
+    int id;
+    cron_expr_set* set = cron_expr_set_new(0);
+    assert(set);
+    for (i = 0; i < patterns_len; i++) {
+        assert(0 == cron_parse_expr_into(patterns[i], &exprs[i], NULL));
+    }
+    /* more than one block of ids, some removed and reused */
+    for (i = 0; i < 1000; i++) {
+        assert((int) i == cron_expr_set_add(set, &exprs[i % patterns_len]));
+    }
+    for (i = 0; i < 1000; i += 3) {
+        assert(0 == cron_expr_set_remove(set, (int) i));
+    }
+    assert(-1 == cron_expr_set_remove(set, 0));
+    assert(-1 == cron_expr_set_remove(set, 1000));
+    assert(666 == cron_expr_set_size(set));
+    assert(999 == cron_expr_set_add(set, &exprs[999 % patterns_len]));
+    memset(&empty, 0, sizeof(empty));
+    assert(-1 == cron_expr_set_add(set, &empty));
+    for (j = 0; j < sizeof(starts) / sizeof(starts[0]); j++) {
+        time_t date;
+        for (date = starts[j]; date < starts[j] + 10800; date += 13) {
+            struct tm calendar = *gmtime(&date);
+            size_t expected_len = 0;
+            size_t minute_len = 0;
+            for (i = 0; i < 1000; i++) {
+                if (0 == i % 3 && 999 != i) continue;
+                if (cron_matches(&exprs[i % patterns_len], date)) {
+                    expected[expected_len++] = (int) i;
+                }
+            }
+            count = cron_expr_set_match(set, &calendar, ids, 1100);
+            assert(count == expected_len);
+            assert(0 == count || 0 == memcmp(ids, expected, count * sizeof(int)));
+            if (count > 1) {
+                assert(1 == cron_expr_set_match(set, &calendar, ids, 1));
+                assert(ids[0] == expected[0]);
+            }
+            for (i = 0; i < 1000; i++) {
+                time_t minute = date - calendar.tm_sec - 1;
+                time_t next;
+                if (0 == i % 3 && 999 != i) continue;
+                next = cron_next(&exprs[i % patterns_len], minute);
+                if (INVALID_INSTANT != next && next < minute + 61) {
+                    expected[minute_len++] = (int) i;
+                }
+            }
+            count = cron_expr_set_match_minute(set, &calendar, ids, 1100);
+            assert(count == minute_len);
+            assert(0 == count || 0 == memcmp(ids, expected, count * sizeof(int)));
+        }
+    }
+    for (k = 0; k < 1000; k++) {
+        cron_expr_set_remove(set, (int) k);
+    }
+    assert(0 == cron_expr_set_size(set));
+    {
+        time_t date = starts[0];
+        struct tm calendar = *gmtime(&date);
+        assert(0 == cron_expr_set_match(set, &calendar, ids, 1100));
+        calendar.tm_sec = 60;
+        id = cron_expr_set_add(set, &exprs[0]);
+        assert(id >= 0);
+        assert(0 == cron_expr_set_match(set, &calendar, ids, 1100));
+        assert(1 == cron_expr_set_match_minute(set, &calendar, ids, 1100) && id == ids[0]);
+    }
+    cron_expr_set_free(set);
+}
+
+static void check_between(const cron_expr* expr, time_t from, time_t to) {
+    time_t dates[2000];
+    time_t expected[2000];
+    int64_t count = 0;
+    size_t written;
+    size_t i;
+    time_t date;
+    cron_iter iter;
+    cron_iter_init(&iter, expr, from);
+    while (INVALID_INSTANT != (date = cron_iter_next(&iter)) && date <= to) {
+        if (count < 2000) {
+            expected[count] = date;
+        }
+        count += 1;
+    }
+    assert(count == cron_count_between(expr, from, to));
+    written = cron_fill_between(expr, from, to, dates, 2000);
+    assert((int64_t) written == (count < 2000 ? count : 2000));
+    for (i = 0; i < written; i++) {
+        assert(dates[i] == expected[i]);
+    }
+    if (written > 3) {
+        assert(3 == cron_fill_between(expr, from, to, dates, 3));
+        assert(dates[2] == expected[2]);
+    }
+}
+
+void test_between() {
+    const char* patterns[] = {"* * * * * *", "*/15 * 1-4 * * *", "0 0 0 29 2 *", "0 0 7 ? * MON-FRI",
+            "0 30 23 30 1/3 ?", "10-15 */2 * 1,29 * 2", "0 0 12 31 * *", "59 59 23 * * *"};
+    /* date -1 is not iterated as it is the error value */
+    time_t starts[] = {1330473600 - 5400, 1341100000, 1293839000, 0, -200 * 86400 - 1};
+    long windows[] = {0, 1, 59, 3600, 86399, 86400, 86401, 3 * 86400 + 17, 100 * 86400};
+    cron_expr expr;
+    size_t i;
+    size_t j;
+    size_t k;
+    for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        assert(0 == cron_parse_expr_into(patterns[i], &expr, NULL));
+        for (j = 0; j < sizeof(starts) / sizeof(starts[0]); j++) {
+            for (k = 0; k < sizeof(windows) / sizeof(windows[0]); k++) {
+                if (windows[k] > 86400 && 0 == i) continue;
+                check_between(&expr, starts[j], starts[j] + windows[k]);
+            }
+        }
+        assert(0 == cron_count_between(&expr, starts[0], starts[0] - 10));
+        assert(0 == cron_fill_between(&expr, starts[0], starts[0] - 10, &starts[0], 1));
+    }
+    /* long ranges are not iterated */
+    assert(0 == cron_parse_expr_into("* * * * * *", &expr, NULL));
+    assert((int64_t) 366 * 86400 == cron_count_between(&expr, 1325376000 - 1, 1356998400 - 1));
+    assert(0 == cron_parse_expr_into("0 0 0 29 2 *", &expr, NULL));
+    assert(97 == cron_count_between(&expr, 946684800, 946684800 + (time_t) 146097 * 86400));
+    assert(0 == cron_parse_expr_into("* * * * * *", &expr, NULL));
+#ifndef CRON_USE_LOCAL_TIME
+    /* counted even though 'cron_next' cannot return it */
+    assert(1 == cron_count_between(&expr, -2, -1));
+    assert(1 == cron_fill_between(&expr, -2, -1, starts, 2) && -1 == starts[0]);
+#endif /* CRON_USE_LOCAL_TIME */
+    assert(-1 == cron_count_between(NULL, 0, 10));
+    assert(0 == cron_fill_between(NULL, 0, 10, &starts[0], 1));
+}
+
+void test_next_no_alloc() {
+#ifdef CRON_TEST_MALLOC
+    int i;
+    int total_before;
+    time_t date = 1341100000;
+    time_t dates[1000];
+    cron_expr* parsed = cron_parse_expr("0 */5 1-4,22 * * MON-FRI", NULL);
+    assert(parsed);
+    total_before = cron_total_allocations;
+    for (i = 0; i < 100000; i++) {
+        date = cron_next(parsed, date);
+        assert(INVALID_INSTANT != date);
+    }
+    date = cron_next_n(parsed, date, dates, 1000) == 1000 ? dates[999] : INVALID_INSTANT;
+    assert(INVALID_INSTANT != date);
+    /* cron_next must not touch the heap */
+    assert(total_before == cron_total_allocations);
+    cron_expr_free(parsed);
+    /* parser must not leak */
+    assert(0 == cron_allocations);
+#endif /* CRON_TEST_MALLOC */
+}
+
+#ifdef CRON_TEST_THREADS
+#define THREADS_MAX 8
+#define THREADS_CALLS 200000
+
+typedef struct {
+    const cron_expr* expr;
+    time_t start;
+    time_t last;
+} thread_job;
+
+static void* next_worker(void* arg) {
+    thread_job* job = (thread_job*) arg;
+    time_t date = job->start;
+    int i;
+    for (i = 0; i < THREADS_CALLS; i++) {
+        date = cron_next(job->expr, date);
+    }
+    job->last = date;
+    return NULL;
+}
+
+#define REGISTRY_READERS 4
+#define REGISTRY_WRITERS 2
+#define REGISTRY_CAPACITY 512
+#define REGISTRY_WRITES 100000
+
+typedef struct {
+    cron_registry* reg;
+    int writer;
+    volatile int* stop;
+    long ops;
+} registry_worker;
+
+/* minute of the expression "0 m * * * *" is kept in the payload as m + 1 */
+static void* registry_reader(void* arg) {
+    registry_worker* worker = (registry_worker*) arg;
+    int thread = cron_registry_attach(worker->reg);
+    assert(-1 != thread);
+    while (!__atomic_load_n(worker->stop, __ATOMIC_ACQUIRE)) {
+        const cron_expr* expr;
+        void* payload;
+        int job = -1;
+        cron_registry_enter(worker->reg, thread);
+        while (-1 != (job = cron_registry_next_job(worker->reg, job, &expr, &payload))) {
+            size_t minute = (size_t) payload - 1;
+            assert(1 == expr->seconds && ((uint64_t) 1) << minute == expr->minutes);
+            assert((time_t) minute * 60 == cron_next(expr, 1341100800) % 3600);
+            worker->ops += 1;
+        }
+        cron_registry_leave(worker->reg, thread);
+    }
+    cron_registry_detach(worker->reg, thread);
+    return NULL;
+}
+
+static void* registry_writer(void* arg) {
+    registry_worker* worker = (registry_worker*) arg;
+    int thread = cron_registry_attach(worker->reg);
+    unsigned int seed = 17 + (unsigned int) worker->writer;
+    char expression[32];
+    assert(-1 != thread);
+    while (worker->ops < REGISTRY_WRITES) {
+        seed = seed * 1103515245u + 12345u;
+        if (cron_registry_size(worker->reg) < REGISTRY_CAPACITY / 2 || 0 == seed % 3) {
+            size_t minute = (seed >> 8) % 60;
+            cron_expr* expr;
+            sprintf(expression, "0 %d * * * *", (int) minute);
+            expr = cron_parse_expr(expression, NULL);
+            if (-1 == cron_registry_add(worker->reg, expr, (void*) (minute + 1))) {
+                cron_expr_free(expr);
+            }
+        } else {
+            cron_registry_remove(worker->reg, thread, (int) ((seed >> 8) % REGISTRY_CAPACITY));
+        }
+        worker->ops += 1;
+    }
+    cron_registry_detach(worker->reg, thread);
+    return NULL;
+}
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#endif /* CRON_TEST_THREADS */
+
+void test_next_threads() {
+#ifdef CRON_TEST_THREADS
+    int i;
+    int nthreads;
+    double single_rate = 0;
+    pthread_t threads[THREADS_MAX];
+    thread_job jobs[THREADS_MAX];
+    thread_job reference;
+    cron_expr* parsed = cron_parse_expr("*/7 */5 1-4,22 * * MON-FRI", NULL);
+    assert(parsed);
+    reference.expr = parsed;
+    reference.start = 1341100000;
+    next_worker(&reference);
+    for (nthreads = 1; nthreads <= THREADS_MAX; nthreads *= 2) {
+        double start = now_seconds();
+        double rate;
+        for (i = 0; i < nthreads; i++) {
+            jobs[i].expr = parsed;
+            jobs[i].start = reference.start;
+            assert(0 == pthread_create(&threads[i], NULL, next_worker, &jobs[i]));
+        }
+        for (i = 0; i < nthreads; i++) {
+            assert(0 == pthread_join(threads[i], NULL));
+            /* all threads share one expression and must agree with the single threaded run */
+            assert(jobs[i].last == reference.last);
+        }
+        rate = (double) nthreads * THREADS_CALLS / (now_seconds() - start);
+        if (1 == nthreads) {
+            single_rate = rate;
+        }
+        printf("cron_next threads: %d, calls/s: %.0f, speedup: %.2f\n", nthreads, rate, rate / single_rate);
+    }
+    cron_expr_free(parsed);
+#endif /* CRON_TEST_THREADS */
+}
+
+/* readers iterate the jobs and check their expressions while writers add and remove them */
+void test_registry_threads() {
+#ifdef CRON_TEST_THREADS
+    pthread_t threads[REGISTRY_READERS + REGISTRY_WRITERS];
+    registry_worker workers[REGISTRY_READERS + REGISTRY_WRITERS];
+    volatile int stop = 0;
+    cron_registry* reg = cron_registry_new(REGISTRY_CAPACITY, REGISTRY_READERS + REGISTRY_WRITERS + 1);
+    double start;
+    double elapsed;
+    long reads = 0;
+    long writes = 0;
+    int count = 0;
+    int job = -1;
+    int i;
+    assert(reg);
+    start = now_seconds();
+    for (i = 0; i < REGISTRY_READERS + REGISTRY_WRITERS; i++) {
+        workers[i].reg = reg;
+        workers[i].writer = i;
+        workers[i].stop = &stop;
+        workers[i].ops = 0;
+        assert(0 == pthread_create(&threads[i], NULL, i < REGISTRY_READERS ? registry_reader : registry_writer, &workers[i]));
+    }
+    for (i = REGISTRY_READERS; i < REGISTRY_READERS + REGISTRY_WRITERS; i++) {
+        assert(0 == pthread_join(threads[i], NULL));
+        writes += workers[i].ops;
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < REGISTRY_READERS; i++) {
+        assert(0 == pthread_join(threads[i], NULL));
+        reads += workers[i].ops;
+    }
+    elapsed = now_seconds() - start;
+    while (-1 != (job = cron_registry_next_job(reg, job, NULL, NULL))) {
+        count += 1;
+    }
+    assert((size_t) count == cron_registry_size(reg));
+    printf("cron_registry readers: %d, writers: %d, jobs read/s: %.0f, writes/s: %.0f\n", REGISTRY_READERS,
+            REGISTRY_WRITERS, reads / elapsed, writes / elapsed);
+    cron_registry_free(reg);
+#endif /* CRON_TEST_THREADS */
 }
 
 int main() {
     test_expr();
+    test_prev();
+    test_next_n();
+    test_iter();
+    test_scheduler();
+    test_wheel();
+    test_cache();
     test_parse();
+    test_parse_into();
+    test_tz();
+    test_shapes();
+    test_matches();
+    test_day_items();
+    test_years();
+    test_serialize();
+    test_store();
+    test_registry();
+    test_expr_set();
+    test_between();
     check_calc_invalid();
+    check_bits();
+    test_next_no_alloc();
+    test_next_threads();
+    test_registry_threads();
 
     return 0;
 }
@@ -0,0 +1,359 @@
+/*
+ * File:   ccronexpr_wheel.c
+ *
+ * Hierarchical timing wheel over a set of cron expressions.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "ccronexpr_wheel.h"
+#include "ccronexpr_alloc.h"
+#include "ccronexpr_internal.h"
+
+#define CRON_INVALID_INSTANT ((time_t) -1)
+
+#define CRON_WHEEL_MIN_CAPACITY 16
+
+#define CRON_WHEEL_MINUTE 60
+#define CRON_WHEEL_HOUR 3600
+#define CRON_WHEEL_DAY 86400
+#define CRON_WHEEL_PERIOD_DAYS 64
+#define CRON_WHEEL_PERIOD ((int64_t) CRON_WHEEL_DAY * CRON_WHEEL_PERIOD_DAYS)
+
+/* levels of seconds, minutes, hours and days, one bit per slot in 'occupied' */
+#define CRON_WHEEL_LEVELS 4
+/* length of a slot and of the whole level, in seconds */
+static const int64_t LEVEL_UNITS[CRON_WHEEL_LEVELS] = {1, CRON_WHEEL_MINUTE, CRON_WHEEL_HOUR, CRON_WHEEL_DAY};
+static const int64_t LEVEL_SPANS[CRON_WHEEL_LEVELS] = {CRON_WHEEL_MINUTE, CRON_WHEEL_HOUR, CRON_WHEEL_DAY, CRON_WHEEL_PERIOD};
+
+/* lists of jobs: due jobs, jobs after the current period, then the slots of the levels */
+#define CRON_WHEEL_DUE 0
+#define CRON_WHEEL_LATER 1
+static const int LEVEL_LISTS[CRON_WHEEL_LEVELS] = {2, 2 + 60, 2 + 60 + 60, 2 + 60 + 60 + 24};
+#define CRON_WHEEL_LISTS (2 + 60 + 60 + 24 + CRON_WHEEL_PERIOD_DAYS)
+
+/* 'state' of a job */
+#define CRON_WHEEL_ARMED 1
+#define CRON_WHEEL_NOT_ARMED 0
+/* removed job, its 'link.next' is the next job in the free list */
+#define CRON_WHEEL_REMOVED -1
+
+/* lists are circular, node ids below CRON_WHEEL_LISTS are the list heads,
+   the others are jobs, so a job is unlinked without knowing its list */
+typedef struct {
+    int prev;
+    int next;
+} cron_wheel_link;
+
+typedef struct {
+    cron_wheel_link link;
+    time_t next_fire;
+    const cron_expr* expr;
+    void* payload;
+    int state;
+} cron_wheel_job;
+
+struct cron_wheel {
+    cron_wheel_link heads[CRON_WHEEL_LISTS];
+    /* slots that may have jobs, bits of the emptied slots are cleared when the wheel reaches them */
+    uint64_t occupied[CRON_WHEEL_LEVELS];
+    /* start of the period of the first date, the wheel time is kept relative to it */
+    int64_t origin;
+    int64_t now;
+    cron_wheel_job* jobs;
+    size_t jobs_len;
+    size_t jobs_cap;
+    int free_head;
+};
+
+static cron_wheel_link* link_of(cron_wheel* wheel, int node) {
+    return node < CRON_WHEEL_LISTS ? &wheel->heads[node] : &wheel->jobs[node - CRON_WHEEL_LISTS].link;
+}
+
+static const cron_wheel_link* link_of_const(const cron_wheel* wheel, int node) {
+    return node < CRON_WHEEL_LISTS ? &wheel->heads[node] : &wheel->jobs[node - CRON_WHEEL_LISTS].link;
+}
+
+static int list_empty(const cron_wheel* wheel, int list) {
+    return list == wheel->heads[list].next;
+}
+
+static void list_reset(cron_wheel* wheel, int list) {
+    wheel->heads[list].prev = list;
+    wheel->heads[list].next = list;
+}
+
+static void list_push(cron_wheel* wheel, int list, int job) {
+    int node = CRON_WHEEL_LISTS + job;
+    int tail = wheel->heads[list].prev;
+    wheel->jobs[job].link.prev = tail;
+    wheel->jobs[job].link.next = list;
+    link_of(wheel, tail)->next = node;
+    wheel->heads[list].prev = node;
+}
+
+static void list_unlink(cron_wheel* wheel, int job) {
+    cron_wheel_link link = wheel->jobs[job].link;
+    link_of(wheel, link.prev)->next = link.next;
+    link_of(wheel, link.next)->prev = link.prev;
+}
+
+/* appends all jobs of the list to the due list */
+static void list_splice_due(cron_wheel* wheel, int list) {
+    int first = wheel->heads[list].next;
+    int last = wheel->heads[list].prev;
+    int tail = wheel->heads[CRON_WHEEL_DUE].prev;
+    if (first == list) return;
+    link_of(wheel, tail)->next = first;
+    link_of(wheel, first)->prev = tail;
+    link_of(wheel, last)->next = CRON_WHEEL_DUE;
+    wheel->heads[CRON_WHEEL_DUE].prev = last;
+    list_reset(wheel, list);
+}
+
+/* puts the armed job to the list of its 'fire' date relative to the wheel time */
+static void place(cron_wheel* wheel, int job) {
+    int64_t fire = (int64_t) wheel->jobs[job].next_fire - wheel->origin;
+    int64_t now = wheel->now;
+    int level;
+    int slot;
+    if (fire <= now) {
+        list_push(wheel, CRON_WHEEL_DUE, job);
+        return;
+    }
+    if (fire / CRON_WHEEL_MINUTE == now / CRON_WHEEL_MINUTE) {
+        level = 0;
+        slot = (int) (fire % CRON_WHEEL_MINUTE);
+    } else if (fire / CRON_WHEEL_HOUR == now / CRON_WHEEL_HOUR) {
+        level = 1;
+        slot = (int) (fire / CRON_WHEEL_MINUTE % 60);
+    } else if (fire / CRON_WHEEL_DAY == now / CRON_WHEEL_DAY) {
+        level = 2;
+        slot = (int) (fire / CRON_WHEEL_HOUR % 24);
+    } else if (fire / CRON_WHEEL_PERIOD == now / CRON_WHEEL_PERIOD) {
+        level = 3;
+        slot = (int) (fire / CRON_WHEEL_DAY % CRON_WHEEL_PERIOD_DAYS);
+    } else {
+        list_push(wheel, CRON_WHEEL_LATER, job);
+        return;
+    }
+    wheel->occupied[level] |= ((uint64_t) 1) << slot;
+    list_push(wheel, LEVEL_LISTS[level] + slot, job);
+}
+
+/* places again all jobs of the list, after the wheel time entered its slot */
+static void cascade(cron_wheel* wheel, int list) {
+    int node = wheel->heads[list].next;
+    list_reset(wheel, list);
+    while (node != list) {
+        int next = link_of(wheel, node)->next;
+        place(wheel, node - CRON_WHEEL_LISTS);
+        node = next;
+    }
+}
+
+/* slots of the level after the one of the wheel time, which are in the same minute, hour, day or period */
+static uint64_t later_slots(const cron_wheel* wheel, int level) {
+    int current = (int) (wheel->now % LEVEL_SPANS[level] / LEVEL_UNITS[level]);
+    if (current >= 63) return 0;
+    return wheel->occupied[level] & (~((uint64_t) 0) << (current + 1));
+}
+
+/* start of the earliest slot that may have jobs, -1 if there are no armed jobs */
+static int64_t next_slot_date(const cron_wheel* wheel) {
+    int level;
+    for (level = 0; level < CRON_WHEEL_LEVELS; level++) {
+        uint64_t bits = later_slots(wheel, level);
+        if (bits) {
+            return wheel->now - wheel->now % LEVEL_SPANS[level] + (int64_t) ctz64(bits) * LEVEL_UNITS[level];
+        }
+    }
+    if (!list_empty(wheel, CRON_WHEEL_LATER)) {
+        return wheel->now - wheel->now % CRON_WHEEL_PERIOD + CRON_WHEEL_PERIOD;
+    }
+    return -1;
+}
+
+/* moves the wheel time to the start of the slot, its jobs (and the jobs of
+   the higher level slots starting at the same time) are cascaded down */
+static void move_to(cron_wheel* wheel, int64_t date) {
+    int level;
+    wheel->now = date;
+    if (0 == date % CRON_WHEEL_PERIOD) {
+        cascade(wheel, CRON_WHEEL_LATER);
+    }
+    for (level = CRON_WHEEL_LEVELS - 1; level > 0; level--) {
+        if (0 == date % LEVEL_UNITS[level]) {
+            int slot = (int) (date % LEVEL_SPANS[level] / LEVEL_UNITS[level]);
+            wheel->occupied[level] &= ~(((uint64_t) 1) << slot);
+            cascade(wheel, LEVEL_LISTS[level] + slot);
+        }
+    }
+    wheel->occupied[0] &= ~(((uint64_t) 1) << (date % CRON_WHEEL_MINUTE));
+    list_splice_due(wheel, LEVEL_LISTS[0] + (int) (date % CRON_WHEEL_MINUTE));
+}
+
+/* moves the wheel time forward to the date or to the first second with due jobs before it */
+static void advance(cron_wheel* wheel, time_t date) {
+    int64_t target = (int64_t) date - wheel->origin;
+    while (list_empty(wheel, CRON_WHEEL_DUE) && wheel->now < target) {
+        int64_t next = next_slot_date(wheel);
+        if (-1 == next || next > target) {
+            wheel->now = target;
+            break;
+        }
+        move_to(wheel, next);
+    }
+}
+
+static time_t earliest_in_list(const cron_wheel* wheel, int list) {
+    time_t min = CRON_INVALID_INSTANT;
+    int node;
+    for (node = wheel->heads[list].next; node != list; node = link_of_const(wheel, node)->next) {
+        time_t fire = wheel->jobs[node - CRON_WHEEL_LISTS].next_fire;
+        if (CRON_INVALID_INSTANT == min || fire < min) {
+            min = fire;
+        }
+    }
+    return min;
+}
+
+static void* grow_array(void* arr, size_t len, size_t* cap, size_t elem_size) {
+    size_t new_cap = *cap >= CRON_WHEEL_MIN_CAPACITY ? *cap * 2 : CRON_WHEEL_MIN_CAPACITY;
+    void* res = cron_malloc(new_cap * elem_size);
+    if (!res) return NULL;
+    if (arr) {
+        memcpy(res, arr, len * elem_size);
+        cron_free(arr);
+    }
+    *cap = new_cap;
+    return res;
+}
+
+static int valid_job(const cron_wheel* wheel, int job) {
+    return wheel && job >= 0 && (size_t) job < wheel->jobs_len &&
+            CRON_WHEEL_REMOVED != wheel->jobs[job].state;
+}
+
+cron_wheel* cron_wheel_new(time_t date, size_t capacity) {
+    int64_t start = (int64_t) date;
+    int i;
+    cron_wheel* wheel = (cron_wheel*) cron_malloc(sizeof(cron_wheel));
+    if (!wheel) return NULL;
+    memset(wheel, 0, sizeof(cron_wheel));
+    for (i = 0; i < CRON_WHEEL_LISTS; i++) {
+        list_reset(wheel, i);
+    }
+    /* floor, so that the slots are aligned to UTC minutes, hours and days also before the epoch */
+    wheel->origin = (start >= 0 ? start : start - CRON_WHEEL_PERIOD + 1) / CRON_WHEEL_PERIOD * CRON_WHEEL_PERIOD;
+    wheel->now = start - wheel->origin;
+    wheel->free_head = -1;
+    if (capacity > 0) {
+        wheel->jobs = (cron_wheel_job*) cron_malloc(capacity * sizeof(cron_wheel_job));
+        if (!wheel->jobs) {
+            cron_wheel_free(wheel);
+            return NULL;
+        }
+        wheel->jobs_cap = capacity;
+    }
+    return wheel;
+}
+
+int cron_wheel_add(cron_wheel* wheel, const cron_expr* expr, void* payload, time_t date) {
+    int job;
+    time_t next;
+    if (!wheel || !expr) return -1;
+    next = cron_next(expr, date);
+    if (CRON_INVALID_INSTANT == next) return -1;
+    if (-1 != wheel->free_head) {
+        job = wheel->free_head;
+        wheel->free_head = wheel->jobs[job].link.next;
+    } else {
+        if (wheel->jobs_len >= (size_t) (INT_MAX - CRON_WHEEL_LISTS)) return -1;
+        if (wheel->jobs_len == wheel->jobs_cap) {
+            void* grown = grow_array(wheel->jobs, wheel->jobs_len, &wheel->jobs_cap, sizeof(cron_wheel_job));
+            if (!grown) return -1;
+            wheel->jobs = (cron_wheel_job*) grown;
+        }
+        job = (int) wheel->jobs_len;
+        wheel->jobs_len += 1;
+    }
+    wheel->jobs[job].next_fire = next;
+    wheel->jobs[job].expr = expr;
+    wheel->jobs[job].payload = payload;
+    wheel->jobs[job].state = CRON_WHEEL_ARMED;
+    place(wheel, job);
+    return job;
+}
+
+int cron_wheel_remove(cron_wheel* wheel, int job) {
+    if (!valid_job(wheel, job)) return -1;
+    if (CRON_WHEEL_ARMED == wheel->jobs[job].state) {
+        list_unlink(wheel, job);
+    }
+    wheel->jobs[job].expr = NULL;
+    wheel->jobs[job].payload = NULL;
+    wheel->jobs[job].state = CRON_WHEEL_REMOVED;
+    wheel->jobs[job].link.next = wheel->free_head;
+    wheel->free_head = job;
+    return 0;
+}
+
+time_t cron_wheel_peek(const cron_wheel* wheel) {
+    int level;
+    if (!wheel) return CRON_INVALID_INSTANT;
+    if (!list_empty(wheel, CRON_WHEEL_DUE)) return earliest_in_list(wheel, CRON_WHEEL_DUE);
+    for (level = 0; level < CRON_WHEEL_LEVELS; level++) {
+        uint64_t bits = later_slots(wheel, level);
+        while (bits) {
+            int list = LEVEL_LISTS[level] + (int) ctz64(bits);
+            if (!list_empty(wheel, list)) return earliest_in_list(wheel, list);
+            bits &= bits - 1;
+        }
+    }
+    return earliest_in_list(wheel, CRON_WHEEL_LATER);
+}
+
+int cron_wheel_pop_due(cron_wheel* wheel, time_t date, void** payload, time_t* fire_date) {
+    int job;
+    if (!wheel) return -1;
+    /* due jobs are not after the wheel time, which only moves forward */
+    if ((int64_t) date - wheel->origin < wheel->now) return -1;
+    advance(wheel, date);
+    if (list_empty(wheel, CRON_WHEEL_DUE)) return -1;
+    job = wheel->heads[CRON_WHEEL_DUE].next - CRON_WHEEL_LISTS;
+    list_unlink(wheel, job);
+    wheel->jobs[job].state = CRON_WHEEL_NOT_ARMED;
+    if (fire_date) {
+        *fire_date = wheel->jobs[job].next_fire;
+    }
+    if (payload) {
+        *payload = wheel->jobs[job].payload;
+    }
+    return job;
+}
+
+int cron_wheel_rearm(cron_wheel* wheel, int job, time_t date) {
+    time_t next;
+    if (!valid_job(wheel, job)) return -1;
+    if (CRON_WHEEL_ARMED == wheel->jobs[job].state) {
+        list_unlink(wheel, job);
+        wheel->jobs[job].state = CRON_WHEEL_NOT_ARMED;
+    }
+    next = cron_next(wheel->jobs[job].expr, date);
+    if (CRON_INVALID_INSTANT == next) return -1;
+    wheel->jobs[job].next_fire = next;
+    wheel->jobs[job].state = CRON_WHEEL_ARMED;
+    place(wheel, job);
+    return 0;
+}
+
+void cron_wheel_free(cron_wheel* wheel) {
+    if (!wheel) return;
+    if (wheel->jobs) {
+        cron_free(wheel->jobs);
+    }
+    cron_free(wheel);
+}
@@ -0,0 +1,117 @@
+/*
+ * File:   ccronexpr_wheel.h
+ *
+ * Hierarchical timing wheel over a set of cron expressions.
+ */
+
+#ifndef CCRONEXPR_WHEEL_H
+#define	CCRONEXPR_WHEEL_H
+
+#include "ccronexpr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Timing wheel, holds jobs (cron expression with client payload) in slots
+ * by their next 'fire' dates: seconds of the current minute, minutes of the
+ * current hour, hours of the current day, days of the current 64-day period
+ * and a list of the later jobs. Jobs are moved to the lower level when the
+ * wheel time enters their minute, hour, day or period, so every 'fire' takes
+ * constant time (no more than 4 moves) regardless of the number of jobs, and all
+ * jobs due at the same second are taken at once.
+ * Periods are aligned to UTC days since the epoch.
+ * Wheel is not thread-safe.
+ */
+typedef struct cron_wheel cron_wheel;
+
+/**
+ * Creates empty wheel.
+ *
+ * @param date current date, the wheel time starts at it and only moves forward
+ * @param capacity number of jobs to preallocate space for, can be 0
+ * @return wheel in case of success, must be freed by client using
+ *         'cron_wheel_free' function. NULL is returned on error.
+ */
+cron_wheel* cron_wheel_new(time_t date, size_t capacity);
+
+/**
+ * Adds a job to the wheel and arms it with the next 'fire' date
+ * of the expression after the specified date. Jobs with 'fire' dates
+ * not after the wheel time are due right away.
+ * Wheel does not copy the expression, it must stay valid
+ * until the job is removed or the wheel is freed.
+ *
+ * @param wheel wheel
+ * @param expr parsed cron expression of the job
+ * @param payload client data returned with the job when it is due
+ * @param date date to calculate the first 'fire' date from
+ * @return job id (not negative) in case of success, ids of removed jobs
+ *         are reused. -1 is returned on error or if the expression never fires.
+ */
+int cron_wheel_add(cron_wheel* wheel, const cron_expr* expr, void* payload, time_t date);
+
+/**
+ * Removes the job from the wheel.
+ *
+ * @param wheel wheel
+ * @param job job id returned by 'cron_wheel_add'
+ * @return 0 in case of success, -1 if there is no such job.
+ */
+int cron_wheel_remove(cron_wheel* wheel, int job);
+
+/**
+ * Returns the earliest 'fire' date of all armed jobs. Takes time proportional
+ * to the number of jobs in the first not empty slot of the wheel.
+ *
+ * @param wheel wheel
+ * @return earliest 'fire' date, '((time_t) -1)' if no jobs are armed.
+ */
+time_t cron_wheel_peek(const cron_wheel* wheel);
+
+/**
+ * Moves the wheel time forward to the specified date (stopping at the
+ * first second with due jobs) and takes a due job. Jobs due at different
+ * seconds are taken in the order of their 'fire' dates, jobs due at the
+ * same second (and jobs armed with dates the wheel time has already passed)
+ * in any order. The job stays in the wheel, but is not armed
+ * until 'cron_wheel_rearm' is called for it. Takes constant time
+ * apart from moving the wheel time.
+ * Dates must not decrease between calls: for a date before the wheel time
+ * (the last date passed here, or the earlier 'fire' date of the jobs
+ * due at it) no job is taken.
+ *
+ * @param wheel wheel
+ * @param date current date
+ * @param payload output client data of the job, can be NULL
+ * @param fire_date output 'fire' date of the job, can be NULL
+ * @return due job id, -1 if no job is due.
+ */
+int cron_wheel_pop_due(cron_wheel* wheel, time_t date, void** payload, time_t* fire_date);
+
+/**
+ * Arms the job again with the next 'fire' date of its expression after the
+ * specified date (usually the 'fire' date returned from 'cron_wheel_pop_due').
+ * If the job is already armed its 'fire' date is replaced.
+ *
+ * @param wheel wheel
+ * @param job job id
+ * @param date date to calculate the next 'fire' date from
+ * @return 0 in case of success, -1 if there is no such job or its
+ *         expression does not fire anymore (the job is left not armed).
+ */
+int cron_wheel_rearm(cron_wheel* wheel, int job, time_t date);
+
+/**
+ * Frees the wheel, expressions of the jobs are not freed.
+ *
+ * @param wheel wheel to free
+ */
+void cron_wheel_free(cron_wheel* wheel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* CCRONEXPR_WHEEL_H */